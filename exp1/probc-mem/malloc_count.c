@@ -32,6 +32,10 @@
 #include <stdio.h>
 #include <locale.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include "malloc_count.h"
 
@@ -77,6 +81,84 @@ static long long peak = 0, curr = 0, total = 0;
 static malloc_count_callback_type callback = NULL;
 static void* callback_cookie = NULL;
 
+/*****************************************************/
+/* statistics shared between all processes of a run */
+/*****************************************************/
+
+#define MAX_OBSERVES 4096
+
+struct shared_table {
+    long long live, peak_live;
+    int num_processes, max_processes;
+    int num_observes;
+    malloc_count_observe_stats observes[MAX_OBSERVES];
+    malloc_count_process processes[];
+};
+
+static struct shared_table* shared = NULL;
+static int row = -1;            /* of this process, -1 if untracked */
+static int observe = 0;         /* this process's current observe */
+
+static double timestamp(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* keep *max at least value; the table is updated by processes concurrently */
+static void update_max(long long* max, long long value)
+{
+    long long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old &&
+           !__atomic_compare_exchange_n(max, &old, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* take a row for this process, and add its heap bytes to the population */
+static void join_population(int parent)
+{
+    int r = __atomic_fetch_add(&shared->num_processes, 1, __ATOMIC_RELAXED);
+    row = (r < shared->max_processes) ? r : -1;
+    if (row >= 0) {
+        malloc_count_process* p = &shared->processes[row];
+        p->pid = getpid();
+        p->parent = parent;
+        p->birth = timestamp();
+        p->death = 0;
+        p->curr = curr;
+        p->peak = peak;
+        p->total = total;
+    }
+    update_max(&shared->peak_live,
+               __atomic_add_fetch(&shared->live, curr, __ATOMIC_RELAXED));
+}
+
+/* pthread_atfork child handler: a new process, which starts out with a copy
+ * of its parent's heap, but has allocated nothing yet itself */
+static void after_fork_child(void)
+{
+    peak = curr;
+    total = 0;
+    join_population(row);
+}
+
+static void shared_count(long long inc, long long allocs)
+{
+    update_max(&shared->peak_live,
+               __atomic_add_fetch(&shared->live, inc, __ATOMIC_RELAXED));
+    if (row >= 0) {
+        malloc_count_process* p = &shared->processes[row];
+        p->curr = curr;
+        p->peak = peak;
+        p->total = total;
+    }
+    if (inc > 0 && observe < MAX_OBSERVES) {
+        __atomic_add_fetch(&shared->observes[observe].bytes, inc, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&shared->observes[observe].allocs, allocs, __ATOMIC_RELAXED);
+    }
+}
+
 /* add allocation to statistics */
 static void inc_count(size_t inc)
 {
@@ -90,6 +172,7 @@ static void inc_count(size_t inc)
     total += inc;
     if (callback) callback(callback_cookie, curr);
 #endif
+    if (shared) shared_count(inc, 1);
 }
 
 /* decrement allocation to statistics */
@@ -102,6 +185,7 @@ static void dec_count(size_t dec)
     curr -= dec;
     if (callback) callback(callback_cookie, curr);
 #endif
+    if (shared) shared_count(-(long long)dec, 0);
 }
 
 /* user function to return the currently allocated amount of memory */
@@ -136,6 +220,72 @@ void malloc_count_set_callback(malloc_count_callback_type cb, void* cookie)
     callback_cookie = cookie;
 }
 
+/* user function to share statistics with forked processes */
+void malloc_count_share(int max_processes)
+{
+    size_t size = sizeof(struct shared_table)
+        + max_processes * sizeof(malloc_count_process);
+    /* rows are only touched (and backed by memory) once processes take them */
+    void* table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror(PPREFIX "mmap");
+        return;
+    }
+    shared = table;
+    shared->max_processes = max_processes;
+    shared->observes[0].start = timestamp();
+    shared->num_observes = 1;
+    join_population(-1);
+    pthread_atfork(NULL, NULL, after_fork_child);
+}
+
+extern size_t malloc_count_population_current(void)
+{
+    return shared ? __atomic_load_n(&shared->live, __ATOMIC_RELAXED) : curr;
+}
+
+extern size_t malloc_count_population_peak(void)
+{
+    return shared ? __atomic_load_n(&shared->peak_live, __ATOMIC_RELAXED) : peak;
+}
+
+extern void malloc_count_observe(int index)
+{
+    observe = index;
+    if (!shared || index >= MAX_OBSERVES) return;
+    /* the first process to arrive marks the start of the observe */
+    double zero = 0, now = timestamp();
+    __atomic_compare_exchange(&shared->observes[index].start, &zero, &now, 0,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    int num = __atomic_load_n(&shared->num_observes, __ATOMIC_RELAXED);
+    while (index + 1 > num &&
+           !__atomic_compare_exchange_n(&shared->num_observes, &num, index + 1,
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+extern void malloc_count_exit(void)
+{
+    if (!shared) return;
+    __atomic_sub_fetch(&shared->live, curr, __ATOMIC_RELAXED);
+    if (row >= 0) shared->processes[row].death = timestamp();
+}
+
+extern const malloc_count_process* malloc_count_processes(int* count)
+{
+    if (!shared) { *count = 0; return NULL; }
+    *count = shared->num_processes < shared->max_processes
+        ? shared->num_processes : shared->max_processes;
+    return shared->processes;
+}
+
+extern const malloc_count_observe_stats* malloc_count_observes(int* count)
+{
+    if (!shared) { *count = 0; return NULL; }
+    *count = shared->num_observes;
+    return shared->observes;
+}
+
 /****************************************************/
 /* exported symbols that overlay the libc functions */
 /****************************************************/
@@ -56,6 +56,42 @@ extern void malloc_count_set_callback(malloc_count_callback_type cb,
 /* user function which prints current and peak allocation to stderr */
 extern void malloc_count_print_status(void);
 
+/* fork-tree-aware statistics: move the counters of this process, and of every
+ * process it forks from now on, into a table in shared memory. Each process
+ * gets a row (up to max_processes) recording its pid, its parent's row, the
+ * times of its birth and death, and its own heap usage; the table also keeps
+ * the heap bytes live over all processes, and their peak. */
+extern void malloc_count_share(int max_processes);
+
+/* heap bytes currently allocated by all living processes, and their peak */
+extern size_t malloc_count_population_current(void);
+extern size_t malloc_count_population_peak(void);
+
+/* a forking program can mark its progress through synchronizing observes;
+ * allocations are then also counted per observe */
+extern void malloc_count_observe(int observe);
+
+/* called by a process sharing statistics just before it _exit()s: record its
+ * death, and retire its heap bytes from the population */
+extern void malloc_count_exit(void);
+
+/* one row per process, and per observe, as recorded in the shared table */
+typedef struct {
+    int pid;
+    int parent;                 /* row of the parent process, -1 for the first */
+    double birth, death;        /* timestamps; death is 0 while alive */
+    long long curr, peak, total;
+} malloc_count_process;
+
+typedef struct {
+    double start;               /* when the first process reached the observe */
+    long long bytes, allocs;    /* allocated by all processes while there */
+} malloc_count_observe_stats;
+
+/* the shared table, or NULL/0 if malloc_count_share was not called */
+extern const malloc_count_process* malloc_count_processes(int* count);
+extern const malloc_count_observe_stats* malloc_count_observes(int* count);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,33 @@
+/******************************************************************************
+ * memprofile.cpp
+ *
+ * C interface to a population MemProfile, for the (C) inference engines.
+ *
+ ******************************************************************************/
+
+#include <new>
+
+#include "memprofile.h"
+
+// Static storage, so that neither operator new nor libstdc++ is needed
+static union {
+    char bytes[sizeof(MemProfile)];
+    double align;
+} storage;
+static MemProfile* profile = NULL;
+
+extern "C" void memprofile_population_start(const char* filepath,
+                                            double time_resolution)
+{
+    malloc_count_share(1 << 20);
+    profile = new (&storage) MemProfile(filepath, time_resolution, 0, NULL, true);
+}
+
+extern "C" void memprofile_population_stop(void)
+{
+    if (!profile) return;
+    profile->~MemProfile();
+    profile = NULL;
+}
+
+/*****************************************************************************/
@@ -25,9 +25,24 @@
 
 #include <stdio.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "malloc_count.h"
 
+#ifdef __cplusplus
+extern "C" { /* for use from C programs */
+#endif
+
+/* write a population memory profile (see MemProfile) of this process and all
+ * the processes it forks, to filepath; stop writes the summary tables */
+extern void memprofile_population_start(const char* filepath,
+                                        double time_resolution);
+extern void memprofile_population_stop(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+
 /**
  * MemProfile is a class which hooks into malloc_count's callback and writes a
  * heap usage profile at run-time.
@@ -66,6 +81,13 @@ protected:
     /// maximum memory usage to previous log output
     size_t      m_max;
 
+    /// population mode: heap usage over a whole tree of forked processes
+    bool        m_population;
+    /// thread sampling the population's heap usage
+    pthread_t   m_sampler;
+    /// cleared to stop the sampler
+    volatile bool m_sampling;
+
 protected:
 
     /// template function missing in cmath, absolute difference
@@ -128,6 +150,49 @@ protected:
         return static_cast<MemProfile*>(cookie)->callback(memcurr);
     }
 
+    /// population mode: output the live heap bytes of all processes every
+    /// m_time_resolution seconds (their peak in between is not seen here,
+    /// but is written in the summary)
+    static void* sampler(void* cookie)
+    {
+        MemProfile* profile = static_cast<MemProfile*>(cookie);
+        while (profile->m_sampling) {
+            profile->output(timestamp(), malloc_count_population_current());
+            usleep((useconds_t)(profile->m_time_resolution * 1e6));
+        }
+        return NULL;
+    }
+
+    /// population mode: summary of peak usage, processes and observes, as
+    /// gnuplot comments after the time series
+    void write_summary()
+    {
+        fprintf(m_file, "# peak %llu\n",
+                (unsigned long long)malloc_count_population_peak());
+
+        int count;
+        const malloc_count_process* processes = malloc_count_processes(&count);
+        fprintf(m_file, "# process pid parent birth death peak total\n");
+        for (int i = 0; i < count; ++i) {
+            const malloc_count_process& p = processes[i];
+            fprintf(m_file, "# process %d %d %g %g %lld %lld\n",
+                    p.pid, p.parent, p.birth - m_base_ts,
+                    p.death > 0 ? p.death - m_base_ts : -1.0, p.peak, p.total);
+        }
+
+        const malloc_count_observe_stats* observes = malloc_count_observes(&count);
+        fprintf(m_file, "# observe index start bytes allocs bytes_per_s\n");
+        for (int i = 0; i < count; ++i) {
+            const malloc_count_observe_stats& o = observes[i];
+            if (o.start == 0) continue;
+            double end = (i + 1 < count && observes[i+1].start > 0)
+                ? observes[i+1].start : timestamp();
+            fprintf(m_file, "# observe %d %g %lld %lld %g\n",
+                    i, o.start - m_base_ts, o.bytes, o.allocs,
+                    end > o.start ? o.bytes / (end - o.start) : 0.0);
+        }
+    }
+
 public:
 
     /** Constructor for MemProfile.
@@ -135,28 +200,49 @@ public:
      * @param time_resolution   resolution when a log entry is always written.
      * @param size_resolution   resolution when a log entry is always written.
      * @param funcname          enables multi-function output, appends to file.
+     * @param population        profile this process and every process it
+     *                          forks from now on (see malloc_count_share),
+     *                          sampling every time_resolution seconds.
      */
     MemProfile(const char* filepath,
                double time_resolution = 0.1, size_t size_resolution = 1024,
-               const char* funcname = NULL)
+               const char* funcname = NULL, bool population = false)
         : m_time_resolution( time_resolution ),
           m_size_resolution( size_resolution ),
           m_funcname( funcname ),
           m_base_ts( timestamp() ),
-          m_base_mem( malloc_count_current() ),
+          m_base_mem( population ? 0 : malloc_count_current() ),
           m_prev_ts( 0 ),
           m_prev_mem( 0 ),
-          m_max( 0 )
+          m_max( 0 ),
+          m_population( population ),
+          m_sampling( population )
     {
         char stack;
         m_stack_base = &stack;
         m_file = fopen(filepath, funcname ? "a" : "w");
-        malloc_count_set_callback(MemProfile::static_callback, this);
+        if (m_population) {
+            // forked processes inherit the FILE: leave nothing buffered for
+            // them to write out again
+            setvbuf(m_file, NULL, _IONBF, 0);
+            pthread_create(&m_sampler, NULL, MemProfile::sampler, this);
+        }
+        else {
+            malloc_count_set_callback(MemProfile::static_callback, this);
+        }
     }
 
     /// Destructor flushes currently aggregated values and closes the file.
     ~MemProfile()
     {
+        if (m_population) {
+            m_sampling = false;
+            pthread_join(m_sampler, NULL);
+            output(timestamp(), malloc_count_population_current());
+            write_summary();
+            fclose(m_file);
+            return;
+        }
         m_prev_ts = 0; // force flush
         m_prev_mem = 0;
         callback( malloc_count_current() );
@@ -165,6 +251,8 @@ public:
     }
 };
 
+#endif // __cplusplus
+
 #endif // _MEM_PROFILE_H_
 
 /*****************************************************************************/
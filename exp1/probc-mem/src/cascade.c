@@ -18,6 +18,7 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "malloc_count.h"
 
 #define min(a, b) ((a < b) ? (a) : (b))
 #define max(a, b) ((a > b) ? (a) : (b))
@@ -124,6 +125,7 @@ void destroy_particle() {
     pthread_cond_signal(&globals->execution_leaf_node_cond);
     pthread_mutex_unlock(&globals->execution_leaf_node_mutex);
 
+    malloc_count_exit();
     _exit(0);
 }
 
@@ -257,6 +259,7 @@ void weight_trace(const double ln_p, const bool synchronize) {
     // debug_print(1, "[observe %d] outgoing weight: %f\n", locals->current_observe, new_log_weight);
 
     locals->current_observe += 1;
+    malloc_count_observe(locals->current_observe);
     locals->log_weight = new_log_weight;
     locals->log_weight_increment = 0;
 
@@ -16,12 +16,19 @@
 
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "memprofile.h"
 
 
 
 // Name of file pointer for shared memory object
 static char SHM_FILE[256];
 
+// With --mem_profile=path, write a population memory profile there
+static const char *MEM_PROFILE_PATH = NULL;
+
+// Seconds between samples of the population's heap usage
+#define MEM_PROFILE_RESOLUTION 0.01
+
 
 
 
@@ -195,6 +202,21 @@ void *shared_memory_alloc(int mem_size) {
  */
 int program_execution_wrapper(int argc, char **argv) {
 
+    // Take out --mem_profile=path (before any "--"), so engines never see it
+    int kept = 1;
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "--") == 0) {
+            while (argi < argc) argv[kept++] = argv[argi++];
+            break;
+        } else if (strncmp(argv[argi], "--mem_profile=", 14) == 0) {
+            MEM_PROFILE_PATH = argv[argi] + 14;
+        } else {
+            argv[kept++] = argv[argi];
+        }
+    }
+    argv[kept] = NULL;
+    argc = kept;
+
     parse_args(argc, argv);
 
     char *fixed_argv[argc];
@@ -228,6 +250,11 @@ int program_execution_wrapper(int argc, char **argv) {
     // TODO NOTE shouldn't have to unlink this, except after a crash.
     shm_unlink(SHM_FILE);
 
+    // Heap usage summed over all particle processes (see memprofile.h)
+    if (MEM_PROFILE_PATH != NULL) memprofile_population_start(MEM_PROFILE_PATH, MEM_PROFILE_RESOLUTION);
+
+    int status = infer(&__program, argc, argv);
 
-    return infer(&__program, argc, argv);
+    memprofile_population_stop();
+    return status;
 }
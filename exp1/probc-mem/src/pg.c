@@ -17,6 +17,7 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "malloc_count.h"
 
 
 // Set defaults for number of particles and iterations
@@ -220,6 +221,7 @@ void destroy_particle() {
     assert(locals->live_offspring_count == 0);
     free(locals->pid_trace);
     utstring_free(locals->predict);
+    malloc_count_exit();
     _exit(0);
 }
 
@@ -450,6 +452,7 @@ void weight_trace(const double ln_p, const bool synchronize) {
  		    locals->log_weight += ln_p;
  		    return;
  		}
+        malloc_count_observe(locals->current_observe + 1);
 
 		// We want to branch and resample on every synchronizing observe
  		pthread_mutex_lock(&(globals->begin_observe_mutex));
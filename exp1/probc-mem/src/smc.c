@@ -17,6 +17,7 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "malloc_count.h"
 
 
 // Set defaults for number of particles 
@@ -187,6 +188,7 @@ void residual_resample() {
 void destroy_particle() {
     assert(locals->live_offspring_count == 0);
     utstring_free(locals->predict);
+    malloc_count_exit();
     _exit(0);
 }
 
@@ -234,6 +236,7 @@ void weight_trace(const double ln_p, const bool synchronize) {
     globals->begin_observe_counter += 1;
     debug_print(3, "Incrementing observe counter %d to one higher than global observe counter %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid()); 
     locals->current_observe += 1;
+    malloc_count_observe(locals->current_observe);
 
     debug_print(4,"[OBSERVE %d, %d] #%d, %0.4f\n", locals->current_observe, getpid(), globals->begin_observe_counter, ln_p);
 
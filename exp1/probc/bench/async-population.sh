@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# Check: the population of asynchronous SMC (smc --async) stays bounded for
+# every --max_lag. Builds the smc engine in a scratch copy of the tree, runs
+# each example at each lag and seed, and reads the population the engine
+# reports on stderr. Writes one CSV row per run:
+#
+#   program,particles,max_lag,seed,min,max,final,result
+#
+# A run fails if any observe has more than 4 * -p particles (the most the
+# population cap in async_resample allows) or the population dies out.
+# Exits with status 1 if any run fails.
+#
+# Usage: bench/async-population.sh [-p particles] [-l "1 2 4 8 16"] [-s "1 2 3"] [-x "hmm big-hmm"]
+#
+
+PARTICLES=100
+LAGS="1 2 4 8 16"
+SEEDS="1 2 3"
+PROGRAMS="hmm big-hmm"
+while getopts "p:l:s:x:" opt; do
+    case $opt in
+        p) PARTICLES="$OPTARG" ;;
+        l) LAGS="$OPTARG" ;;
+        s) SEEDS="$OPTARG" ;;
+        x) PROGRAMS="$OPTARG" ;;
+        *) echo "usage: $0 [-p particles] [-l \"1 2 4\"] [-s \"1 2 3\"] [-x \"hmm big-hmm\"]" >&2; exit 1 ;;
+    esac
+done
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+cp -r "$SRC" "$SCRATCH/smc"
+(cd "$SCRATCH/smc" && make clean && make ENGINE=smc VERBOSITY=0 $PROGRAMS) >/dev/null 2>&1 || {
+    echo "build failed for ENGINE=smc" >&2
+    exit 1
+}
+
+status=0
+echo "program,particles,max_lag,seed,min,max,final,result"
+for program in $PROGRAMS; do
+    for lag in $LAGS; do
+        for seed in $SEEDS; do
+            # async population (max lag L): min A, max B over T observes, F at the end
+            read -r smallest largest final < <("$SCRATCH/smc/bin/$program" -p $PARTICLES --max_lag $lag -r $seed 2>&1 >/dev/null \
+                | sed -n 's/^async population.*: min \([0-9]*\), max \([0-9]*\) over .*, \([0-9]*\) at the end$/\1 \2 \3/p')
+            result=ok
+            if [ -z "$largest" ]; then
+                result=FAIL-no-report
+            elif [ "$largest" -gt $((4 * PARTICLES)) ]; then
+                result=FAIL-exploded
+            elif [ "$smallest" -eq 0 ] || [ "$final" -eq 0 ]; then
+                result=FAIL-died
+            fi
+            [ "$result" = ok ] || status=1
+            echo "$program,$PARTICLES,$lag,$seed,${smallest:-NA},${largest:-NA},${final:-NA},$result"
+        done
+    done
+done
+exit $status
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "barrier.h"
+
+/**
+ *
+ * Microbenchmark: latency of one observe barrier round across P processes.
+ *
+ * Compares the pthread mutex/cond barrier the engines used originally against
+ * the futex-based shared_barrier, flat and with a combining tree, and writes
+ * one CSV row per (primitive, process count):
+ *
+ *   primitive,processes,rounds,ns_per_round
+ *
+ * Usage: barrier-latency [--processes 1,2,4,...] [--rounds R] [--fanout K]
+ *
+ */
+
+#define MAX_PROCESS_COUNTS 64
+
+typedef struct {
+    // Original implementation: counter + generation under a shared mutex
+    int counter;
+    int generation;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    shared_barrier barrier;
+} bench_state;
+
+static bench_state *state;
+
+
+static void mutex_barrier(int participants) {
+    pthread_mutex_lock(&state->mutex);
+    int generation = state->generation;
+    if (++state->counter == participants) {
+        state->counter = 0;
+        state->generation++;
+        pthread_cond_broadcast(&state->cond);
+    } else {
+        while (generation == state->generation) {
+            pthread_cond_wait(&state->cond, &state->mutex);
+        }
+    }
+    pthread_mutex_unlock(&state->mutex);
+}
+
+static void futex_barrier(int slot, int participants) {
+    int sense;
+    if (shared_barrier_arrive(&state->barrier, slot, participants, &sense)) {
+        shared_barrier_release(&state->barrier);
+    } else {
+        shared_barrier_wait(&state->barrier, sense);
+    }
+}
+
+
+/**
+ * Fork P workers which each pass through the barrier R times;
+ * returns mean wall clock nanoseconds per round.
+ *
+ */
+static double run(const char *primitive, int processes, int rounds, int fanout) {
+    state->counter = 0;
+    state->generation = 0;
+    shared_barrier_init(&state->barrier, processes, fanout);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int slot=0; slot<processes; slot++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool use_mutex = (strcmp(primitive, "mutex") == 0);
+            for (int r=0; r<rounds; r++) {
+                if (use_mutex) {
+                    mutex_barrier(processes);
+                } else {
+                    futex_barrier(slot, processes);
+                }
+            }
+            _exit(0);
+        } else if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+    }
+    for (int slot=0; slot<processes; slot++) {
+        wait(NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    double elapsed_ns = (end.tv_sec - start.tv_sec)*1e9 + (end.tv_usec - start.tv_usec)*1e3;
+    return elapsed_ns / rounds;
+}
+
+
+int main(int argc, char **argv) {
+    int process_counts[MAX_PROCESS_COUNTS] = { 1, 2, 4, 8, 16, 32, 64 };
+    int num_process_counts = 7;
+    int rounds = 10000;
+    int fanout = 4;
+
+    static struct option long_options[] = {
+        {"processes", required_argument, 0, 'p'},
+        {"rounds", required_argument, 0, 'r'},
+        {"fanout", required_argument, 0, 'k'},
+        {0, 0, 0, 0}
+    };
+    int c, option_index;
+    while((c = getopt_long(argc, argv, "p:r:k:", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'p':
+                num_process_counts = 0;
+                for (char *token = strtok(optarg, ","); token != NULL && num_process_counts < MAX_PROCESS_COUNTS; token = strtok(NULL, ",")) {
+                    process_counts[num_process_counts++] = atoi(token);
+                }
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'k':
+                fanout = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [--processes 1,2,4] [--rounds R] [--fanout K]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    // Standalone (no engine linked): set up the shared state by hand
+    state = mmap(NULL, sizeof(bench_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(MAP_FAILED != state);
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&state->mutex, &mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&state->cond, &cond_attr);
+
+    printf("primitive,processes,rounds,ns_per_round\n");
+    for (int i=0; i<num_process_counts; i++) {
+        int p = process_counts[i];
+        assert(p > 0);
+        printf("mutex,%d,%d,%.1f\n", p, rounds, run("mutex", p, rounds, 0));
+        printf("futex,%d,%d,%.1f\n", p, rounds, run("futex", p, rounds, 0));
+        printf("futex-tree%d,%d,%d,%.1f\n", fanout, p, rounds, run("futex-tree", p, rounds, fanout));
+        fflush(stdout);
+    }
+    return 0;
+}
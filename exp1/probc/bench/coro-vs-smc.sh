@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# Benchmark: wall clock time of the fork-based smc engine against the
+# stack-copying coroutine engine (coro), on the same examples and
+# particle counts. Each engine is built in a scratch copy of the tree.
+# Writes one CSV row per run, using the engines' own --timeit output:
+#
+#   engine,program,particles,repeat,seconds
+#
+# Usage: bench/coro-vs-smc.sh [-p "100 1000 10000"] [-n repeats] [-x "hmm big-hmm"]
+#
+
+PARTICLES="100 1000 10000"
+REPEATS=3
+PROGRAMS="hmm big-hmm gaussian-unknown-mean linear-gaussian"
+while getopts "p:n:x:" opt; do
+    case $opt in
+        p) PARTICLES="$OPTARG" ;;
+        n) REPEATS="$OPTARG" ;;
+        x) PROGRAMS="$OPTARG" ;;
+        *) echo "usage: $0 [-p \"100 1000\"] [-n repeats] [-x \"hmm big-hmm\"]" >&2; exit 1 ;;
+    esac
+done
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+echo "engine,program,particles,repeat,seconds"
+for engine in smc coro; do
+    cp -r "$SRC" "$SCRATCH/$engine"
+    (cd "$SCRATCH/$engine" && make clean && make ENGINE=$engine VERBOSITY=0 $PROGRAMS) >/dev/null 2>&1 || {
+        echo "build failed for ENGINE=$engine" >&2
+        exit 1
+    }
+    for program in $PROGRAMS; do
+        for p in $PARTICLES; do
+            for r in $(seq 1 $REPEATS); do
+                seconds=$("$SCRATCH/$engine/bin/$program" -p $p -t 2>/dev/null | grep '^time_elapsed' | cut -d, -f2)
+                echo "$engine,$program,$p,$r,${seconds:-NA}"
+            done
+        done
+    done
+done
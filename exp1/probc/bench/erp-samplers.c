@@ -0,0 +1,395 @@
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "distributions.h"
+#include "erp.h"
+
+/**
+ *
+ * Checks and times the scalar samplers in erp.c (ziggurat normal and
+ * exponential, Marsaglia-Tsang gamma, beta from gamma) against randomkit's.
+ *
+ * For each distribution, draws N samples through erp.h and checks their mean
+ * and variance (within 5 standard errors) and their Kolmogorov-Smirnov
+ * distance to the exact CDF (at the 0.1% level); then times N draws through
+ * erp.h and through the randomkit function it replaced. One CSV row each:
+ *
+ *   distribution,samples,mean,expected_mean,variance,expected_variance,ks_d,ks_critical,erp_ns,randomkit_ns,result
+ *
+ * Then does the same for the precomputed categorical samplers (the alias
+ * table and the sparse row), against discrete_rng: N draws are checked by a chi-square test of their frequencies
+ * (at the 0.1% level, merging neighbouring entries until each bin expects at
+ * least 5 draws), and the share of them which landed in the sparse tail
+ * against its mass (within 5 standard errors); the cached log-probabilities
+ * are compared to the exact ones. One CSV row each:
+ *
+ *   categorical,samples,K,bins,tail_frequency,expected_tail_frequency,chi2,chi2_critical,erp_ns,discrete_ns,result
+ *
+ * Exits with status 1 if any check fails.
+ *
+ * Usage: erp-samplers [--samples N] [--seed S] [--rng=philox]
+ *
+ */
+
+// Floor for the denominators in the modified Lentz method
+#define LENTZ_TINY 1e-300
+
+// Categorical checks: entries, share of the mass left to the sparse tail, and
+// draws timed through discrete_rng (which takes O(K) per draw)
+#define CATEGORICAL_K 1000
+#define TAIL_MASS 0.05
+#define DISCRETE_TIMED_DRAWS 100000
+
+typedef struct {
+    const char *name;
+    int num_params;
+    double a, b;
+    double (*draw)(double a, double b);                 // through erp.h
+    double (*randomkit)(rk_state *state, double a, double b);
+    double (*cdf)(double x, double a, double b);
+    double mean, variance;
+} distribution;
+
+
+// Regularized lower incomplete gamma function P(s, x) (Numerical Recipes 6.2)
+static double gamma_p(double s, double x) {
+    if (x <= 0) return 0;
+    const double log_prefix = s*log(x) - x - lgamma(s);
+    if (x < s + 1) {
+        double term = 1/s, sum = term;
+        for (int n=1; n<1000 && fabs(term) > fabs(sum)*1e-15; n++) {
+            term *= x / (s + n);
+            sum += term;
+        }
+        return sum * exp(log_prefix);
+    }
+    // Continued fraction for Q(s, x), by the modified Lentz method
+    double b = x + 1 - s, c = 1/LENTZ_TINY, d = 1/b, h = d;
+    for (int n=1; n<1000; n++) {
+        const double an = -n*(n - s);
+        b += 2;
+        d = an*d + b;
+        if (fabs(d) < LENTZ_TINY) d = LENTZ_TINY;
+        c = b + an/c;
+        if (fabs(c) < LENTZ_TINY) c = LENTZ_TINY;
+        d = 1/d;
+        h *= d*c;
+        if (fabs(d*c - 1) < 1e-15) break;
+    }
+    return 1 - exp(log_prefix) * h;
+}
+
+// Continued fraction for the incomplete beta function (Numerical Recipes 6.4)
+static double beta_continued_fraction(double x, double a, double b) {
+    double c = 1, d = 1 - (a + b)*x/(a + 1);
+    if (fabs(d) < LENTZ_TINY) d = LENTZ_TINY;
+    d = 1/d;
+    double h = d;
+    for (int m=1; m<1000; m++) {
+        double an = m*(b - m)*x / ((a + 2*m - 1)*(a + 2*m));
+        d = 1 + an*d;
+        if (fabs(d) < LENTZ_TINY) d = LENTZ_TINY;
+        c = 1 + an/c;
+        if (fabs(c) < LENTZ_TINY) c = LENTZ_TINY;
+        d = 1/d;
+        h *= d*c;
+        an = -(a + m)*(a + b + m)*x / ((a + 2*m)*(a + 2*m + 1));
+        d = 1 + an*d;
+        if (fabs(d) < LENTZ_TINY) d = LENTZ_TINY;
+        c = 1 + an/c;
+        if (fabs(c) < LENTZ_TINY) c = LENTZ_TINY;
+        d = 1/d;
+        h *= d*c;
+        if (fabs(d*c - 1) < 1e-15) break;
+    }
+    return h;
+}
+
+// Regularized incomplete beta function I_x(a, b)
+static double beta_i(double x, double a, double b) {
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    const double log_prefix = lgamma(a + b) - lgamma(a) - lgamma(b) + a*log(x) + b*log(1 - x);
+    if (x < (a + 1)/(a + b + 2)) {
+        return exp(log_prefix) * beta_continued_fraction(x, a, b) / a;
+    }
+    return 1 - exp(log_prefix) * beta_continued_fraction(1 - x, b, a) / b;
+}
+
+
+static double draw_normal(double a, double b) { return normal_rng(a, b); }
+static double draw_exponential(double a, double b) { return exponential_rng(a); }
+static double draw_gamma(double a, double b) { return gamma_rng(a, b); }
+static double draw_beta(double a, double b) { return beta_rng(a, b); }
+
+static double randomkit_normal(rk_state *state, double a, double b) { return rk_normal(state, a, sqrt(b)); }
+static double randomkit_exponential(rk_state *state, double a, double b) { return rk_standard_exponential(state) / a; }
+static double randomkit_gamma(rk_state *state, double a, double b) { return rk_standard_gamma(state, a) / b; }
+static double randomkit_beta(rk_state *state, double a, double b) { return rk_beta(state, a, b); }
+
+static double cdf_normal(double x, double a, double b) { return 0.5*erfc(-(x - a)/sqrt(2*b)); }
+static double cdf_exponential(double x, double a, double b) { return (x <= 0) ? 0 : 1 - exp(-a*x); }
+static double cdf_gamma(double x, double a, double b) { return gamma_p(a, b*x); }
+static double cdf_beta(double x, double a, double b) { return beta_i(x, a, b); }
+
+#define NORMAL(m, v) { "normal", 2, m, v, draw_normal, randomkit_normal, cdf_normal, m, v }
+#define EXPONENTIAL(r) { "exponential", 1, r, 0, draw_exponential, randomkit_exponential, cdf_exponential, 1/(r), 1/((r)*(r)) }
+#define GAMMA(s, r) { "gamma", 2, s, r, draw_gamma, randomkit_gamma, cdf_gamma, (s)/(r), (s)/((r)*(r)) }
+#define BETA(a, b) { "beta", 2, a, b, draw_beta, randomkit_beta, cdf_beta, (a)/((a)+(b)), (a)*(b)/(((a)+(b))*((a)+(b))*((a)+(b)+1)) }
+
+static const distribution distributions[] = {
+    NORMAL(0.0, 1.0), NORMAL(-3.0, 0.25),
+    EXPONENTIAL(1.0), EXPONENTIAL(4.0),
+    GAMMA(0.1, 1.0), GAMMA(0.5, 2.0), GAMMA(1.0, 1.0), GAMMA(2.5, 1.0), GAMMA(30.0, 3.0),
+    BETA(0.5, 0.5), BETA(2.0, 5.0), BETA(0.2, 3.0),
+};
+
+
+static int compare_doubles(const void *x, const void *y) {
+    const double a = *(const double *)x, b = *(const double *)y;
+    return (a > b) - (a < b);
+}
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+/**
+ * Check one distribution on n samples, and time it; prints its row and
+ * returns whether it passed
+ *
+ */
+static bool check(const distribution *dist, double *x, int n, rk_state *state) {
+    double sum = 0;
+    for (int i=0; i<n; i++) {
+        x[i] = dist->draw(dist->a, dist->b);
+        sum += x[i];
+    }
+    const double mean = sum / n;
+    double m2 = 0, m4 = 0;
+    for (int i=0; i<n; i++) {
+        const double d2 = (x[i] - mean)*(x[i] - mean);
+        m2 += d2;
+        m4 += d2*d2;
+    }
+    const double variance = m2 / (n - 1);
+    m4 /= n;
+    const bool mean_ok = fabs(mean - dist->mean) < 5*sqrt(dist->variance/n);
+    const bool variance_ok = fabs(variance - dist->variance) < 5*sqrt(fmax(m4 - variance*variance, 0)/n) + 1e-12;
+
+    qsort(x, n, sizeof(double), compare_doubles);
+    double ks_d = 0;
+    for (int i=0; i<n; i++) {
+        const double f = dist->cdf(x[i], dist->a, dist->b);
+        ks_d = fmax(ks_d, fmax(f - (double)i/n, (double)(i + 1)/n - f));
+    }
+    const double ks_critical = 1.949 / sqrt(n);
+    const bool ks_ok = ks_d < ks_critical;
+
+    volatile double sink = 0;
+    double start = seconds();
+    for (int i=0; i<n; i++) sink += dist->draw(dist->a, dist->b);
+    const double erp_ns = (seconds() - start) / n * 1e9;
+    start = seconds();
+    for (int i=0; i<n; i++) sink += dist->randomkit(state, dist->a, dist->b);
+    const double randomkit_ns = (seconds() - start) / n * 1e9;
+
+    const bool ok = mean_ok && variance_ok && ks_ok;
+    char label[64];
+    if (dist->num_params == 1) {
+        snprintf(label, sizeof(label), "%s(%g)", dist->name, dist->a);
+    } else {
+        snprintf(label, sizeof(label), "%s(%g;%g)", dist->name, dist->a, dist->b);
+    }
+    printf("%s,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.1f,%.1f,%s\n",
+           label, n, mean, dist->mean, variance, dist->variance,
+           ks_d, ks_critical, erp_ns, randomkit_ns,
+           ok ? "ok" : (!ks_ok ? "FAIL-ks" : (!mean_ok ? "FAIL-mean" : "FAIL-variance")));
+    fflush(stdout);
+    return ok;
+}
+
+
+/**
+ * A categorical sampler under test: draws and log-probabilities through erp.h
+ *
+ */
+typedef struct {
+    const char *name;
+    const void *dist;
+    unsigned int (*draw)(const void *dist);
+    double (*lnp)(int x, const void *dist);
+} categorical_sampler;
+
+static unsigned int draw_table(const void *dist) { return categorical_rng(dist); }
+static double lnp_table(int x, const void *dist) { return categorical_lnp(x, dist); }
+static unsigned int draw_sparse(const void *dist) { return sparse_categorical_rng(dist); }
+static double lnp_sparse(int x, const void *dist) { return sparse_categorical_lnp(x, dist); }
+
+/**
+ * Check a categorical sampler for p[0..K-1] (unnormalized) on n draws, and time
+ * it; in_tail (or NULL) marks the entries in a sparse tail. Prints its row and
+ * returns whether it passed
+ *
+ */
+static bool check_categorical(const categorical_sampler *sampler, double *p, int K, const bool *in_tail, int n) {
+    double sum = 0;
+    for (int k=0; k<K; k++) sum += p[k];
+    long *counts = calloc(K, sizeof(long));
+    for (int i=0; i<n; i++) counts[sampler->draw(sampler->dist)]++;
+
+    // Chi-square, merging entries (in order) until each bin expects at least 5
+    double chi2 = 0, bin_expected = 0;
+    long bin_observed = 0;
+    int bins = 0;
+    for (int k=0; k<K; k++) {
+        bin_expected += n*p[k]/sum;
+        bin_observed += counts[k];
+        if (bin_expected >= 5 || k == K - 1) {
+            if (bin_expected > 0) {
+                chi2 += (bin_observed - bin_expected)*(bin_observed - bin_expected) / bin_expected;
+                bins++;
+            } else if (bin_observed > 0) {
+                chi2 = INFINITY;
+            }
+            bin_expected = 0;
+            bin_observed = 0;
+        }
+    }
+    // Upper 0.1% point of chi-square with bins - 1 degrees of freedom (Wilson-Hilferty)
+    const double df = (bins > 1) ? bins - 1 : 1;
+    const double chi2_critical = df * pow(1 - 2/(9*df) + 3.090*sqrt(2/(9*df)), 3);
+    const bool chi2_ok = chi2 < chi2_critical;
+
+    long tail_observed = 0;
+    double tail_expected = 0;
+    for (int k=0; k<K && in_tail != NULL; k++) {
+        if (!in_tail[k]) continue;
+        tail_observed += counts[k];
+        tail_expected += p[k]/sum;
+    }
+    const double tail_frequency = (double)tail_observed / n;
+    const bool tail_ok = fabs(tail_frequency - tail_expected) <= 5*sqrt(tail_expected*(1 - tail_expected)/n);
+
+    bool lnp_ok = true;
+    for (int k=0; k<K; k++) {
+        const double exact = (p[k] > 0) ? log(p[k]/sum) : -INFINITY;
+        const double cached = sampler->lnp(k, sampler->dist);
+        if (!(cached == exact || fabs(cached - exact) < 1e-9)) lnp_ok = false;
+    }
+    free(counts);
+
+    volatile unsigned int sink = 0;
+    double start = seconds();
+    for (int i=0; i<n; i++) sink += sampler->draw(sampler->dist);
+    const double erp_ns = (seconds() - start) / n * 1e9;
+    const int discrete_draws = (n < DISCRETE_TIMED_DRAWS) ? n : DISCRETE_TIMED_DRAWS;
+    start = seconds();
+    for (int i=0; i<discrete_draws; i++) sink += discrete_rng(p, K);
+    const double discrete_ns = (seconds() - start) / discrete_draws * 1e9;
+
+    const bool ok = chi2_ok && tail_ok && lnp_ok;
+    printf("%s,%d,%d,%d,%.6f,%.6f,%.3f,%.3f,%.1f,%.1f,%s\n",
+           sampler->name, n, K, bins, tail_frequency, tail_expected,
+           chi2, chi2_critical, erp_ns, discrete_ns,
+           ok ? "ok" : (!chi2_ok ? "FAIL-chi2" : (!tail_ok ? "FAIL-tail" : "FAIL-lnp")));
+    fflush(stdout);
+    return ok;
+}
+
+/**
+ * Alias table over a skewed vector: geometric weights 0.99^k, plus a spike on
+ * the last entry holding about a third of the mass, so most columns are
+ * topped up from a few large ones
+ *
+ */
+static bool check_table(int n) {
+    double *p = malloc(CATEGORICAL_K * sizeof(double));
+    for (int k=0; k<CATEGORICAL_K; k++) p[k] = pow(0.99, k);
+    p[CATEGORICAL_K - 1] = 50;
+    categorical_table table;
+    categorical_table_new(&table, p, CATEGORICAL_K);
+
+    const categorical_sampler sampler = { "table(skewed)", &table, draw_table, lnp_table };
+    const bool ok = check_categorical(&sampler, p, CATEGORICAL_K, NULL, n);
+
+    categorical_table_free(&table);
+    free(p);
+    return ok;
+}
+
+/**
+ * Sparse row: Zipf-like weights 1/(k+1)^1.5, with every seventh entry zero,
+ * so that most entries (and most of the zeros) fall in the tail
+ *
+ */
+static bool check_sparse(int n) {
+    double *p = malloc(CATEGORICAL_K * sizeof(double));
+    for (int k=0; k<CATEGORICAL_K; k++) {
+        p[k] = (k % 7 == 6) ? 0 : pow(k + 1, -1.5);
+    }
+    sparse_categorical dist;
+    sparse_categorical_new(&dist, p, CATEGORICAL_K, TAIL_MASS);
+    bool *in_tail = calloc(CATEGORICAL_K, sizeof(bool));
+    for (int j=0; j<dist.num_tail; j++) in_tail[dist.tail[j]] = true;
+
+    char label[64];
+    snprintf(label, sizeof(label), "sparse(%d head;%d tail)", dist.num_head, dist.num_tail);
+    const categorical_sampler sampler = { label, &dist, draw_sparse, lnp_sparse };
+    const bool ok = check_categorical(&sampler, p, CATEGORICAL_K, in_tail, n);
+
+    sparse_categorical_free(&dist);
+    free(in_tail);
+    free(p);
+    return ok;
+}
+
+
+int main(int argc, char **argv) {
+    argc = erp_rng_start(argc, argv);
+    int samples = 1000000;
+    long seed = 1;
+
+    static struct option long_options[] = {
+        {"samples", required_argument, 0, 'n'},
+        {"seed", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+    int c, option_index;
+    while((c = getopt_long(argc, argv, "n:s:", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'n':
+                samples = atoi(optarg);
+                break;
+            case 's':
+                seed = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [--samples N] [--seed S] [--rng=philox]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    erp_rng_init(seed);
+    rk_state state;
+    rk_seed(seed, &state);
+    double *x = malloc(samples * sizeof(double));
+
+    bool all_ok = true;
+    printf("distribution,samples,mean,expected_mean,variance,expected_variance,ks_d,ks_critical,erp_ns,randomkit_ns,result\n");
+    for (int d=0; d<sizeof(distributions)/sizeof(distributions[0]); d++) {
+        all_ok &= check(&distributions[d], x, samples, &state);
+    }
+    printf("categorical,samples,K,bins,tail_frequency,expected_tail_frequency,chi2,chi2_critical,erp_ns,discrete_ns,result\n");
+    all_ok &= check_table(samples);
+    all_ok &= check_sparse(samples);
+    free(x);
+    return all_ok ? 0 : 1;
+}
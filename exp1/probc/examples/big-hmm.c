@@ -1355,6 +1355,16 @@ static double observations[N] = {         NAN,
 11.22672275,   7.41962631,   8.45635411
 };
 
+// The rows of T, built once before any particle runs. Most entries are tiny
+// (down to 1e-37): those holding the last 1e-9 of each row's mass go in its
+// tail, which is only searched on the rare draws that land there
+static sparse_categorical transition_table[K];
+
+__attribute__((constructor))
+static void build_tables() {
+    sparse_categorical_rows_new(transition_table, &T[0][0], K, K, 1e-9);
+}
+
 int main(int argc, char **argv) {
     double initial_state_dist[K];
     double state_obs_mean[K];
@@ -1365,7 +1375,7 @@ int main(int argc, char **argv) {
 
     int states[N];
     for (int i=0; i<N; i++) {
-        states[i] = (i == 0) ? (int)discrete_rng(initial_state_dist, K) : (int)discrete_rng(T[states[i-1]], K);
+        states[i] = (i == 0) ? (int)discrete_rng(initial_state_dist, K) : (int)sparse_categorical_rng(&transition_table[states[i-1]]);
         if (i > 0) {
             weight_trace(normal_lnp(observations[i], state_obs_mean[states[i]], 4), (i%5) == 0);
         }
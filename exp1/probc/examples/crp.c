@@ -26,6 +26,7 @@ void get_class(int *index, int *class_id) {
 
 int main(int argc, char **argv) {
     double alpha = 1.0;
+    particle_state(&urn, sizeof(urn));
     polya_urn_new(&urn, alpha);
 
     mem_func mem_get_class; 
@@ -8,7 +8,7 @@ int main(int argc, char **argv) {
     observe(normal_lnp(9, mu, var)); 
     observe(normal_lnp(8, mu, var)); 
     
-    predict("mu,%f\n", mu);
+    predict_double("mu", mu);
 
     return 0;
 }
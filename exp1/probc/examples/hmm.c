@@ -19,13 +19,26 @@ static double initial_state[K] = { 1.0/3, 1.0/3, 1.0/3 };
 /* Per-state mean of Gaussian emission distribution */
 static double state_mean[K] = { -1, 1, 0 };
 
+/* Alias tables for the constant distributions above, built once before
+ * any particle runs, and shared by all of them */
+static categorical_table initial_table;
+static categorical_table transition_table[K];
+
+__attribute__((constructor))
+static void build_tables() {
+    categorical_table_new(&initial_table, initial_state, K);
+    for (int k=0; k<K; k++) {
+        categorical_table_new(&transition_table[k], T[k], K);
+    }
+}
+
 /* Generative program for a HMM */
 int main(int argc, char **argv) {
     
     int states[N];
     for (int n=0; n<N; n++) {
-        states[n] = (n==0) ? discrete_rng(initial_state, K) 
-                           : discrete_rng(T[states[n-1]], K);
+        states[n] = (n==0) ? categorical_rng(&initial_table)
+                           : categorical_rng(&transition_table[states[n-1]]);
         if (n > 0) {
             observe(normal_lnp(data[n], 
             		       state_mean[states[n]], 1));
@@ -23,7 +23,7 @@ int main(int argc, char** argv) {
     observe(flip_lnp(1, theta));
 
     // is the coin tricky?
-    predict("is_tricky,%d\n", is_tricky);
+    predict_int("is_tricky", is_tricky);
 
     // what percent of the time does the coin come up heads?
     predict("theta,%0.4f\n", theta);
@@ -149,6 +149,18 @@ rk_seed(unsigned long seed, rk_state *state)
     state->gauss = 0;
     state->has_gauss = 0;
     state->has_binomial = 0;
+    state->counter_based = 0;
+}
+
+void
+rk_seed_counter(unsigned long lineage, rk_state *state)
+{
+    state->counter_based = 1;
+    state->lineage = lineage;
+    state->counter = 0;
+    state->block_pos = 4;
+    state->has_gauss = 0;
+    state->has_binomial = 0;
 }
 
 /* Thomas Wang 32 bits integer hash function */
@@ -207,12 +219,69 @@ rk_randomseed(rk_state *state)
 #define UPPER_MASK 0x80000000UL
 #define LOWER_MASK 0x7fffffffUL
 
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+ * 3", SC 2011), as in Random123 */
+#define PHILOX_M0 0xD2511F53UL
+#define PHILOX_M1 0xCD9E8D57UL
+#define PHILOX_W0 0x9E3779B9UL
+#define PHILOX_W1 0xBB67AE85UL
+
+static void
+rk_philox(const unsigned long ctr_in[4], const unsigned long key_in[2],
+          unsigned long out[4])
+{
+    uint32_t c0 = ctr_in[0], c1 = ctr_in[1], c2 = ctr_in[2], c3 = ctr_in[3];
+    uint32_t k0 = key_in[0], k1 = key_in[1];
+    int round;
+
+    for (round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/* Fixed key: streams are told apart by the lineage in the counter */
+static const unsigned long rk_counter_key[2] = { 0x243F6A88UL, 0x85A308D3UL };
+
+/* Next block of four 32-bit draws, and one step of the draw counter */
+static void
+rk_counter_refill(rk_state *state)
+{
+    const unsigned long *key = rk_counter_key;
+    unsigned long ctr[4];
+
+    ctr[0] = state->counter & 0xffffffffUL;
+    ctr[1] = (state->counter >> 16) >> 16;
+    ctr[2] = state->lineage & 0xffffffffUL;
+    ctr[3] = (state->lineage >> 16) >> 16;
+    rk_philox(ctr, key, state->block);
+    state->counter++;
+    state->block_pos = 0;
+}
+
 /* Slightly optimised reference implementation of the Mersenne Twister */
 unsigned long
 rk_random(rk_state *state)
 {
     unsigned long y;
 
+    if (state->counter_based) {
+        if (state->block_pos == 4) {
+            rk_counter_refill(state);
+        }
+        return state->block[state->block_pos++];
+    }
+
     if (state->pos == RK_STATE_LEN) {
         int i;
 
@@ -240,6 +309,76 @@ rk_random(rk_state *state)
     return y;
 }
 
+/* Philox blocks computed side by side, one lane per block, so that the
+ * compiler can vectorize the rounds; also compiled for AVX-512 and AVX2 */
+#define RK_LANES 8
+
+#if defined(__x86_64__) && defined(__linux__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+static void
+rk_counter_fill(uint32_t *out, size_t blocks, rk_state *state)
+{
+    uint32_t c0[RK_LANES], c1[RK_LANES], c2[RK_LANES], c3[RK_LANES];
+    const uint32_t lineage_lo = state->lineage & 0xffffffffUL;
+    const uint32_t lineage_hi = (state->lineage >> 16) >> 16;
+    size_t done, lanes;
+    int lane, round;
+
+    for (done = 0; done < blocks; done += lanes) {
+        lanes = (blocks - done < RK_LANES) ? blocks - done : RK_LANES;
+        uint32_t k0 = rk_counter_key[0], k1 = rk_counter_key[1];
+        for (lane = 0; lane < RK_LANES; lane++) {
+            unsigned long counter = state->counter + lane;
+            c0[lane] = counter & 0xffffffffUL;
+            c1[lane] = (counter >> 16) >> 16;
+            c2[lane] = lineage_lo;
+            c3[lane] = lineage_hi;
+        }
+        for (round = 0; round < 10; round++) {
+            for (lane = 0; lane < RK_LANES; lane++) {
+                uint64_t p0 = (uint64_t)PHILOX_M0 * c0[lane];
+                uint64_t p1 = (uint64_t)PHILOX_M1 * c2[lane];
+                c0[lane] = (uint32_t)(p1 >> 32) ^ c1[lane] ^ k0;
+                c2[lane] = (uint32_t)(p0 >> 32) ^ c3[lane] ^ k1;
+                c1[lane] = (uint32_t)p1;
+                c3[lane] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        for (lane = 0; lane < (int)lanes; lane++) {
+            out[4*(done + lane)] = c0[lane];
+            out[4*(done + lane) + 1] = c1[lane];
+            out[4*(done + lane) + 2] = c2[lane];
+            out[4*(done + lane) + 3] = c3[lane];
+        }
+        state->counter += lanes;
+    }
+}
+
+void
+rk_random_n(uint32_t *out, size_t n, rk_state *state)
+{
+    size_t i = 0;
+
+    if (!state->counter_based) {
+        for (i = 0; i < n; i++) {
+            out[i] = rk_random(state);
+        }
+        return;
+    }
+    /* What is left of the current block, whole blocks, then the rest */
+    while (i < n && state->block_pos < 4) {
+        out[i++] = state->block[state->block_pos++];
+    }
+    rk_counter_fill(out + i, (n - i) / 4, state);
+    i += (n - i) / 4 * 4;
+    while (i < n) {
+        out[i++] = rk_random(state);
+    }
+}
+
 long
 rk_long(rk_state *state)
 {
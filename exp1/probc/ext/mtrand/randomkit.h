@@ -57,6 +57,7 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifndef _RANDOMKIT_
 #define _RANDOMKIT_
@@ -94,6 +95,15 @@ typedef struct rk_state_
     double p3;
     double p4;
 
+    /* Counter-based mode (see rk_seed_counter): the stream is Philox4x32-10
+     * of (draw counter, lineage) under a fixed key, so seeding writes these
+     * few fields instead of the 624-word key above. */
+    int counter_based;
+    int block_pos;
+    unsigned long lineage;
+    unsigned long counter;
+    unsigned long block[4];
+
 }
 rk_state;
 
@@ -118,6 +128,13 @@ extern "C" {
  */
 extern void rk_seed(unsigned long seed, rk_state *state);
 
+/*
+ * Initialize the RNG state as a counter-based stream: draws are Philox4x32-10
+ * blocks of (draw counter, lineage), so seeding is O(1), and any two lineages
+ * give independent streams.
+ */
+extern void rk_seed_counter(unsigned long lineage, rk_state *state);
+
 /*
  * Initialize the RNG state using a random seed.
  * Uses /dev/random or, when unavailable, the clock (see randomkit.c).
@@ -133,6 +150,12 @@ extern rk_error rk_randomseed(rk_state *state);
  */
 extern unsigned long rk_random(rk_state *state);
 
+/*
+ * Fills out with n values of rk_random, i.e. the next n draws of the stream.
+ * In counter-based mode, whole Philox blocks are computed several at a time.
+ */
+extern void rk_random_n(uint32_t *out, size_t n, rk_state *state);
+
 /*
  * Returns a random long between 0 and LONG_MAX inclusive
  */
@@ -1,11 +1,8 @@
 #!/bin/bash
-echo "total" > total.txt
+rm -f total.txt
 
 for i in `seq 1 1`;
 do
   pkill -Kill -f big-hmm
-  bin/big-hmm -p 25 >> total.txt
-  echo "" >> total.txt
-
-  mv fork.csv fork$i.csv
+  bin/big-hmm -p 25 --stats_file total.txt --profile=profile$i.json > /dev/null
 done
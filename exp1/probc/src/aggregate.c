@@ -0,0 +1,194 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "engine-shared.h"
+#include "aggregate.h"
+
+
+static bool enabled = false;
+static int every = 0;
+static aggregate_table *table = NULL;
+
+
+static inline uint64_t hash(const char *bytes, size_t length, uint64_t seed) {
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (size_t i=0; i<length; i++) {
+        h ^= (unsigned char)bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static inline double log_add(double a, double b) {
+    return (a > b) ? a + log1p(exp(b - a)) : b + log1p(exp(a - b));
+}
+
+
+void aggregate_enable(int every_iterations) {
+    enabled = true;
+    every = every_iterations;
+}
+
+bool aggregate_enabled() {
+    return enabled;
+}
+
+int aggregate_every() {
+    return every;
+}
+
+void aggregate_init() {
+    if (!enabled) return;
+    table = (aggregate_table *)shared_memory_alloc(sizeof(aggregate_table));
+    memset(table, 0, sizeof(aggregate_table));
+    for (int i=0; i<AGGREGATE_MAX_VALUES; i++) {
+        table->values[i].variable = -1;
+    }
+    init_shared_mutex(&table->mutex, NULL);
+}
+
+
+/**
+ * Slot of the variable called `name`, adding it if new; -1 if it can't be
+ * (name too long, or table full)
+ *
+ */
+static int find_variable(const char *name, size_t name_length) {
+    if (name_length == 0 || name_length >= AGGREGATE_MAX_NAME) return -1;
+    int slot = hash(name, name_length, 0) & (AGGREGATE_MAX_VARIABLES - 1);
+    while (table->variables[slot].name_length != 0) {
+        aggregate_variable *variable = &table->variables[slot];
+        if (variable->name_length == name_length && memcmp(variable->name, name, name_length) == 0) {
+            return slot;
+        }
+        slot = (slot + 1) & (AGGREGATE_MAX_VARIABLES - 1);
+    }
+    if (table->num_variables >= AGGREGATE_MAX_VARIABLES*3/4) return -1;
+    aggregate_variable *variable = &table->variables[slot];
+    memcpy(variable->name, name, name_length);
+    variable->name_length = name_length;
+    variable->discrete = true;
+    table->order[table->num_variables++] = slot;
+    return slot;
+}
+
+static void count_value(int slot, long value, double log_weight) {
+    aggregate_variable *variable = &table->variables[slot];
+    int index = hash((const char *)&value, sizeof(value), slot) & (AGGREGATE_MAX_VALUES - 1);
+    while (table->values[index].variable != -1) {
+        aggregate_value *entry = &table->values[index];
+        if (entry->variable == slot && entry->value == value) {
+            entry->log_weight = log_add(entry->log_weight, log_weight);
+            return;
+        }
+        index = (index + 1) & (AGGREGATE_MAX_VALUES - 1);
+    }
+    if (table->num_values >= AGGREGATE_MAX_VALUES*3/4) {
+        variable->truncated = true;
+        return;
+    }
+    table->values[index] = (aggregate_value) { slot, value, log_weight };
+    table->num_values++;
+}
+
+/**
+ * Weighted Welford update, in terms of the new sample's share of the total
+ * weight, r = w / (W + w), so that weights never leave log space
+ *
+ */
+static void fold_value(const char *name, size_t name_length, double value, bool is_int, void *context) {
+    double log_weight = *(double *)context;
+    int slot = find_variable(name, name_length);
+    if (slot < 0) {
+        table->skipped++;
+        return;
+    }
+    aggregate_variable *variable = &table->variables[slot];
+    if (variable->count == 0) {
+        variable->log_weight = log_weight;
+        variable->mean = value;
+        variable->variance = 0;
+    } else {
+        double total = log_add(variable->log_weight, log_weight);
+        double r = exp(log_weight - total);
+        double delta = value - variable->mean;
+        variable->mean += r*delta;
+        variable->variance = (1 - r)*(variable->variance + r*delta*delta);
+        variable->log_weight = total;
+    }
+    variable->count++;
+
+    if (!is_int) {
+        variable->discrete = false;
+    } else if (variable->discrete && !variable->truncated) {
+        count_value(slot, (long)value, log_weight);
+    }
+}
+
+void aggregate_predicts(const predict_buffer *predicts, double log_weight) {
+    pthread_mutex_lock(&table->mutex);
+    predict_buffer_visit(predicts, fold_value, &log_weight);
+    pthread_mutex_unlock(&table->mutex);
+}
+
+
+// Order of printing: by variable (in order of first appearance), then value
+static int *rank = NULL;
+
+static int compare_values(const void *a, const void *b) {
+    const aggregate_value *x = a, *y = b;
+    if (x->variable != y->variable) return rank[x->variable] - rank[y->variable];
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+void aggregate_print(FILE *stream, int iteration) {
+    if (table == NULL) return;
+    pthread_mutex_lock(&table->mutex);
+    if (iteration > 0) {
+        fprintf(stream, "aggregate(iteration %d)\n", iteration);
+    }
+    for (int i=0; i<table->num_variables; i++) {
+        aggregate_variable *variable = &table->variables[table->order[i]];
+        fprintf(stream, "E[%.*s] = %g; Var[%.*s] = %g\n", variable->name_length, variable->name, variable->mean,
+                variable->name_length, variable->name, variable->variance);
+    }
+
+    // Values of discrete variables
+    rank = malloc(AGGREGATE_MAX_VARIABLES*sizeof(int));
+    for (int i=0; i<table->num_variables; i++) {
+        rank[table->order[i]] = i;
+    }
+    aggregate_value *values = malloc((table->num_values + 1)*sizeof(aggregate_value));
+    int count = 0;
+    for (int v=0; v<AGGREGATE_MAX_VALUES; v++) {
+        int slot = table->values[v].variable;
+        if (slot >= 0 && table->variables[slot].discrete && !table->variables[slot].truncated) {
+            values[count++] = table->values[v];
+        }
+    }
+    qsort(values, count, sizeof(aggregate_value), compare_values);
+    for (int v=0; v<count; v++) {
+        aggregate_variable *variable = &table->variables[values[v].variable];
+        fprintf(stream, "p(%.*s = %ld) = %g\n", variable->name_length, variable->name, values[v].value,
+                exp(values[v].log_weight - variable->log_weight));
+    }
+    for (int i=0; i<table->num_variables; i++) {
+        aggregate_variable *variable = &table->variables[table->order[i]];
+        if (variable->discrete && variable->truncated) {
+            fprintf(stderr, "aggregate: too many distinct values to count for %.*s\n", variable->name_length, variable->name);
+        }
+    }
+    free(values);
+    free(rank);
+    rank = NULL;
+
+    if (table->skipped > 0) {
+        fprintf(stderr, "aggregate: %d values not summarized (name too long, or too many names)\n", table->skipped);
+    }
+    fflush(stream);
+    pthread_mutex_unlock(&table->mutex);
+}
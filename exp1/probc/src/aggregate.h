@@ -0,0 +1,88 @@
+#ifndef __AGGREGATE__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "predict-buffer.h"
+
+/**
+ *
+ * In-engine posterior summaries (--aggregate[=k]).
+ *
+ * Instead of writing out its predicts, each finished particle folds them into
+ * a table of accumulators in shared memory, keyed by predict name: a weighted
+ * mean and variance (Welford's update, with weights kept in log space) for
+ * every variable, and, while a variable has only taken integer values, the
+ * total weight of each value. The root prints the summaries at the end, in
+ * the format of compute_moments.sh and compute_counts.sh:
+ *
+ *   E[name] = mean; Var[name] = variance
+ *   p(name = value) = probability
+ *
+ * pg and pimh accumulate over all iterations, and with k > 0 also print the
+ * summaries so far every k iterations.
+ *
+ */
+
+#define AGGREGATE_MAX_VARIABLES 4096
+#define AGGREGATE_MAX_NAME 64
+#define AGGREGATE_MAX_VALUES (1 << 16)
+
+typedef struct {
+    char name[AGGREGATE_MAX_NAME];
+    int name_length;            // 0 for an empty slot
+    bool discrete;              // only integer values so far
+    bool truncated;             // ran out of value slots
+    long count;
+    double log_weight;          // log total weight
+    double mean;
+    double variance;
+} aggregate_variable;
+
+typedef struct {
+    int variable;               // -1 for an empty slot
+    long value;
+    double log_weight;
+} aggregate_value;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int num_variables;
+    int num_values;
+    int skipped;                        // values of names too long, or with no free slot
+    int order[AGGREGATE_MAX_VARIABLES]; // variable slots, in order of first appearance
+    aggregate_variable variables[AGGREGATE_MAX_VARIABLES];
+    aggregate_value values[AGGREGATE_MAX_VALUES];
+} aggregate_table;
+
+
+/**
+ * Called while parsing arguments: aggregate instead of writing out predicts,
+ * printing intermediate summaries every `every` iterations (if > 0)
+ *
+ */
+void aggregate_enable(int every);
+bool aggregate_enabled();
+int aggregate_every();
+
+/**
+ * Called by the root, before forking any particles: allocate the table
+ *
+ */
+void aggregate_init();
+
+/**
+ * Fold a finished particle's predicts into the table, with weight exp(log_weight)
+ *
+ */
+void aggregate_predicts(const predict_buffer *predicts, double log_weight);
+
+/**
+ * Print the summaries so far; a positive `iteration` labels intermediate ones
+ *
+ */
+void aggregate_print(FILE *stream, int iteration);
+
+#define __AGGREGATE__
+#endif
@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "barrier.h"
+
+// Number of polls before a waiter goes to sleep in the kernel
+#define SPIN_COUNT 256
+
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Sleep while *addr == expected; wake every sleeper on addr.
+ * Shared (non-private) futexes, since waiters are in different processes.
+ *
+ */
+void shared_futex_wait(volatile int *addr, int expected) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+#else
+    if (*addr == expected) sched_yield();
+#endif
+}
+
+void shared_futex_wake_all(volatile int *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static inline int load_acquire(volatile int *addr) {
+    return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Spinning only pays off when every participant can be on a CPU at once;
+ * otherwise a spinning waiter just delays the process it is waiting for.
+ *
+ */
+static int spin_limit(int participants) {
+    static int online_cpus = 0;
+    if (online_cpus == 0) online_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return (participants > 1 && participants <= online_cpus) ? SPIN_COUNT : 0;
+}
+
+
+void shared_barrier_init(shared_barrier *barrier, int max_participants, int fanout) {
+    assert(max_participants > 0);
+    barrier->sense.value = 0;
+    barrier->count.value = 0;
+    barrier->fanout = (fanout > 1) ? fanout : 0;
+    barrier->max_participants = max_participants;
+    barrier->spin_count = spin_limit(max_participants);
+    barrier->num_levels = 0;
+    barrier->nodes = NULL;
+    if (barrier->fanout == 0) return;
+
+    // Lay out every level of the combining tree in one shared array
+    int width = max_participants;
+    int num_nodes = 0;
+    do {
+        assert(barrier->num_levels < BARRIER_MAX_LEVELS);
+        width = (width + fanout - 1) / fanout;
+        barrier->level_offset[barrier->num_levels++] = num_nodes;
+        num_nodes += width;
+    } while (width > 1);
+
+    barrier->nodes = mmap(NULL, num_nodes*sizeof(padded_counter), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == barrier->nodes) {
+        perror("mmap");
+    }
+    assert(MAP_FAILED != barrier->nodes);
+    for (int i=0; i<num_nodes; i++) barrier->nodes[i].value = 0;
+}
+
+
+bool shared_barrier_arrive(shared_barrier *barrier, int slot, int participants, int *sense) {
+    assert(slot >= 0 && slot < participants && participants <= barrier->max_participants);
+
+    // Read the sense *before* arriving, so the leader cannot flip it underneath us
+    *sense = load_acquire(&barrier->sense.value);
+
+    if (barrier->fanout == 0) {
+        int arrived = __atomic_add_fetch(&barrier->count.value, 1, __ATOMIC_ACQ_REL);
+        if (arrived < participants) return false;
+        barrier->count.value = 0;
+        return true;
+    }
+
+    // Climb the combining tree; only the last arrival at each node continues
+    const int fanout = barrier->fanout;
+    int index = slot;
+    int width = participants;
+    for (int level=0; level<barrier->num_levels; level++) {
+        int node = index / fanout;
+        int expected = width - node*fanout;
+        if (expected > fanout) expected = fanout;
+        padded_counter *counter = &barrier->nodes[barrier->level_offset[level] + node];
+        if (__atomic_add_fetch(&counter->value, 1, __ATOMIC_ACQ_REL) < expected) return false;
+        counter->value = 0;
+        width = (width + fanout - 1) / fanout;
+        index = node;
+        if (width == 1) return true;
+    }
+    assert(false);
+    return true;
+}
+
+void shared_barrier_wait(shared_barrier *barrier, int sense) {
+    for (int spin=0; spin<barrier->spin_count; spin++) {
+        if (load_acquire(&barrier->sense.value) != sense) return;
+        cpu_relax();
+    }
+    while (load_acquire(&barrier->sense.value) == sense) {
+        shared_futex_wait(&barrier->sense.value, sense);
+    }
+}
+
+bool shared_barrier_released(shared_barrier *barrier, int sense) {
+    return load_acquire(&barrier->sense.value) != sense;
+}
+
+void shared_barrier_release(shared_barrier *barrier) {
+    __atomic_store_n(&barrier->sense.value, !barrier->sense.value, __ATOMIC_RELEASE);
+    shared_futex_wake_all(&barrier->sense.value);
+}
+
+
+void shared_latch_set(shared_latch *latch, int count) {
+    latch->spin_count = spin_limit(count);
+    __atomic_store_n(&latch->count.value, count, __ATOMIC_RELEASE);
+}
+
+bool shared_latch_count_down(shared_latch *latch) {
+    if (__atomic_sub_fetch(&latch->count.value, 1, __ATOMIC_ACQ_REL) > 0) return false;
+    shared_futex_wake_all(&latch->count.value);
+    return true;
+}
+
+void shared_latch_wait(shared_latch *latch) {
+    int count;
+    for (int spin=0; spin<latch->spin_count; spin++) {
+        if (load_acquire(&latch->count.value) <= 0) return;
+        cpu_relax();
+    }
+    while ((count = load_acquire(&latch->count.value)) > 0) {
+        shared_futex_wait(&latch->count.value, count);
+    }
+}
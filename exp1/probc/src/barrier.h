@@ -0,0 +1,94 @@
+#ifndef __BARRIER__
+
+#include <stdbool.h>
+
+/**
+ *
+ * Process-shared synchronization primitives for observe barriers.
+ *
+ * Both live in MAP_SHARED memory and sleep on futexes (Linux) rather than
+ * pthread mutex/cond pairs, so arriving particles never contend on a lock,
+ * and every hot counter sits on its own cache line.
+ *
+ */
+
+#define CACHE_LINE_SIZE 64
+#define BARRIER_MAX_LEVELS 32
+
+typedef struct {
+    volatile int value;
+    char padding[CACHE_LINE_SIZE - sizeof(int)];
+} __attribute__((aligned(CACHE_LINE_SIZE))) padded_counter;
+
+
+/**
+ * Sense-reversing barrier with an optional combining tree.
+ *
+ * Particles arrive in a dense slot range [0, participants); with fanout k > 1,
+ * slot s first arrives at leaf node s/k, and only the last arrival at each node
+ * continues upward, so at most k processes ever touch the same counter.
+ *
+ * The last process to arrive becomes the leader: it does not wait, and instead
+ * may update shared state (e.g. resample) before calling shared_barrier_release.
+ *
+ */
+typedef struct {
+    padded_counter sense;
+    padded_counter count;
+    int fanout;
+    int max_participants;
+    int spin_count;
+    int num_levels;
+    int level_offset[BARRIER_MAX_LEVELS];
+    padded_counter *nodes;
+} shared_barrier;
+
+/**
+ * Initialize a barrier inside shared memory, for up to max_participants slots.
+ * A fanout of 0 or 1 gives a flat (single counter) barrier.
+ *
+ */
+void shared_barrier_init(shared_barrier *barrier, int max_participants, int fanout);
+
+/**
+ * Arrive at the barrier from the given slot. Returns true for the leader (last
+ * arrival). Otherwise the caller must pass the returned sense to shared_barrier_wait.
+ *
+ */
+bool shared_barrier_arrive(shared_barrier *barrier, int slot, int participants, int *sense);
+void shared_barrier_wait(shared_barrier *barrier, int sense);
+void shared_barrier_release(shared_barrier *barrier);
+
+
+/**
+ * Count-down latch: waiters block until the count reaches zero. Processes that
+ * count down need not wait, so it also covers particles that exit at an observe.
+ *
+ */
+typedef struct {
+    padded_counter count;
+    int spin_count;
+} shared_latch;
+
+void shared_latch_set(shared_latch *latch, int count);
+bool shared_latch_count_down(shared_latch *latch);
+void shared_latch_wait(shared_latch *latch);
+
+
+/**
+ * Sleep while *addr == expected (returns early on a wake or spurious wakeup);
+ * wake every process sleeping on addr. Used directly by the zygote pool.
+ *
+ */
+void shared_futex_wait(volatile int *addr, int expected);
+void shared_futex_wake_all(volatile int *addr);
+
+/**
+ * Non-blocking check: has the barrier been released since this process
+ * arrived with the given sense?
+ *
+ */
+bool shared_barrier_released(shared_barrier *barrier, int sense);
+
+#define __BARRIER__
+#endif
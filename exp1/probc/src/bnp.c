@@ -5,24 +5,25 @@
 
 #include "bnp.h"
 #include "erp.h"
+#include "probabilistic.h"
 
 
 // Polya urn
 
 void polya_urn_new(polya_urn_state *state, double concentration) {
     int s = 2; // initial size
-    *state = (polya_urn_state) { concentration, 0, s, 0, malloc(s*sizeof(int)) };
+    *state = (polya_urn_state) { concentration, 0, s, 0, particle_alloc(s*sizeof(int)) };
 }
 
 void polya_urn_free(polya_urn_state *state) {
-    free(state->counts);
+    particle_free(state->counts);
 }
 
 int polya_urn_draw(polya_urn_state *state) {
     // expand internal state if necessary
     if (state->len_buckets == state->max_buckets) {
         state->max_buckets *= 2; // growth factor
-        state->counts = realloc(state->counts, state->max_buckets*sizeof(int));
+        state->counts = particle_realloc(state->counts, state->max_buckets*sizeof(int));
     }
     
     // draw from urn
@@ -61,11 +62,11 @@ int polya_urn_draw(polya_urn_state *state) {
 
 void stick_new(stick_dist *state, double concentration) {
     int s = 2; // initial size
-    *state = (stick_dist) { concentration, -1, s, 1.0, 0.0, malloc(s*sizeof(double)) };
+    *state = (stick_dist) { concentration, -1, s, 1.0, 0.0, particle_alloc(s*sizeof(double)) };
 }
 
 void stick_free(stick_dist *state) {
-    free(state->beta);
+    particle_free(state->beta);
 }
 
 int stick_rng(stick_dist *state) {
@@ -77,7 +78,7 @@ int stick_rng(stick_dist *state) {
         if (entry == state->max_buckets) {
             // expand internal state if necessary
             state->max_buckets *= 2; // growth factor
-            state->beta = realloc(state->beta, state->max_buckets*sizeof(double));
+            state->beta = particle_realloc(state->beta, state->max_buckets*sizeof(double));
         }
         if (entry > state->len_buckets) {
             // compute new entries as needed
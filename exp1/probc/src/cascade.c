@@ -18,6 +18,10 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "sample-file.h"
+#include "aggregate.h"
+#include "profile.h"
+#include "perf-counters.h"
 
 #define min(a, b) ((a < b) ? (a) : (b))
 #define max(a, b) ((a > b) ? (a) : (b))
@@ -101,7 +105,7 @@ typedef struct {
     int initial_index;
     int live_offspring_count;
     int particle_pseudocount;
-    UT_string *predict;
+    predict_buffer *predict;
 } process_locals;
 
 
@@ -115,7 +119,7 @@ static shared_globals *globals;
  */
 void destroy_particle() {
     assert(locals->live_offspring_count == 0);
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
     
     pthread_mutex_lock(&globals->execution_leaf_node_mutex);
     globals->initial_particles = max(globals->initial_particles, locals->initial_index+1);
@@ -124,6 +128,8 @@ void destroy_particle() {
     pthread_cond_signal(&globals->execution_leaf_node_cond);
     pthread_mutex_unlock(&globals->execution_leaf_node_mutex);
 
+    profile_flush();
+    perf_counters_exit();
     _exit(0);
 }
 
@@ -136,10 +142,24 @@ void predict(const char *format, ...) {
     if (IS_PRERUN) { return; }
     va_list args;
     va_start(args, format);
-    utstring_printf_va(locals->predict, format, args);
+    predict_buffer_printf_va(locals->predict, format, args);
     va_end(args);
 }
 
+/**
+ * Typed predicts, formatted only at output time
+ *
+ */
+void predict_value(const char *name, const double value) {
+    if (IS_PRERUN) { return; }
+    predict_buffer_add_double(locals->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    if (IS_PRERUN) { return; }
+    predict_buffer_add_int(locals->predict, name, value);
+}
+
 
 /**
  * Print elapsed time at end of particle
@@ -257,6 +277,7 @@ void weight_trace(const double ln_p, const bool synchronize) {
     // debug_print(1, "[observe %d] outgoing weight: %f\n", locals->current_observe, new_log_weight);
 
     locals->current_observe += 1;
+    perf_counters_observe(locals->current_observe);
     locals->log_weight = new_log_weight;
     locals->log_weight_increment = 0;
 
@@ -351,12 +372,16 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
     debug_print(1, "Main process pid: %d\n", main_pid);
     
     // Initialize random number generators
-    erp_rng_init();
-    if (INITIAL_SEED >= 0) set_rng_seed(INITIAL_SEED);
+    erp_rng_init(INITIAL_SEED);
 
     // Create shared-memory globals object
     init_globals();
 
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
     // Set initial state (pre-fork)
     process_locals _locals;
     locals = &_locals;
@@ -365,7 +390,7 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
     locals->log_weight = 0;
     locals->log_weight_increment = 0;
     locals->particle_pseudocount = 1;
-	utstring_new(locals->predict);
+	locals->predict = predict_buffer_new();
 
     // Do initial prerun (at the moment, all this does is count the number of observes)
     pid_t prerun_pid = fork();
@@ -447,18 +472,13 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
 
             UT_string *tmp_output;
             utstring_new(tmp_output);
-            int ix_left = 0;
-            int ix_right = 0;
-            
+
             pthread_mutex_lock(&globals->synthetic_pid_mutex);
             unsigned long synthetic_pid = globals->synthetic_pid++;
             
             double final_particle_weight = locals->log_weight; // + log(locals->particle_pseudocount);
             
-            while ((ix_right = utstring_find(locals->predict, ix_left, "\n", 1)) >= 0) {
-                utstring_printf(tmp_output, "%.*s,%f,%ld\n", ix_right - ix_left, &utstring_body(locals->predict)[ix_left], final_particle_weight, synthetic_pid);
-                ix_left = ix_right + 1;
-            }
+            format_weighted_predicts(locals->predict, tmp_output, final_particle_weight, synthetic_pid);
 
             flush_output(&globals->stdout_mutex, tmp_output);
             utstring_free(tmp_output);
@@ -492,7 +512,7 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
 
             i--;
             sleep(1);
-            //utstring_free(locals->predict);
+            //predict_buffer_free(locals->predict);
             //exit(1);
         } else {
             locals->live_offspring_count++;
@@ -563,10 +583,12 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
 
     // Collect terminated child processes
     cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+    sample_file_close();
+    aggregate_print(stdout, 0);
     debug_print(3,"Post-cleanup; main thread complete, leaf node counter at %d\n", globals->execution_leaf_node_counter);
     debug_print(1,"Summary: total of %lu paths completed, from %d initializations\n", globals->synthetic_pid, i+1);
 
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
     
     return 0;
 }
@@ -581,10 +603,14 @@ void parse_args(int argc, char **argv) {
         {"evidence", no_argument, 0, 'e'},
         {"rng_seed", required_argument, 0, 'r'},
         {"process_cap", required_argument, 0, 'c'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
     };
     int c, option_index;
     
-    while((c = getopt_long(argc, argv, "p:ter:c:", long_options, &option_index)) != -1) {
+    while((c = getopt_long(argc, argv, "p:ter:c:o:O:A::", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 PARTICLE_SOFT_LIMIT = atoi(optarg);
@@ -598,6 +624,18 @@ void parse_args(int argc, char **argv) {
             case 'r':
                 INITIAL_SEED = atol(optarg);
                 break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
             case 'c':
                 MAX_LEAF_NODE_COUNT = atoi(optarg);
                 break;
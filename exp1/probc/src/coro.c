@@ -0,0 +1,735 @@
+#include <assert.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "utstring.h"
+#include "probabilistic.h"
+#include "engine-shared.h"
+#include "resample.h"
+#include "particle-state.h"
+#include "sync-policy.h"
+#include "sample-file.h"
+#include "aggregate.h"
+
+/**
+ *
+ * Stack-copying coroutine SMC.
+ *
+ * Particles are not processes. Each worker thread owns one execution stack and
+ * a set of particles, which it runs one at a time as coroutines (ucontext) on
+ * that stack. At a synchronizing observe a particle switches back to its
+ * thread's scheduler, which copies the live part of the execution stack into a
+ * snapshot. Once every particle of every thread has reached the observe, the
+ * threads meet at a barrier and resample; offspring share their ancestor's
+ * snapshot, which is copied back onto the execution stack each time one of
+ * them is resumed. Copying a few kilobytes of stack replaces a fork().
+ *
+ * A stack snapshot is only valid at the address it was taken from, so a
+ * particle and all its descendants stay on the thread that started it.
+ *
+ * Besides the stack, a snapshot holds the program's registered particle state:
+ * regions declared with particle_state(), and the thread's arena, from which
+ * particle_alloc() serves memory. The arena also sits at a fixed address per
+ * thread, so it is saved and restored just like the stack. Any other globals or
+ * heap memory are shared by all particles of a process, so programs must not
+ * keep mutable state there across synchronizing observes. Registered regions
+ * are process-wide, so programs which use particle_state() run on one thread:
+ * a prerun, up to the first synchronizing observe, finds out whether they do.
+ *
+ */
+
+// Set defaults for number of particles
+static int NUM_PARTICLES = 100;
+
+// Number of worker threads (0 = one per online CPU)
+static int NUM_THREADS = 0;
+
+// Size of each thread's execution stack, in kilobytes
+static int STACK_KB = 8192;
+
+// Size of each thread's particle_alloc arena, in kilobytes (address space only)
+static int ARENA_KB = 65536;
+
+// We can print out an estimate of the marginal likelihood
+static bool ESTIMATE_MARGINAL_LIKELIHOOD = false;
+
+// Tau \in [0, 1] determines the frequency of resampling
+static double TAU = 0.5;
+
+// Possibly default initial seed
+static long INITIAL_SEED = -1;
+
+// Flag to mark whether or not to record walltime
+static bool TIME_EXECUTION = false;
+
+// Flag to mark whether to output weighted or unweighted particle set
+static bool WEIGHTED_OUTPUT = false;
+
+// Scheme used to sample offspring counts
+static resampler_type RESAMPLER = RESAMPLE_MULTINOMIAL;
+
+// Which synchronizing observes are barriers
+static sync_policy SYNC_POLICY = { SYNC_ALWAYS, 1 };
+
+// Bytes below the observing frame which are saved along with it
+#define STACK_MARGIN 256
+
+// Batch output into chunks of this size before taking the stdout lock
+#define OUTPUT_BATCH_BYTES (1 << 16)
+
+
+/**
+ * Saved execution stack of a particle stopped at an observe; shared (read-only)
+ * by all of its offspring until they have been resumed
+ *
+ */
+typedef struct {
+    ucontext_t context;
+    char *stack;        // saved copy of [sp, stack_top)
+    size_t length;
+    char *sp;
+    char *state;        // registered regions and arena, see particle-state.h
+    int refcount;
+} snapshot;
+
+typedef struct {
+    int index;
+    double log_weight;
+    unsigned long seed;
+    int current_observe;    // synchronizing observes passed, barriers or not
+    bool force_sync;
+    bool done;
+    snapshot *snap;     // NULL until first run
+    predict_buffer *predict;
+} particle;
+
+/**
+ * Per-thread scheduler state
+ *
+ */
+typedef struct {
+    int id;
+    pthread_t thread;
+    ucontext_t scheduler;
+    ucontext_t start;
+    char *stack;
+    char *stack_top;
+    particle_arena arena;
+
+    // Particles currently owned by this thread (offspring stay with their ancestor)
+    particle *particles;
+    particle *next_particles;
+    int count;
+    int capacity;
+
+    particle *current;
+    UT_string *output;
+} coro_thread;
+
+/**
+ * Struct containing global state variables, shared between threads
+ *
+ */
+typedef struct {
+
+    coro_thread *threads;
+    int num_threads;
+
+    // Hold per-particle log-weights, offspring counts and seeds, for resampling
+    double *log_weights;
+    int *n_offspring;
+    int *offspring_slot;
+    unsigned long *seeds;
+
+    // Threads meet here once all their particles have reached the observe
+    pthread_barrier_t observe_barrier;
+
+    // Engine RNG seed: resampling and particle seeds do not depend on which thread leads
+    unsigned long engine_seed;
+
+    int current_observe;
+    bool resampled;
+    bool finished;
+
+    // Which upcoming synchronizing observes are barriers
+    sync_schedule schedule;
+
+    // Mutex: stdout lock
+    pthread_mutex_t stdout_mutex;
+
+    // Marginal likelihood estimate
+    double log_marginal_likelihood;
+
+} shared_globals;
+
+
+static shared_globals *globals;
+static __thread coro_thread *self;
+
+// Set in the child which checks whether the program registers particle state
+static bool IS_PRERUN = false;
+
+static int (*program)(int, char**);
+static int program_argc;
+static char **program_argv;
+
+
+/**
+ * Sample number of offspring, given particle weights,
+ * using the resampling scheme selected on the command line
+ *
+ */
+void resample() {
+
+    enter_run_rng_stream();
+    resample_offspring(RESAMPLER, globals->log_weights, NUM_PARTICLES, NUM_PARTICLES, globals->n_offspring);
+    leave_run_rng_stream();
+
+#if DEBUG_LEVEL >= 2
+    // print all the offspring counts (debug)
+    fprintf(stderr, "[resampling] observe #%d (%s)\n", globals->current_observe, resampler_name(RESAMPLER));
+    fprintf(stderr, "LOG WEIGHT: <");
+    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
+    fprintf(stderr, ">\n");
+    fprintf(stderr, "N_OFFSPRING: <");
+    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
+    fprintf(stderr, ">\n");
+#endif
+}
+
+
+/**
+ * Special printf function which writes to the output file
+ *
+ */
+void predict(const char *format, ...) {
+    if (IS_PRERUN) return;
+    va_list args;
+    va_start(args, format);
+    predict_buffer_printf_va(self->current->predict, format, args);
+    va_end(args);
+}
+
+/**
+ * Special printf function "predict", for named doubles
+ *
+ */
+void predict_value(const char *name, const double value) {
+    if (IS_PRERUN) return;
+    predict_buffer_add_double(self->current->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    if (IS_PRERUN) return;
+    predict_buffer_add_int(self->current->predict, name, value);
+}
+
+void weight_trace(const double ln_p, const bool synchronize) {
+
+    // Prerun: particle_state must be called before the first synchronizing observe
+    if (IS_PRERUN) {
+        if (synchronize) _exit(particle_state_count() > 0);
+        return;
+    }
+
+    particle *p = self->current;
+    p->log_weight += ln_p;
+    if (!synchronize) return;
+
+    // Not a barrier under the current schedule: carry on
+    int sync_index = p->current_observe++;
+    if (!p->force_sync && !sync_schedule_is_barrier(&globals->schedule, sync_index)) return;
+    debug_print(4,"[OBSERVE %d] particle #%d, %0.4f\n", p->current_observe, p->index, ln_p);
+
+    // Everything from just below this frame to the top of the stack is live
+    char marker;
+    snapshot *snap = malloc(sizeof(snapshot));
+    snap->sp = (char *)((uintptr_t)&marker - STACK_MARGIN);
+    if (snap->sp < self->stack) snap->sp = self->stack;
+    snap->refcount = 1;
+    p->snap = snap;
+
+    // Back to the scheduler, which saves the stack; we return here once
+    // resumed, possibly as one of several offspring of this particle
+    swapcontext(&snap->context, &self->scheduler);
+}
+
+
+/**
+ * Queue a finished particle's predicts for output
+ *
+ */
+static void write_output(bool force) {
+    if (utstring_len(self->output) == 0) return;
+    if (!force && utstring_len(self->output) < OUTPUT_BATCH_BYTES) return;
+    flush_output(&globals->stdout_mutex, self->output);
+    utstring_clear(self->output);
+}
+
+static void output_particle(particle *p) {
+    if (!WEIGHTED_OUTPUT) {
+        format_predicts(p->predict, self->output);
+    } else {
+        format_weighted_predicts(p->predict, self->output, p->log_weight, p->index);
+    }
+    write_output(false);
+}
+
+
+/**
+ * Coroutine entry point: run the program from the start, on the thread's
+ * execution stack. Returning switches back to the scheduler (uc_link).
+ *
+ */
+static void particle_main() {
+    program(program_argc, program_argv);
+    if (!WEIGHTED_OUTPUT) {
+        // "dummy" observe to mark end of program; always a barrier, as we resample
+        self->current->force_sync = true;
+        observe(0);
+    }
+    // Not necessarily the particle which started here: re-read after observes
+    particle *p = self->current;
+    p->done = true;
+    output_particle(p);
+}
+
+
+/**
+ * Run one particle until its next synchronizing observe, or to completion
+ *
+ */
+static void run_particle(particle *p) {
+    self->current = p;
+    set_rng_seed(p->seed);
+    snapshot *snap = p->snap;
+    if (snap == NULL) {
+        particle_arena_reset(&self->arena);
+        getcontext(&self->start);
+        self->start.uc_stack.ss_sp = self->stack;
+        self->start.uc_stack.ss_size = self->stack_top - self->stack;
+        self->start.uc_link = &self->scheduler;
+        makecontext(&self->start, particle_main, 0);
+        swapcontext(&self->scheduler, &self->start);
+    } else {
+        // Restore the stack as it was at the observe, then resume from it
+        memcpy(snap->sp, snap->stack, snap->length);
+        particle_state_restore(&self->arena, snap->state);
+        p->snap = NULL;
+        swapcontext(&self->scheduler, &snap->context);
+
+        // Drop our reference, once the context is no longer needed
+        if (--snap->refcount == 0) {
+            free(snap->stack);
+            free(snap->state);
+            free(snap);
+        }
+    }
+
+    // Back from the particle: if it stopped at an observe, save its stack
+    if (!p->done) {
+        snap = p->snap;
+        assert(snap != NULL);
+        snap->length = self->stack_top - snap->sp;
+        snap->stack = malloc(snap->length);
+        memcpy(snap->stack, snap->sp, snap->length);
+        snap->state = malloc(particle_state_size(&self->arena));
+        particle_state_save(&self->arena, snap->state);
+    }
+
+    if (globals->num_threads > 1 && particle_state_count() > 0) {
+        fprintf(stderr, "coro: particle_state must be called before the first observe\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * Leader, between barriers: check the population is consistently at an observe
+ * (or finished), then resample and pick seeds for the next segment
+ *
+ */
+static void resample_population() {
+
+    int num_done = 0;
+    int observe_index = -1;
+    bool mismatch = false;
+    for (int t=0; t<globals->num_threads; t++) {
+        coro_thread *thread = &globals->threads[t];
+        for (int i=0; i<thread->count; i++) {
+            particle *p = &thread->particles[i];
+            globals->log_weights[p->index] = p->log_weight;
+            if (p->done) num_done++;
+            if (observe_index >= 0 && p->current_observe - 1 != observe_index) mismatch = true;
+            observe_index = p->current_observe - 1;
+        }
+    }
+    if (num_done == NUM_PARTICLES) {
+        globals->finished = true;
+        return;
+    } else if (num_done > 0 || mismatch) {
+        fprintf(stderr, "coro: particles disagree on the number of synchronizing observes\n");
+        exit(1);
+    }
+    globals->current_observe++;
+
+    double ESS = 0;
+    double normalization = log_sum_exp(globals->log_weights, NUM_PARTICLES);
+    for (int i=0; i<NUM_PARTICLES; i++) {
+        ESS += pow(exp(globals->log_weights[i] - normalization), 2);
+        globals->n_offspring[i] = 1;
+    }
+    ESS = 1 / ESS;
+    debug_print(2,"ESS at observe %d: %f\n", globals->current_observe, ESS);
+
+    set_rng_seed(globals->engine_seed);
+    globals->resampled = (ESS < TAU*NUM_PARTICLES);
+    if (globals->resampled) {
+        globals->log_marginal_likelihood += normalization - log(NUM_PARTICLES);
+        resample();
+    }
+    sync_schedule_update(&globals->schedule, &SYNC_POLICY, TAU, observe_index, ESS/NUM_PARTICLES, globals->resampled);
+    resample_assign_slots(globals->n_offspring, NUM_PARTICLES, globals->offspring_slot);
+
+    // Every particle's next segment gets a fresh seed, as after a fork
+    for (int i=0; i<NUM_PARTICLES; i++) {
+        globals->seeds[i] = gen_new_rng_seed();
+    }
+    globals->engine_seed = gen_new_rng_seed();
+}
+
+
+/**
+ * After resampling, each thread replaces its particles with their offspring
+ * (which stay on this thread, next to each other)
+ *
+ */
+static void spawn_offspring() {
+    int count = 0;
+    for (int i=0; i<self->count; i++) {
+        count += globals->n_offspring[self->particles[i].index];
+    }
+    if (count > self->capacity) {
+        self->capacity = 2*count;
+        self->particles = realloc(self->particles, self->capacity*sizeof(particle));
+        self->next_particles = realloc(self->next_particles, self->capacity*sizeof(particle));
+    }
+
+    int next = 0;
+    for (int i=0; i<self->count; i++) {
+        particle *p = &self->particles[i];
+        int n_offspring = globals->n_offspring[p->index];
+        int first_slot = globals->offspring_slot[p->index];
+        if (n_offspring == 0) {
+            if (--p->snap->refcount == 0) {
+                free(p->snap->stack);
+                free(p->snap->state);
+                free(p->snap);
+            }
+            predict_buffer_free(p->predict);
+            continue;
+        }
+        p->snap->refcount += n_offspring - 1;
+        for (int k=0; k<n_offspring; k++) {
+            particle *child = &self->next_particles[next++];
+            *child = *p;
+            child->index = first_slot + k;
+            child->seed = globals->seeds[child->index];
+            if (globals->resampled) child->log_weight = 0;
+            if (k > 0) {
+                child->predict = predict_buffer_new();
+                predict_buffer_copy(child->predict, p->predict);
+            }
+        }
+    }
+    assert(next == count);
+
+    particle *tmp = self->particles;
+    self->particles = self->next_particles;
+    self->next_particles = tmp;
+    self->count = count;
+}
+
+
+/**
+ * Worker thread: advance all of its particles to the next observe, meet the
+ * other threads, resample, repeat
+ *
+ */
+static void *thread_main(void *arg) {
+    self = (coro_thread *)arg;
+    particle_arena_activate(&self->arena);
+    utstring_new(self->output);
+
+    while (true) {
+        for (int i=0; i<self->count; i++) {
+            run_particle(&self->particles[i]);
+        }
+        if (pthread_barrier_wait(&globals->observe_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            resample_population();
+        }
+        pthread_barrier_wait(&globals->observe_barrier);
+        if (globals->finished) break;
+        spawn_offspring();
+    }
+
+    write_output(true);
+    for (int i=0; i<self->count; i++) {
+        predict_buffer_free(self->particles[i].predict);
+    }
+    utstring_free(self->output);
+    return NULL;
+}
+
+
+/**
+ *
+ * Initialize global state
+ *
+ */
+void init_globals(int num_threads) {
+
+    globals = (shared_globals *)malloc(sizeof(shared_globals));
+    globals->threads = (coro_thread *)calloc(num_threads, sizeof(coro_thread));
+    globals->num_threads = num_threads;
+    globals->log_weights = (double *)malloc(NUM_PARTICLES*sizeof(double));
+    globals->n_offspring = (int *)malloc(NUM_PARTICLES*sizeof(int));
+    globals->offspring_slot = (int *)malloc(NUM_PARTICLES*sizeof(int));
+    globals->seeds = (unsigned long *)malloc(NUM_PARTICLES*sizeof(unsigned long));
+
+    pthread_barrier_init(&globals->observe_barrier, NULL, num_threads);
+    pthread_mutex_init(&globals->stdout_mutex, NULL);
+
+    globals->current_observe = 0;
+    globals->resampled = false;
+    globals->finished = false;
+    globals->log_marginal_likelihood = 0.0;
+    sync_schedule_init(&globals->schedule, &SYNC_POLICY);
+}
+
+
+/**
+ * Map a thread's execution stack, with a guard page at the bottom
+ *
+ */
+static void init_thread(coro_thread *thread, int id, int first_index, int count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t stack_size = ((size_t)STACK_KB*1024 + page - 1) / page * page;
+    char *mapping = mmap(NULL, stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (MAP_FAILED == mapping) {
+        perror("mmap");
+        exit(1);
+    }
+    mprotect(mapping, page, PROT_NONE);
+    particle_arena_init(&thread->arena, (size_t)ARENA_KB*1024);
+
+    thread->id = id;
+    thread->stack = mapping + page;
+    thread->stack_top = thread->stack + stack_size;
+    thread->count = count;
+    thread->capacity = count;
+    thread->particles = malloc(count*sizeof(particle));
+    thread->next_particles = malloc(count*sizeof(particle));
+    for (int i=0; i<count; i++) {
+        particle *p = &thread->particles[i];
+        p->index = first_index + i;
+        p->log_weight = 0;
+        p->seed = gen_new_rng_seed();
+        p->current_observe = 0;
+        p->force_sync = false;
+        p->done = false;
+        p->snap = NULL;
+        p->predict = predict_buffer_new();
+    }
+}
+
+
+/**
+ * Run the program in a child, up to its first synchronizing observe, to find
+ * out whether it registers any particle state
+ *
+ */
+static bool program_registers_state(int (*f)(int, char**), int argc, char **argv) {
+    fflush(stdout);
+    pid_t prerun_pid = fork();
+    if (prerun_pid == 0) {
+        IS_PRERUN = true;
+        f(argc, argv);
+        _exit(particle_state_count() > 0);
+    } else if (prerun_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    int status;
+    waitpid(prerun_pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+
+/**
+ *
+ * initialize engine and start inference over a supplied program
+ *
+ */
+int infer(int (*f)(int, char**), int argc, char **argv) {
+
+    // Initialize random number generators
+    erp_rng_init(INITIAL_SEED);
+
+    program = f;
+    program_argc = argc;
+    program_argv = argv;
+
+    int num_threads = (NUM_THREADS > 0) ? NUM_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > NUM_PARTICLES) num_threads = NUM_PARTICLES;
+
+    // Registered regions are shared by all threads, so fall back to one
+    if (num_threads > 1 && program_registers_state(f, argc, argv)) {
+        if (NUM_THREADS > 1) fprintf(stderr, "coro: program registers particle_state; running on 1 thread\n");
+        num_threads = 1;
+    }
+    debug_print(1, "Running %d particles on %d threads\n", NUM_PARTICLES, num_threads);
+
+    // Create globals, and deal out the initial particles evenly
+    init_globals(num_threads);
+    int first_index = 0;
+    for (int t=0; t<num_threads; t++) {
+        int count = NUM_PARTICLES/num_threads + ((t < NUM_PARTICLES % num_threads) ? 1 : 0);
+        init_thread(&globals->threads[t], t, first_index, count);
+        first_index += count;
+    }
+    globals->engine_seed = gen_new_rng_seed();
+
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
+    // Start timer
+    struct timeval start_time;
+    if (TIME_EXECUTION) {
+        gettimeofday(&start_time, NULL);
+        debug_print(1, "Starting timer at %ld.%06d\n", start_time.tv_sec, (int)start_time.tv_usec);
+    }
+
+    // Run SMC once
+    for (int t=0; t<num_threads; t++) {
+        if (pthread_create(&globals->threads[t].thread, NULL, thread_main, &globals->threads[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t=0; t<num_threads; t++) {
+        pthread_join(globals->threads[t].thread, NULL);
+    }
+    sample_file_close();
+    aggregate_print(stdout, 0);
+
+    // Print out timing info
+    if (TIME_EXECUTION) print_walltime(&globals->stdout_mutex, 1, &start_time);
+
+    // Report how many synchronizing observes were actually barriers
+    if (SYNC_POLICY.type != SYNC_ALWAYS) sync_schedule_print_stats(&globals->schedule, &SYNC_POLICY, stderr);
+
+    // Print marginal likelihood estimate
+    if (ESTIMATE_MARGINAL_LIKELIHOOD) {
+        globals->log_marginal_likelihood += log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
+        pthread_mutex_lock(&globals->stdout_mutex);
+        fprintf(stdout, "log_marginal_likelihood,%0.8f,,%d\n", globals->log_marginal_likelihood, NUM_PARTICLES);
+        fflush(stdout);
+        pthread_mutex_unlock(&globals->stdout_mutex);
+    }
+
+    return 0;
+}
+
+
+void parse_args(int argc, char **argv) {
+
+    // Parse args
+    static struct option long_options[] = {
+        {"particles", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 'j'},
+        {"stack_kb", required_argument, 0, 'k'},
+        {"arena_kb", required_argument, 0, 'a'},
+        {"timeit", no_argument, 0, 't'},
+        {"weighted", no_argument, 0, 'w'},
+        {"evidence", no_argument, 0, 'e'},
+        {"rng_seed", required_argument, 0, 'r'},
+        {"resampler", required_argument, 0, 'R'},
+        {"sync_policy", required_argument, 0, 's'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
+    };
+    int c, option_index;
+
+    while((c = getopt_long(argc, argv, "p:j:k:a:twer:R:s:o:O:A::", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'p':
+                NUM_PARTICLES = atoi(optarg);
+                break;
+            case 'j':
+                NUM_THREADS = atoi(optarg);
+                break;
+            case 'k':
+                STACK_KB = atoi(optarg);
+                break;
+            case 'a':
+                ARENA_KB = atoi(optarg);
+                break;
+            case 't':
+                TIME_EXECUTION = true;
+                break;
+            case 'w':
+                WEIGHTED_OUTPUT = true;
+                break;
+            case 'e':
+                ESTIMATE_MARGINAL_LIKELIHOOD = true;
+                break;
+            case 'r':
+                INITIAL_SEED = atol(optarg);
+                break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
+            case 'R':
+                if (!resampler_from_name(optarg, &RESAMPLER)) {
+                    fprintf(stderr, "Unknown resampler: %s (multinomial, stratified or systematic; residual is the same as systematic)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                if (!sync_policy_from_name(optarg, &SYNC_POLICY)) {
+                    fprintf(stderr, "Unknown sync policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+        }
+    }
+
+    debug_print(1, "Running with %d particles\n", NUM_PARTICLES);
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>    /* For O_* constants */
 // #include <getopt.h>
 // #include <stdarg.h>
@@ -16,27 +17,38 @@
 
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "output-ring.h"
+#include "reaper.h"
+#include "sample-file.h"
+#include "aggregate.h"
+#include "run-stats.h"
+#include "profile.h"
+#include "perf-counters.h"
+#include "mem-sampler.h"
+#include "resample.h"
 
 
 
 // Name of file pointer for shared memory object
 static char SHM_FILE[256];
 
-
-
-
+// Handlers to run in every new particle process, in registration order
+#define MAX_FORK_HOOKS 8
+static void (*fork_hooks[MAX_FORK_HOOKS])();
+static int num_fork_hooks = 0;
 
 
 /**
- * Special printf function "predict", for named doubles
+ * Special printf function "predict", for named doubles; engines store these
+ * (and predict_int) as typed records, see predict-buffer.h
  *
  */
-void predict_float(const char *name, const double value) {
-    predict("%s,%f\n", name, value);
+void predict_double(const char *name, const double value) {
+    predict_value(name, value);
 }
 
-void predict_int(const char *name, const int value) {
-    predict("%s,%d\n", name, value);
+void predict_float(const char *name, const double value) {
+    predict_value(name, value);
 }
 
 void predict_chars(const char *name, const char *chars) {
@@ -82,6 +94,7 @@ void init_shared_mutex(pthread_mutex_t *mutex, pthread_cond_t *cond) {
 
 
 void print_walltime(pthread_mutex_t *mutex, int iteration_count, struct timeval *start_time) {
+    output_ring_sync();
     pthread_mutex_lock(mutex);
     struct timeval current_time;
     gettimeofday(&current_time, NULL);
@@ -96,6 +109,34 @@ void print_walltime(pthread_mutex_t *mutex, int iteration_count, struct timeval
     pthread_mutex_unlock(mutex);
 }
 
+void format_predicts(const predict_buffer *predicts, UT_string *out) {
+    if (aggregate_enabled()) {
+        aggregate_predicts(predicts, 0);
+    } else if (sample_file_enabled()) {
+        predict_buffer_encode(predicts, out);
+    } else {
+        predict_buffer_format(predicts, out);
+    }
+}
+
+void format_weighted_predicts(const predict_buffer *predicts, UT_string *out, double log_weight, long id) {
+    if (aggregate_enabled()) {
+        aggregate_predicts(predicts, log_weight);
+    } else if (sample_file_enabled()) {
+        predict_buffer_encode_weighted(predicts, out, log_weight, id);
+    } else {
+        predict_buffer_format_weighted(predicts, out, log_weight, id);
+    }
+}
+
+void flush_predicts(pthread_mutex_t *mutex, const predict_buffer *predicts) {
+    UT_string *formatted;
+    utstring_new(formatted);
+    format_predicts(predicts, formatted);
+    flush_output(mutex, formatted);
+    utstring_free(formatted);
+}
+
 
 /**
  * In all implementations, observe is just an alias for weight_trace
@@ -121,6 +162,7 @@ void cleanup_children(int num_children_to_eat, int *const total_children) {
         }
         num_children_to_eat--;
         *total_children = *total_children - 1;
+        reaper_note_reaped(1);
         debug_print(4,"Child process %d->%d terminated (%d remaining)\n", getpid(), terminated_pid, *total_children);
     }
 }
@@ -142,6 +184,7 @@ void cleanup_completed_children(int *const total_children) {
         if (terminated_pid > 0) {
             // A positive return value indicates we actually collected a terminated child process
             *total_children = *total_children - 1;
+            reaper_note_reaped(1);
         } else if (terminated_pid == 0) {
             // No child particles have terminated; return
             break;
@@ -158,14 +201,28 @@ void cleanup_completed_children(int *const total_children) {
  *
  */
 void flush_output(pthread_mutex_t *mutex, UT_string *buffer) {
+    uint64_t start = profile_clock();
+    if (output_ring_active()) {
+        output_ring_write(utstring_body(buffer), utstring_len(buffer));
+        profile_end(PROFILE_FLUSH, start);
+        return;
+    }
+    // No ring: write straight to the file descriptor (stdout or the sample spool), bypassing stdio
     pthread_mutex_lock(mutex);
-    int stdout_copy = dup(STDOUT_FILENO);
-    FILE* out = fdopen(stdout_copy, "w");
-    fprintf(out, "%s", utstring_body(buffer));
-    fflush(out);
-    // TODO for some reason, calling fclose() here can freeze, on linux.
-    //fclose(out);
+    const char *body = utstring_body(buffer);
+    size_t length = utstring_len(buffer);
+    while (length > 0) {
+        ssize_t count = write(sample_file_fd(), body, length);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        body += count;
+        length -= count;
+    }
     pthread_mutex_unlock(mutex);
+    profile_end(PROFILE_FLUSH, start);
 }
 
 
@@ -189,14 +246,76 @@ void *shared_memory_alloc(int mem_size) {
 }
 
 
+void register_fork_hook(void (*hook)()) {
+    assert(num_fork_hooks < MAX_FORK_HOOKS);
+    if (num_fork_hooks == 0) {
+        pthread_atfork(NULL, NULL, run_fork_hooks);
+    }
+    fork_hooks[num_fork_hooks++] = hook;
+}
+
+void run_fork_hooks() {
+    for (int i=0; i<num_fork_hooks; i++) {
+        fork_hooks[i]();
+    }
+}
+
+
+/**
+ * Remove every --name option before any "--" from argv, so that engines and
+ * programs never see it, and update *argc. Accepts --name=value, and either
+ * --name value (if the option takes a value) or a plain --name. Returns the
+ * last value given, "" for a plain --name, or NULL if there is none.
+ *
+ */
+static const char *take_option(int *argc, char **argv, const char *name, bool takes_value) {
+    size_t length = strlen(name);
+    const char *value = NULL;
+    int kept = 1;
+    for (int argi = 1; argi < *argc; argi++) {
+        const char *arg = argv[argi];
+        bool matches = (strncmp(arg, "--", 2) == 0 && strncmp(arg + 2, name, length) == 0);
+        if (strcmp(arg, "--") == 0) {
+            while (argi < *argc) argv[kept++] = argv[argi++];
+            break;
+        } else if (matches && arg[2 + length] == '=') {
+            value = arg + 3 + length;
+        } else if (matches && arg[2 + length] == '\0' && !takes_value) {
+            value = "";
+        } else if (matches && arg[2 + length] == '\0' && argi + 1 < *argc) {
+            value = argv[++argi];
+        } else {
+            argv[kept++] = argv[argi];
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    return value;
+}
+
+
 /**
  * Program execution wrapper
  *
  */
 int program_execution_wrapper(int argc, char **argv) {
-    // clock_t start, end;
-    // FILE *fp;
-    // start = clock();
+    // Options handled here rather than by the engines
+    run_stats_start(argv[0], take_option(&argc, argv, "stats_file", true));
+    profile_start(argv[0], take_option(&argc, argv, "profile", false));
+    perf_counters_start(take_option(&argc, argv, "perf_counters", false) != NULL);
+    const char *mem_sample_ms = take_option(&argc, argv, "mem_sample_ms", true);
+    mem_sampler_start((mem_sample_ms != NULL) ? atoi(mem_sample_ms) : 0);
+    const char *resample_threads = take_option(&argc, argv, "resample_threads", true);
+    if (resample_threads != NULL) {
+        int num_threads = 0, min_count = 0;
+        sscanf(resample_threads, "%d,%d", &num_threads, &min_count);
+        resample_set_threads(num_threads, min_count);
+    }
+    const char *rng = take_option(&argc, argv, "rng", true);
+    if (rng != NULL && !erp_rng_start(rng)) {
+        fprintf(stderr, "Unknown generator --rng %s (mt19937 or philox)\n", rng);
+        exit(1);
+    }
     parse_args(argc, argv);
 
     char *fixed_argv[argc];
@@ -229,8 +348,19 @@ int program_execution_wrapper(int argc, char **argv) {
 
     // TODO NOTE shouldn't have to unlink this, except after a crash.
     shm_unlink(SHM_FILE);
+    profile_init();
+    perf_counters_init();
+    mem_sampler_init();
+
+    int status = infer(&__program, argc, argv);
+
+    // Per-phase timings, with --profile, per-particle counters, with
+    // --perf_counters, and the memory of the process tree, with --mem_sample_ms
+    profile_report();
+    perf_counters_report();
+    mem_sampler_report();
 
-    // end = clock();
-    // printf("%lu", end-start);
-    return infer(&__program, argc, argv);
+    // Resource usage of the whole run, on stderr or --stats_file
+    run_stats_report();
+    return status;
 }
@@ -3,6 +3,8 @@
 #include <pthread.h>
 
 #include "utstring.h"
+#include "barrier.h"
+#include "predict-buffer.h"
 
 // DEBUG_LEVEL. 0 = none, 1 = minimal, 2 = detailed, 3 = verbose, 4 = absurdly verbose
 #ifndef DEBUG_LEVEL
@@ -37,6 +39,16 @@ void *shared_memory_alloc(int mem_size);
  */
 void init_shared_mutex(pthread_mutex_t *mutex, pthread_cond_t *cond);
 
+/**
+ * Register a handler to run in the child whenever a particle process is
+ * created. fork() runs the handlers through pthread_atfork; code which creates
+ * processes some other way (e.g. a raw clone(), which skips the atfork
+ * handlers) calls run_fork_hooks in the child instead.
+ *
+ */
+void register_fork_hook(void (*hook)());
+void run_fork_hooks();
+
 
 /**
  * Print wall clock time to stdout, synchronized via supplied mutex
@@ -65,11 +77,28 @@ void cleanup_completed_children(int *const total_children);
 
 
 /**
- * Flush predict buffer to stdout in a manner which is (hopefully) process- and fork-safe
+ * Flush predict buffer to stdout in a manner which is (hopefully) process- and fork-safe:
+ * through the output ring, if the engine set one up, otherwise under the mutex
  *
  */
 void flush_output(pthread_mutex_t *mutex, UT_string *buffer);
 
+/**
+ * Append a particle's predicts to `out` in the selected output format (text,
+ * or rows for the sample file); the weighted version adds the particle's log
+ * weight and id to each line. With --aggregate, they are summarized instead,
+ * and nothing is appended.
+ *
+ */
+void format_predicts(const predict_buffer *predicts, UT_string *out);
+void format_weighted_predicts(const predict_buffer *predicts, UT_string *out, double log_weight, long id);
+
+/**
+ * Format a particle's predicts and flush them, as above
+ *
+ */
+void flush_predicts(pthread_mutex_t *mutex, const predict_buffer *predicts);
+
 
 #define __PMCMC_SHARED__
 #endif
@@ -1,23 +1,230 @@
 #include <assert.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "distributions.h"
 #include "erp.h"
 
-static rk_state state;
+// Per-thread, so that engines running several particles per process (coro)
+// can give each worker thread its own stream
+static __thread rk_state state;
 
-void erp_rng_init() {
-    rk_seed(time(NULL), &state);
+// The run's stream, and the caller's while it draws from the run's
+static rk_state *run_state = NULL;
+static __thread rk_state saved_state;
+
+// Key for the seeds of offspring, fixed by the run's seed
+static uint64_t offspring_key = 0;
+
+/*
+ * Ziggurat tables (Marsaglia & Tsang, "The ziggurat method for generating
+ * random variables", 2000), with 256 layers and 64-bit draws: the low 8 bits
+ * pick a layer and the rest, scaled by w[i], give x. x is accepted outright
+ * if it falls under the next layer up (k[i]), which is ~99% of the time.
+ * Computed once by erp_rng_init, before any fork, and only read afterwards.
+ */
+#define ZIGGURAT_LAYERS 256
+#define NORMAL_R 3.6541528853610088         // start of the normal tail
+#define NORMAL_V 4.92867323399e-3           // area of each layer
+#define EXPONENTIAL_R 7.69711747013104972
+#define EXPONENTIAL_V 3.949659822581572e-3
+
+static uint64_t normal_k[ZIGGURAT_LAYERS], exponential_k[ZIGGURAT_LAYERS];
+static double normal_w[ZIGGURAT_LAYERS], exponential_w[ZIGGURAT_LAYERS];
+static double normal_f[ZIGGURAT_LAYERS], exponential_f[ZIGGURAT_LAYERS];
+
+static void ziggurat_init() {
+    // Normal: 52 bits of magnitude (one more is the sign)
+    const double normal_m = 4503599627370496.0;
+    double d = NORMAL_R, t = NORMAL_R;
+    double q = NORMAL_V / exp(-0.5*d*d);
+    normal_k[0] = (uint64_t)((d/q)*normal_m);
+    normal_k[1] = 0;
+    normal_w[0] = q/normal_m;
+    normal_w[ZIGGURAT_LAYERS-1] = d/normal_m;
+    normal_f[0] = 1;
+    normal_f[ZIGGURAT_LAYERS-1] = exp(-0.5*d*d);
+    for (int i=ZIGGURAT_LAYERS-2; i>=1; i--) {
+        d = sqrt(-2*log(NORMAL_V/d + exp(-0.5*d*d)));
+        normal_k[i+1] = (uint64_t)((d/t)*normal_m);
+        t = d;
+        normal_f[i] = exp(-0.5*d*d);
+        normal_w[i] = d/normal_m;
+    }
+
+    // Exponential: 56 bits
+    const double exponential_m = 72057594037927936.0;
+    d = t = EXPONENTIAL_R;
+    q = EXPONENTIAL_V / exp(-d);
+    exponential_k[0] = (uint64_t)((d/q)*exponential_m);
+    exponential_k[1] = 0;
+    exponential_w[0] = q/exponential_m;
+    exponential_w[ZIGGURAT_LAYERS-1] = d/exponential_m;
+    exponential_f[0] = 1;
+    exponential_f[ZIGGURAT_LAYERS-1] = exp(-d);
+    for (int i=ZIGGURAT_LAYERS-2; i>=1; i--) {
+        d = -log(EXPONENTIAL_V/d + exp(-d));
+        exponential_k[i+1] = (uint64_t)((d/t)*exponential_m);
+        t = d;
+        exponential_f[i] = exp(-d);
+        exponential_w[i] = d/exponential_m;
+    }
+}
+
+static inline uint64_t random_u64() {
+    const uint64_t high = rk_random(&state);
+    return (high << 32) | rk_random(&state);
+}
+
+static double standard_normal() {
+    for (;;) {
+        uint64_t r = random_u64();
+        const int i = r & 0xff;
+        const int sign = (r >> 8) & 1;
+        const uint64_t magnitude = r >> 12;
+        double x = magnitude * normal_w[i];
+        if (magnitude < normal_k[i]) return sign ? -x : x;
+        if (i == 0) {
+            // Tail beyond NORMAL_R (Marsaglia 1964)
+            double xx, yy;
+            do {
+                xx = -log(1 - rk_double(&state)) / NORMAL_R;
+                yy = -log(1 - rk_double(&state));
+            } while (yy + yy < xx*xx);
+            return sign ? -(NORMAL_R + xx) : NORMAL_R + xx;
+        }
+        if (normal_f[i] + rk_double(&state)*(normal_f[i-1] - normal_f[i]) < exp(-0.5*x*x)) {
+            return sign ? -x : x;
+        }
+    }
+}
+
+static double standard_exponential() {
+    for (;;) {
+        uint64_t r = random_u64();
+        const int i = r & 0xff;
+        const uint64_t magnitude = r >> 8;
+        double x = magnitude * exponential_w[i];
+        if (magnitude < exponential_k[i]) return x;
+        if (i == 0) return EXPONENTIAL_R - log(1 - rk_double(&state));
+        if (exponential_f[i] + rk_double(&state)*(exponential_f[i-1] - exponential_f[i]) < exp(-x)) {
+            return x;
+        }
+    }
+}
+
+/**
+ * Marsaglia & Tsang, "A simple method for generating gamma variables", 2000,
+ * for shape >= 1
+ *
+ */
+static double marsaglia_tsang_gamma(double shape) {
+    const double d = shape - 1.0/3;
+    const double c = 1 / sqrt(9*d);
+    for (;;) {
+        double x, v;
+        do {
+            x = standard_normal();
+            v = 1 + c*x;
+        } while (v <= 0);
+        v = v*v*v;
+        const double u = rk_double(&state);
+        if (u < 1 - 0.0331*(x*x)*(x*x) || log(u) < 0.5*x*x + d*(1 - v + log(v))) {
+            return d*v;
+        }
+    }
+}
+
+// For shape < 1: Gamma(shape+1) * U^(1/shape), with U = exp(-E), E ~ Exp(1)
+static double standard_gamma(double shape) {
+    if (shape == 1) return standard_exponential();
+    if (shape > 1) return marsaglia_tsang_gamma(shape);
+    return marsaglia_tsang_gamma(shape + 1) * exp(-standard_exponential() / shape);
+}
+
+// Its log, which stays finite for tiny shapes where the variate underflows to 0
+static double log_standard_gamma(double shape) {
+    if (shape >= 1) return log(standard_gamma(shape));
+    return log(marsaglia_tsang_gamma(shape + 1)) - standard_exponential() / shape;
+}
+
+
+// Counter-based (Philox) streams rather than the Mersenne Twister
+#ifdef ERP_RNG_PHILOX
+static bool counter_rng = true;
+#else
+static bool counter_rng = false;
+#endif
+
+int erp_rng_start(const char *name) {
+    if (strcmp(name, "philox") == 0) {
+        counter_rng = true;
+    } else if (strcmp(name, "mt19937") == 0) {
+        counter_rng = false;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void erp_rng_init(long seed) {
+    ziggurat_init();
+    set_rng_seed((seed >= 0) ? seed : time(NULL));
+    if (run_state == NULL) {
+        run_state = mmap(NULL, sizeof(rk_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (run_state == MAP_FAILED) {
+            perror("mmap");
+            run_state = NULL;
+            return;
+        }
+    }
+    saved_state = state;
+    set_rng_seed(gen_new_rng_seed());
+    *run_state = state;
+    state = saved_state;
+    offspring_key = gen_new_rng_seed();
 }
 
 unsigned long int gen_new_rng_seed() {
-    return rk_random(&state);
+    // A 64-bit stream name, so that lineages of many particles don't collide
+    return counter_rng ? rk_ulong(&state) : rk_random(&state);
+}
+
+// SplitMix64's finalizer: a bijection on 64 bits which mixes every input bit
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+unsigned long int gen_offspring_rng_seed(unsigned long int step, unsigned long int slot) {
+    return mix64(mix64(offspring_key ^ step) ^ slot);
 }
 
 void set_rng_seed(unsigned long int seed) {
-    rk_seed(seed, &state);
+    if (counter_rng) {
+        rk_seed_counter(seed, &state);
+    } else {
+        rk_seed(seed, &state);
+    }
+}
+
+void enter_run_rng_stream() {
+    if (run_state == NULL) return;
+    saved_state = state;
+    state = *run_state;
+}
+
+void leave_run_rng_stream() {
+    if (run_state == NULL) return;
+    *run_state = state;
+    state = saved_state;
 }
 
 
@@ -44,7 +251,7 @@ double poisson_lnp(long x, double rate) {
 }
 
 double gamma_rng(double shape, double rate) {
-    return rk_standard_gamma(&state, shape) / rate;
+    return standard_gamma(shape) / rate;
 }
 
 double gamma_lnp(double x, double shape, double rate) {
@@ -52,7 +259,26 @@ double gamma_lnp(double x, double shape, double rate) {
 }
 
 double beta_rng(double a, double b) {
-    return rk_beta(&state, a, b);
+    if (a >= 1 && b >= 1) {
+        // X / (X + Y) for X ~ Gamma(a), Y ~ Gamma(b)
+        const double x = standard_gamma(a);
+        return x / (x + standard_gamma(b));
+    }
+    if (a < 1 && b < 1) {
+        // Johnk's algorithm: accept when X + Y <= 1, for X = U^(1/a), Y = V^(1/b)
+        for (;;) {
+            const double log_x = -standard_exponential() / a;
+            const double log_y = -standard_exponential() / b;
+            const double x = exp(log_x), y = exp(log_y);
+            if (x + y > 1) continue;
+            if (x + y > 0) return x / (x + y);
+            // Both underflowed: divide in log space
+            return 1 / (1 + exp(log_y - log_x));
+        }
+    }
+    // The same in log space, where small shapes underflow the gamma variates
+    const double log_x = log_standard_gamma(a);
+    return 1 / (1 + exp(log_standard_gamma(b) - log_x));
 }
 
 double beta_lnp(double x, double a, double b) {
@@ -61,8 +287,7 @@ double beta_lnp(double x, double a, double b) {
 }
 
 double normal_rng(double mean, double variance) {
-    const double sd = sqrt(variance);
-    return rk_normal(&state, mean, sd);
+    return mean + sqrt(variance)*standard_normal();
 }
 
 double normal_lnp(double x, double mean, double variance) {
@@ -72,6 +297,14 @@ double normal_lnp(double x, double mean, double variance) {
     return -0.5*xmms/variance - Z;
 }
 
+double exponential_rng(double rate) {
+    return standard_exponential() / rate;
+}
+
+double exponential_lnp(double x, double rate) {
+    return (x < 0) ? -INFINITY : log(rate) - rate*x;
+}
+
 int uniform_discrete_rng(int num_elements) {
     return rk_interval(num_elements-1, &state);
 }
@@ -96,6 +329,82 @@ long sample_long_rng() {
     return rk_long(&state);
 }
 
+
+// Batched variants, ERP_BATCH draws at a time
+#define ERP_BATCH 256
+
+// Hot loops are compiled for AVX-512 and AVX2 as well, picked at load time
+#if defined(__x86_64__) && defined(__linux__)
+#define ERP_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define ERP_SIMD_CLONES
+#endif
+
+// Two 32-bit words to a double in [0, 1), exactly as rk_double
+static inline double words_to_double(uint32_t a, uint32_t b) {
+    return ((a >> 5) * 67108864.0 + (b >> 6)) / 9007199254740992.0;
+}
+
+// Next m uniforms on [0, 1)
+static void unit_uniforms(double *u, int m) {
+    uint32_t words[2*ERP_BATCH];
+    rk_random_n(words, 2*m, &state);
+    for (int j=0; j<m; j++) {
+        u[j] = words_to_double(words[2*j], words[2*j+1]);
+    }
+}
+
+void uniform_rng_n(double *x, int n, double lower, double upper) {
+    const double scale = upper - lower;
+    for (int i=0; i<n; i+=ERP_BATCH) {
+        const int m = (n - i < ERP_BATCH) ? n - i : ERP_BATCH;
+        unit_uniforms(x + i, m);
+        for (int j=0; j<m; j++) x[i+j] = lower + scale*x[i+j];
+    }
+}
+
+void flip_rng_n(unsigned int *x, int n, double p) {
+    double u[ERP_BATCH];
+    for (int i=0; i<n; i+=ERP_BATCH) {
+        const int m = (n - i < ERP_BATCH) ? n - i : ERP_BATCH;
+        unit_uniforms(u, m);
+        for (int j=0; j<m; j++) x[i+j] = (u[j] < p) ? 1 : 0;
+    }
+}
+
+/**
+ * Box-Muller: uniforms u[j] and u[pairs+j] give normals z[j] and z[pairs+j].
+ * Separate loops, so that log, cos and sin each vectorize (a loop with both
+ * cos and sin is turned into sincos calls, which don't); with the AVX2 and
+ * AVX-512 clones, through glibc's vector math library
+ *
+ */
+ERP_SIMD_CLONES
+static void box_muller(double *z, const double *u, int pairs) {
+    double r[ERP_BATCH/2], theta[ERP_BATCH/2];
+    for (int j=0; j<pairs; j++) r[j] = sqrt(-2*log(1 - u[j]));
+    for (int j=0; j<pairs; j++) theta[j] = 2*M_PI*u[pairs+j];
+    for (int j=0; j<pairs; j++) z[j] = r[j]*cos(theta[j]);
+    for (int j=0; j<pairs; j++) z[pairs+j] = r[j]*sin(theta[j]);
+}
+
+void normal_rng_n(double *x, int n, double mean, double variance) {
+    const double sd = sqrt(variance);
+    double u[ERP_BATCH], z[ERP_BATCH];
+    for (int i=0; i<n; i+=ERP_BATCH) {
+        const int m = (n - i < ERP_BATCH) ? n - i : ERP_BATCH;
+        const int pairs = (m + 1) / 2;
+        unit_uniforms(u, 2*pairs);
+        box_muller(z, u, pairs);
+        for (int j=0; j<m; j++) x[i+j] = mean + sd*z[j];
+    }
+}
+
+void gamma_rng_n(double *x, int n, double shape, double rate) {
+    // Rejection sampling: one draw at a time
+    for (int i=0; i<n; i++) x[i] = gamma_rng(shape, rate);
+}
+
 unsigned int discrete_rng(double *p, int K) {
     const double u = rk_uniform(&state, 0, 1);
     double sum = 0;
@@ -129,6 +438,198 @@ double discrete_lnp(int x, double *p, int K) {
     }
 }
 
+void categorical_table_new(categorical_table *table, const double *p, int K) {
+    assert(K > 0);
+    table->K = K;
+    table->columns = malloc(K*sizeof(categorical_alias));
+    table->log_p = malloc(K*sizeof(double));
+    double sum = 0;
+    for (int k=0; k<K; k++) sum += p[k];
+
+    // Vose's method: pair each column with less than the average mass with
+    // one that has more, which tops it up to exactly the average
+    double *scaled = malloc(K*sizeof(double));
+    int *small = malloc(K*sizeof(int));
+    int *large = malloc(K*sizeof(int));
+    int num_small = 0, num_large = 0;
+    for (int k=0; k<K; k++) {
+        table->log_p[k] = log(p[k]/sum);
+        scaled[k] = p[k]*K/sum;
+        if (scaled[k] < 1) {
+            small[num_small++] = k;
+        } else {
+            large[num_large++] = k;
+        }
+    }
+    while (num_small > 0 && num_large > 0) {
+        const int less = small[--num_small];
+        const int more = large[--num_large];
+        table->columns[less] = (categorical_alias) { scaled[less], more };
+        scaled[more] = (scaled[more] + scaled[less]) - 1;
+        if (scaled[more] < 1) {
+            small[num_small++] = more;
+        } else {
+            large[num_large++] = more;
+        }
+    }
+    // Whatever is left is full, up to rounding
+    while (num_large > 0) {
+        const int k = large[--num_large];
+        table->columns[k] = (categorical_alias) { 1, k };
+    }
+    while (num_small > 0) {
+        const int k = small[--num_small];
+        table->columns[k] = (categorical_alias) { 1, k };
+    }
+    free(scaled);
+    free(small);
+    free(large);
+}
+
+void categorical_table_free(categorical_table *table) {
+    free(table->columns);
+    free(table->log_p);
+}
+
+unsigned int categorical_rng(const categorical_table *table) {
+    // One uniform picks the column, and its fractional part the side
+    const double u = rk_double(&state) * table->K;
+    const int k = (u < table->K) ? (int)u : table->K - 1;
+    const categorical_alias column = table->columns[k];
+    return (u - k < column.threshold) ? k : column.alias;
+}
+
+double categorical_lnp(int x, const categorical_table *table) {
+    if (x < 0 || x >= table->K) {
+        return -INFINITY;
+    } else {
+        return table->log_p[x];
+    }
+}
+
+typedef struct {
+    double p;
+    int k;
+} weighted_index;
+
+static int by_decreasing_p(const void *x, const void *y) {
+    const double a = ((const weighted_index *)x)->p, b = ((const weighted_index *)y)->p;
+    return (a < b) - (a > b);
+}
+
+static int by_index(const void *x, const void *y) {
+    return ((const weighted_index *)x)->k - ((const weighted_index *)y)->k;
+}
+
+void sparse_categorical_new(sparse_categorical *dist, const double *p, int K, double tail_mass) {
+    double sum = 0;
+    int nonzero = 0;
+    for (int k=0; k<K; k++) {
+        sum += p[k];
+        if (p[k] > 0) nonzero++;
+    }
+    if (nonzero == 0) {
+        fprintf(stderr, "[ERROR] sparse_categorical_new: no nonzero entries, K = %d\n", K);
+        *dist = (sparse_categorical) { .K = K };
+        return;
+    }
+    weighted_index *entries = malloc(nonzero*sizeof(weighted_index));
+    int n = 0;
+    for (int k=0; k<K; k++) {
+        if (p[k] > 0) entries[n++] = (weighted_index) { p[k]/sum, k };
+    }
+    qsort(entries, nonzero, sizeof(weighted_index), by_decreasing_p);
+
+    // Head: the largest entries, until what is left is at most tail_mass
+    double remaining = 1;
+    int num_head = 0;
+    while (num_head < nonzero && remaining > tail_mass) {
+        remaining -= entries[num_head++].p;
+    }
+    const int num_tail = nonzero - num_head;
+    double tail_total = 0;
+    for (int j=num_head; j<nonzero; j++) tail_total += entries[j].p;
+
+    dist->K = K;
+    dist->num_head = num_head;
+    dist->head = malloc(num_head*sizeof(int));
+    double *head_p = malloc((num_head + 1)*sizeof(double));
+    for (int j=0; j<num_head; j++) {
+        dist->head[j] = entries[j].k;
+        head_p[j] = entries[j].p;
+    }
+    head_p[num_head] = tail_total;
+    categorical_table_new(&dist->table, head_p, num_head + (num_tail > 0 ? 1 : 0));
+    free(head_p);
+
+    dist->num_tail = num_tail;
+    dist->tail = malloc(num_tail*sizeof(int));
+    dist->tail_cdf = malloc(num_tail*sizeof(double));
+    double cumsum = 0;
+    for (int j=0; j<num_tail; j++) {
+        dist->tail[j] = entries[num_head + j].k;
+        cumsum += entries[num_head + j].p;
+        dist->tail_cdf[j] = cumsum / tail_total;
+    }
+
+    qsort(entries, nonzero, sizeof(weighted_index), by_index);
+    dist->num_nonzero = nonzero;
+    dist->index = malloc(nonzero*sizeof(int));
+    dist->log_p = malloc(nonzero*sizeof(double));
+    for (int j=0; j<nonzero; j++) {
+        dist->index[j] = entries[j].k;
+        dist->log_p[j] = log(entries[j].p);
+    }
+    free(entries);
+}
+
+void sparse_categorical_free(sparse_categorical *dist) {
+    categorical_table_free(&dist->table);
+    free(dist->head);
+    free(dist->tail);
+    free(dist->tail_cdf);
+    free(dist->index);
+    free(dist->log_p);
+}
+
+unsigned int sparse_categorical_rng(const sparse_categorical *dist) {
+    assert(dist->num_nonzero > 0);
+    const unsigned int j = categorical_rng(&dist->table);
+    if (j < dist->num_head) return dist->head[j];
+
+    // The tail: first entry whose cumulative probability exceeds u
+    const double u = rk_double(&state);
+    int lower = 0, upper = dist->num_tail - 1;
+    while (lower < upper) {
+        const int middle = (lower + upper) / 2;
+        if (dist->tail_cdf[middle] > u) {
+            upper = middle;
+        } else {
+            lower = middle + 1;
+        }
+    }
+    return dist->tail[lower];
+}
+
+double sparse_categorical_lnp(int x, const sparse_categorical *dist) {
+    int lower = 0, upper = dist->num_nonzero;
+    while (lower < upper) {
+        const int middle = (lower + upper) / 2;
+        if (dist->index[middle] < x) {
+            lower = middle + 1;
+        } else {
+            upper = middle;
+        }
+    }
+    return (lower < dist->num_nonzero && dist->index[lower] == x) ? dist->log_p[lower] : -INFINITY;
+}
+
+void sparse_categorical_rows_new(sparse_categorical *rows, const double *matrix, int num_rows, int K, double tail_mass) {
+    for (int r=0; r<num_rows; r++) {
+        sparse_categorical_new(&rows[r], matrix + (size_t)r*K, K, tail_mass);
+    }
+}
+
 unsigned int discrete_log_rng(double *log_p, int K) {
     // log_p might be unnormalized
 //     double A = log_p[0];
@@ -178,11 +679,9 @@ double dirichlet_lnp(double *x, double *alpha, int K) {
 }
 
 void dirichlet_sym_rng(double *x, double alpha, int K) {
+    gamma_rng_n(x, K, alpha, 1);
     double sum = 0;
-    for (int k=0; k<K; k++) {
-        x[k] = gamma_rng(alpha, 1);
-        sum += x[k];
-    }
+    for (int k=0; k<K; k++) sum += x[k];
     for (int k=0; k<K; k++) x[k] /= sum;
 }
 
@@ -195,19 +694,16 @@ double dirichlet_sym_lnp(double *x, double alpha, int K) {
 }
 
 void dirichlet_sym_log_rng(double *log_x, double alpha, int K) {
-   double sum = 0;
+    // Normalized in log space, so that entries which underflow to 0 for
+    // small alpha keep a finite log
+    double max = -INFINITY;
     for (int k=0; k<K; k++) {
-        double entry = 0;
-//         while (entry == 0)
-        entry = rk_standard_gamma(&state, alpha);
-        log_x[k] = log(entry);
-        if (isinf(log_x[k])) {
-            fprintf(stderr, "LOG ENTRY IS -INF: %d, value = %0.8f\n", k, entry);
-        }
-        assert(!isinf(log_x[k]));
-        sum += entry;
+        log_x[k] = log_standard_gamma(alpha);
+        if (log_x[k] > max) max = log_x[k];
     }
-    double log_sum = log(sum);
+    double sum = 0;
+    for (int k=0; k<K; k++) sum += exp(log_x[k] - max);
+    const double log_sum = max + log(sum);
     assert(!isinf(log_sum));
     for (int k=0; k<K; k++) log_x[k] -= log_sum;
 }
@@ -2,13 +2,35 @@
 #define __ERP__
 
 
-/* initialize ERP random number generator */
-void erp_rng_init();
-
-/* reseed ERP generator */
+/* choose the ERP generator, "mt19937" or "philox", as given by --rng (the
+ * default is mt19937, or philox when built with -DERP_RNG_PHILOX); returns 0
+ * if the name is unknown */
+int erp_rng_start(const char *name);
+
+/* initialize ERP random number generator, from `seed`, or from the clock if
+ * it is negative; called by the root before it forks any particles */
+void erp_rng_init(long seed);
+
+/* reseed ERP generator. With philox, a seed names a stream: the stream of
+ * (seed, draw counter) is Philox4x32-10 of the pair, so reseeding costs two
+ * writes instead of filling the Mersenne Twister's 624 words, and a child's
+ * stream depends only on its parent's stream and the draws before the fork,
+ * not on the order in which particles are scheduled */
 unsigned long int gen_new_rng_seed();
 void set_rng_seed(unsigned long int seed);
 
+/* seed for the offspring which takes particle slot `slot` at resampling step
+ * `step`: a function of these and the run's seed only, so that it doesn't
+ * depend on which process forks the offspring, or in what order */
+unsigned long int gen_offspring_rng_seed(unsigned long int step, unsigned long int slot);
+
+/* draw from the run's own stream, kept in memory shared by all particles,
+ * rather than from the caller's: for draws made on behalf of the whole
+ * population (resampling), so they don't depend on which particle happens to
+ * make them */
+void enter_run_rng_stream();
+void leave_run_rng_stream();
+
 
 /* flip */
 unsigned int flip_rng(double p);
@@ -21,6 +43,55 @@ double discrete_lnp(int x, double *p, int K);
 /* discrete variant, takes log-probability vector */
 unsigned int discrete_log_rng(double *log_p, int K);
 
+/* categorical, precomputed: built once from a probability vector p (which
+ * need not be normalized), for distributions that don't change, such as the
+ * rows of a constant transition matrix. Build tables before particles fork
+ * (e.g. in a constructor) and they share them copy-on-write. Draws take O(1)
+ * through a Walker/Vose alias table, and log-probabilities are cached */
+typedef struct {
+    double threshold;   /* keep column k if the uniform falls below this */
+    int alias;          /* otherwise draw this */
+} categorical_alias;
+
+typedef struct {
+    int K;
+    categorical_alias *columns;
+    double *log_p;
+} categorical_table;
+
+void categorical_table_new(categorical_table *table, const double *p, int K);
+void categorical_table_free(categorical_table *table);
+unsigned int categorical_rng(const categorical_table *table);
+double categorical_lnp(int x, const categorical_table *table);
+
+/* sparse categorical: for probability vectors where most entries are near
+ * zero. The fewest entries which hold all but at most tail_mass of the mass
+ * go into a small alias table, along with one column for the rest (the
+ * tail); a draw which lands in the tail is resolved exactly, by binary
+ * search over the tail entries, so sampling is unbiased. Entries equal to
+ * zero are dropped; if they all are (or K is 0), the distribution is empty:
+ * its log-probabilities are all -INFINITY, and drawing from it is an error.
+ * sparse_categorical_rows_new converts a dense num_rows x K matrix (e.g. a
+ * transition matrix) row by row */
+typedef struct {
+    int K;
+    int num_head;
+    int *head;                  /* dense index of each head column */
+    categorical_table table;    /* over the head, plus the tail in the last column */
+    int num_tail;
+    int *tail;                  /* dense index of each tail entry */
+    double *tail_cdf;           /* cumulative probabilities within the tail */
+    int num_nonzero;
+    int *index;                 /* nonzero entries, by dense index */
+    double *log_p;
+} sparse_categorical;
+
+void sparse_categorical_new(sparse_categorical *dist, const double *p, int K, double tail_mass);
+void sparse_categorical_free(sparse_categorical *dist);
+unsigned int sparse_categorical_rng(const sparse_categorical *dist);
+double sparse_categorical_lnp(int x, const sparse_categorical *dist);
+void sparse_categorical_rows_new(sparse_categorical *rows, const double *matrix, int num_rows, int K, double tail_mass);
+
 /* uniform continuous on half-open interval [lower, upper) */
 double uniform_rng(double lower, double upper);
 double uniform_lnp(double x, double lower, double upper);
@@ -45,9 +116,24 @@ double beta_lnp(double x, double a, double b);
 double normal_rng(double mean, double variance);
 double normal_lnp(double x, double mean, double variance);
 
+/* exponential */
+double exponential_rng(double rate);
+double exponential_lnp(double x, double rate);
+
 /* samples a random long-typed value from 0 and LONG_MAX inclusive */
 long sample_long_rng();
 
+/* batched variants: fill x[0..n-1] with independent draws. uniform_rng_n,
+ * flip_rng_n and gamma_rng_n give the same values as n calls of uniform_rng,
+ * flip_rng and gamma_rng; normal_rng_n uses Box-Muller rather than normal_rng's
+ * ziggurat, so its values differ from normal_rng's (same distribution). The
+ * raw words come several Philox blocks at a time, and the transforms are loops
+ * the compiler can vectorize */
+void uniform_rng_n(double *x, int n, double lower, double upper);
+void flip_rng_n(unsigned int *x, int n, double p);
+void normal_rng_n(double *x, int n, double mean, double variance);
+void gamma_rng_n(double *x, int n, double shape, double rate);
+
 /* begin multivariate distributions */
 
 /* dirichlet */
@@ -0,0 +1,243 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // O_DIRECTORY
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "mem-sampler.h"
+
+// Samples kept for printing at the end; later ones only count towards the peaks
+#define MAX_SAMPLES (1 << 16)
+
+// Processes (of any owner) which one scan of /proc can hold, and the size of
+// the hash table over their pids (a power of two, at least twice as large)
+#define MAX_PROCS (1 << 15)
+#define PROC_SLOTS (1 << 16)
+
+// Directory entries of /proc read at once
+#define DENTS_BYTES (1 << 15)
+
+
+typedef struct {
+    double time_s;
+    long processes;
+    long rss_kb;
+    long pss_kb;
+    long uss_kb;
+} mem_sample;
+
+// A process seen in /proc, with its parent
+typedef struct {
+    pid_t pid;
+    pid_t parent;
+    bool in_tree;
+} proc_entry;
+
+static int interval_ms = 0;
+static pid_t root_pid = -1;
+static struct timespec start_time;
+static pthread_t sampler;
+static volatile bool sampling = false;
+static long num_samples = 0;
+static mem_sample peak = { 0 };
+
+// Allocated by mem_sampler_init, before any fork: the sampler thread neither
+// allocates nor uses stdio, so that a particle forked while it is busy does
+// not inherit a locked malloc arena or stderr
+static mem_sample *samples = NULL;
+static proc_entry *procs = NULL;
+static int *proc_slots = NULL;
+static char *dents = NULL;
+
+
+/**
+ * Read a small /proc file into buffer, NUL-terminated; returns its length,
+ * or -1 if it is gone
+ *
+ */
+static ssize_t read_file(const char *path, char *buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t length = 0;
+    ssize_t got;
+    while (length < size - 1 && (got = read(fd, buffer + length, size - 1 - length)) > 0) {
+        length += got;
+    }
+    close(fd);
+    buffer[length] = '\0';
+    return length;
+}
+
+/**
+ * The value of "<field> <n> kB" in a /proc/<pid>/smaps_rollup buffer, or 0
+ *
+ */
+static long field_kb(const char *buffer, const char *field) {
+    const char *line = strstr(buffer, field);
+    return (line != NULL) ? strtol(line + strlen(field), NULL, 10) : 0;
+}
+
+/**
+ * Parent pid from /proc/<pid>/stat; the command name may contain spaces and
+ * parentheses, so parse from the last ')'
+ *
+ */
+static pid_t read_parent(pid_t pid) {
+    char path[64], line[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (read_file(path, line, sizeof(line)) < 0) return -1;
+    char *end = strrchr(line, ')');
+    if (end == NULL || end[1] != ' ' || end[2] == '\0' || end[3] != ' ') return -1;
+    return strtol(end + 4, NULL, 10);
+}
+
+/**
+ * Add one process's Rss, Pss and Uss, from /proc/<pid>/smaps_rollup; false if
+ * it is gone (or the kernel has no smaps_rollup)
+ *
+ */
+static bool add_rollup(pid_t pid, mem_sample *sample) {
+    char path[64], buffer[2048];
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    if (read_file(path, buffer, sizeof(buffer)) < 0) return false;
+    sample->rss_kb += field_kb(buffer, "\nRss:");
+    sample->pss_kb += field_kb(buffer, "\nPss:");
+    sample->uss_kb += field_kb(buffer, "\nPrivate_Clean:") + field_kb(buffer, "\nPrivate_Dirty:");
+    sample->processes++;
+    return true;
+}
+
+/**
+ * Index into procs of the process with this pid, or -1
+ *
+ */
+static int find_proc(pid_t pid) {
+    for (unsigned h = (unsigned)pid & (PROC_SLOTS - 1); proc_slots[h] >= 0; h = (h + 1) & (PROC_SLOTS - 1)) {
+        if (procs[proc_slots[h]].pid == pid) return proc_slots[h];
+    }
+    return -1;
+}
+
+static void add_proc(int index) {
+    unsigned h = (unsigned)procs[index].pid & (PROC_SLOTS - 1);
+    while (proc_slots[h] >= 0) h = (h + 1) & (PROC_SLOTS - 1);
+    proc_slots[h] = index;
+}
+
+/**
+ * Sum the memory of the root and all of its descendants
+ *
+ */
+static mem_sample take_sample() {
+    int count = 0;
+    memset(proc_slots, -1, PROC_SLOTS*sizeof(int));
+#ifdef __linux__
+    int proc = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    long length;
+    while (proc >= 0 && (length = syscall(SYS_getdents64, proc, dents, DENTS_BYTES)) > 0) {
+        for (long offset = 0; offset < length; ) {
+            // struct linux_dirent64: ino, off, reclen, type, name
+            unsigned short reclen = *(unsigned short *)(dents + offset + 16);
+            pid_t pid = atoi(dents + offset + 19);
+            offset += reclen;
+            if (pid <= 0 || count == MAX_PROCS) continue;
+            procs[count] = (proc_entry) { pid, read_parent(pid), pid == root_pid };
+            add_proc(count++);
+        }
+    }
+    if (proc >= 0) close(proc);
+#endif
+
+    // Mark descendants: repeat until no process joins the tree
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i=0; i<count; i++) {
+            if (procs[i].in_tree) continue;
+            int parent = find_proc(procs[i].parent);
+            if (parent >= 0 && procs[parent].in_tree) {
+                procs[i].in_tree = true;
+                changed = true;
+            }
+        }
+    }
+
+    mem_sample sample = { 0 };
+    for (int i=0; i<count; i++) {
+        if (procs[i].in_tree) add_rollup(procs[i].pid, &sample);
+    }
+    return sample;
+}
+
+static void *sample_loop(void *argument) {
+    struct timespec interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+    while (sampling) {
+        mem_sample sample = take_sample();
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sample.time_s = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+        if (num_samples < MAX_SAMPLES) samples[num_samples] = sample;
+        num_samples++;
+        if (sample.processes > peak.processes) peak.processes = sample.processes;
+        if (sample.rss_kb > peak.rss_kb) peak.rss_kb = sample.rss_kb;
+        if (sample.pss_kb > peak.pss_kb) peak.pss_kb = sample.pss_kb;
+        if (sample.uss_kb > peak.uss_kb) peak.uss_kb = sample.uss_kb;
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+
+void mem_sampler_start(int ms) {
+    interval_ms = ms;
+}
+
+void mem_sampler_init() {
+    if (interval_ms <= 0) return;
+#ifdef __linux__
+    root_pid = getpid();
+    samples = malloc(MAX_SAMPLES*sizeof(mem_sample));
+    procs = malloc(MAX_PROCS*sizeof(proc_entry));
+    proc_slots = malloc(PROC_SLOTS*sizeof(int));
+    dents = malloc(DENTS_BYTES);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    sampling = true;
+
+    // Signals (e.g. SIGCHLD, for the reaper) stay with the main thread
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (pthread_create(&sampler, NULL, sample_loop, NULL) != 0) {
+        perror("pthread_create");
+        sampling = false;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+#else
+    fprintf(stderr, "--mem_sample_ms needs /proc/<pid>/smaps_rollup (Linux)\n");
+#endif
+}
+
+void mem_sampler_report() {
+    if (!sampling || getpid() != root_pid) return;
+    sampling = false;
+    pthread_join(sampler, NULL);
+    fprintf(stderr, "mem,time_s,processes,rss_kb,pss_kb,uss_kb\n");
+    for (long i=0; i<num_samples && i<MAX_SAMPLES; i++) {
+        mem_sample *sample = &samples[i];
+        fprintf(stderr, "mem,%.3f,%ld,%ld,%ld,%ld\n", sample->time_s, sample->processes, sample->rss_kb, sample->pss_kb, sample->uss_kb);
+    }
+    fprintf(stderr, "mem_peak,%ld,%ld,%ld,%ld,%ld\n", num_samples, peak.processes, peak.rss_kb, peak.pss_kb, peak.uss_kb);
+    fflush(stderr);
+}
@@ -0,0 +1,50 @@
+#ifndef __MEM_SAMPLER__
+
+/**
+ *
+ * Memory of the whole particle process tree (--mem_sample_ms=N, Linux only).
+ *
+ * Summing the RSS of every process counts each page shared copy-on-write
+ * between particles once per particle, which makes forking look far more
+ * expensive than it is. With --mem_sample_ms, a thread in the root wakes up
+ * every N milliseconds, finds the root's descendants (scanning /proc for
+ * parent pids), and sums, over them and the root, /proc/<pid>/smaps_rollup's
+ *
+ *   Rss     resident pages, counting shared pages in every process
+ *   Pss     each shared page divided between the processes sharing it
+ *   Uss     pages private to a process (Private_Clean + Private_Dirty)
+ *
+ * Pss sums to the memory the tree really uses. The sampler thread only reads
+ * /proc and fills a table allocated up front (no stdio or malloc, which could
+ * leave a particle forked meanwhile with a lock held), so the samples are
+ * printed on stderr once inference is done, one line each (up to 65536 of
+ * them), followed by the peaks over all samples:
+ *
+ *   mem,time_s,processes,rss_kb,pss_kb,uss_kb
+ *   mem,0.010,101,183200,21450,12800
+ *   ...
+ *   mem_peak,<samples>,<processes>,<rss_kb>,<pss_kb>,<uss_kb>
+ *
+ */
+
+
+/**
+ * Called first thing, with the value of --mem_sample_ms (0: no sampling)
+ *
+ */
+void mem_sampler_start(int ms);
+
+/**
+ * Called by the root before it forks any particles: start sampling
+ *
+ */
+void mem_sampler_init();
+
+/**
+ * Called by the root once inference is done: stop sampling, print the peaks
+ *
+ */
+void mem_sampler_report();
+
+#define __MEM_SAMPLER__
+#endif
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 
+// The memo table is part of the particle's state
+#define uthash_malloc(sz) particle_alloc(sz)
+#define uthash_free(ptr,sz) particle_free(ptr)
+
+#include "probabilistic.h"
 #include "memoize.h"
 
 
@@ -22,8 +27,8 @@ void mem_invoke_stateful(mem_func *mf, void *arg, void *result, void *state) {
         memcpy(result, item->result, mf->return_size);
     } else {
         (*mf->fn)(arg, result, state);
-        item = malloc(sizeof(hashitem));
-        *item = (hashitem) { malloc(mf->arg_size), malloc(mf->return_size) };
+        item = particle_alloc(sizeof(hashitem));
+        *item = (hashitem) { particle_alloc(mf->arg_size), particle_alloc(mf->return_size) };
         memcpy(item->arg, arg, mf->arg_size);
         memcpy(item->result, result, mf->return_size);
         HASH_ADD_KEYPTR(hh, mf->argmap, arg, mf->arg_size, item);
@@ -43,8 +48,8 @@ void mem_clear(mem_func *mf) {
     hashitem *item, *tmp;
     HASH_ITER(hh, mf->argmap, item, tmp) {
         HASH_DEL(mf->argmap, item);
-        free(item->arg);
-        free(item->result);
-        free(item);
+        particle_free(item->arg);
+        particle_free(item->result);
+        particle_free(item);
     }
 }
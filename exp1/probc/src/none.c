@@ -35,6 +35,14 @@ void predict(const char *format, ...) {
     utstring_free(contents);
 }
 
+void predict_value(const char *name, const double value) {
+    printf("%s,%f\n", name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    printf("%s,%d\n", name, value);
+}
+
 /**
  * Weighting function accumulates the log-probability of the observes
  *
@@ -49,7 +57,7 @@ void weight_trace(const double ln_p, const bool synchronize) {
  *
  */
 int infer(int (*f)(int, char**), int argc, char **argv) {
-    erp_rng_init();
+    erp_rng_init(-1);
     int retval = __program(argc, argv);
     printf("trace_weight,%f\n", LOG_PROB);
     return retval;
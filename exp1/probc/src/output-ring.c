@@ -0,0 +1,229 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "engine-shared.h"
+#include "output-ring.h"
+#include "sample-file.h"
+
+// Each record is a header (payload length + 1; 0 until ready), then the
+// payload, padded so the next header is aligned and never wraps.
+// The collector zeroes each record once it has taken it out.
+#define RECORD_ALIGN 8
+#define RECORD_HEADER RECORD_ALIGN
+
+// The collector gathers records into batches of this size
+#define COLLECTOR_BATCH_BYTES (1 << 16)
+
+static output_ring *ring = NULL;
+static pid_t owner_pid = -1;
+static pthread_t collector_thread;
+static char *batch = NULL;
+
+
+static inline long record_size(size_t length) {
+    return RECORD_HEADER + (long)((length + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1));
+}
+
+static inline volatile int *header_at(long position) {
+    return (volatile int *)&ring->data[position & (ring->capacity - 1)];
+}
+
+/**
+ * Copy between a flat buffer and the ring, wrapping around its end
+ *
+ */
+static void copy_in(long position, const char *buffer, size_t length) {
+    long offset = position & (ring->capacity - 1);
+    size_t first = ((size_t)(ring->capacity - offset) < length) ? (size_t)(ring->capacity - offset) : length;
+    memcpy(&ring->data[offset], buffer, first);
+    memcpy(ring->data, buffer + first, length - first);
+}
+
+static void copy_out(long position, char *buffer, size_t length) {
+    long offset = position & (ring->capacity - 1);
+    size_t first = ((size_t)(ring->capacity - offset) < length) ? (size_t)(ring->capacity - offset) : length;
+    memcpy(buffer, &ring->data[offset], first);
+    memcpy(buffer + first, ring->data, length - first);
+}
+
+/**
+ * Zero a consumed record, so that none of its bytes looks like a ready header
+ * once the ring wraps around
+ *
+ */
+static void clear(long position, long size) {
+    long offset = position & (ring->capacity - 1);
+    long first = (ring->capacity - offset < size) ? ring->capacity - offset : size;
+    memset(&ring->data[offset], 0, first);
+    memset(ring->data, 0, size - first);
+}
+
+static void write_all(const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t count = write(sample_file_fd(), buffer, length);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return;
+        }
+        buffer += count;
+        length -= count;
+    }
+}
+
+
+/**
+ * Write out the collector's batch, up to ring position `tail`, and let any
+ * writers blocked on a full ring (or output_ring_sync) re-check
+ *
+ */
+static void flush_batch(size_t *batch_length, long tail) {
+    write_all(batch, *batch_length);
+    *batch_length = 0;
+    if (ring->written == tail) return;
+    __atomic_store_n(&ring->written, tail, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->drained.value, 1, __ATOMIC_SEQ_CST);
+    shared_futex_wake_all(&ring->drained.value);
+}
+
+/**
+ * Collector thread: take ready records off the tail in order, write them out
+ * in batches, and sleep when there is nothing to do.
+ * It must not allocate or use stdio, as the root forks while it runs.
+ *
+ */
+static void *collector(void *unused) {
+    size_t batch_length = 0;
+    long tail = ring->tail;
+    while (true) {
+        int header = __atomic_load_n(header_at(tail), __ATOMIC_ACQUIRE);
+        if (header != 0) {
+            size_t length = header - 1;
+            if (batch_length + length > COLLECTOR_BATCH_BYTES) {
+                flush_batch(&batch_length, tail);
+            }
+            if (length > COLLECTOR_BATCH_BYTES) {
+                // Too big to batch: write it straight out of the ring
+                long offset = (tail + RECORD_HEADER) & (ring->capacity - 1);
+                size_t first = ((size_t)(ring->capacity - offset) < length) ? (size_t)(ring->capacity - offset) : length;
+                write_all(&ring->data[offset], first);
+                write_all(ring->data, length - first);
+            } else {
+                copy_out(tail + RECORD_HEADER, batch + batch_length, length);
+                batch_length += length;
+            }
+            clear(tail, record_size(length));
+            tail += record_size(length);
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+            if (batch_length == 0) flush_batch(&batch_length, tail);
+            continue;
+        }
+
+        // Nothing ready: write out what we have, then wait for more
+        flush_batch(&batch_length, tail);
+        if (__atomic_load_n(&ring->closed.value, __ATOMIC_SEQ_CST) &&
+            tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        int published = __atomic_load_n(&ring->published.value, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring->sleeping.value, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(header_at(tail), __ATOMIC_SEQ_CST) == 0) {
+            shared_futex_wait(&ring->published.value, published);
+        }
+        __atomic_store_n(&ring->sleeping.value, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+void output_ring_init(size_t capacity) {
+    // A power of two, so positions wrap with a mask
+    size_t bytes = 1;
+    while (bytes < capacity) bytes <<= 1;
+
+    ring = (output_ring *)shared_memory_alloc(sizeof(output_ring));
+    *ring = (output_ring) { 0 };
+    ring->capacity = bytes;
+    ring->data = (char *)shared_memory_alloc(bytes);
+    memset(ring->data, 0, bytes);
+    batch = malloc(COLLECTOR_BATCH_BYTES);
+    owner_pid = getpid();
+
+    // Signals (e.g. SIGCHLD, for the reaper) stay with the main thread
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_create(&collector_thread, NULL, collector, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+bool output_ring_active() {
+    return ring != NULL;
+}
+
+
+void output_ring_write(const char *buffer, size_t length) {
+    // Keep each record well within the ring; split long buffers between lines
+    // (or sample file rows)
+    size_t max_length = ring->capacity/2 - RECORD_HEADER;
+    while (length > max_length) {
+        size_t chunk = max_length;
+        if (sample_file_enabled()) {
+            chunk = sample_file_whole_rows(buffer, max_length);
+        } else {
+            while (chunk > 0 && buffer[chunk - 1] != '\n') chunk--;
+        }
+        if (chunk == 0) chunk = max_length;
+        output_ring_write(buffer, chunk);
+        buffer += chunk;
+        length -= chunk;
+    }
+    if (length == 0) return;
+
+    long size = record_size(length);
+    long position = __atomic_fetch_add(&ring->head, size, __ATOMIC_SEQ_CST);
+
+    // Wait for the collector to free up enough space
+    while (true) {
+        int drained = __atomic_load_n(&ring->drained.value, __ATOMIC_SEQ_CST);
+        if (position + size - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) <= ring->capacity) break;
+        shared_futex_wait(&ring->drained.value, drained);
+    }
+
+    copy_in(position + RECORD_HEADER, buffer, length);
+    __atomic_store_n(header_at(position), (int)length + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&ring->published.value, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping.value, __ATOMIC_SEQ_CST)) {
+        shared_futex_wake_all(&ring->published.value);
+    }
+}
+
+
+void output_ring_sync() {
+    if (ring == NULL || getpid() != owner_pid) return;
+    long head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    while (true) {
+        int drained = __atomic_load_n(&ring->drained.value, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->written, __ATOMIC_SEQ_CST) >= head) break;
+        shared_futex_wait(&ring->drained.value, drained);
+    }
+}
+
+void output_ring_close() {
+    if (ring == NULL || getpid() != owner_pid) return;
+    __atomic_store_n(&ring->closed.value, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->published.value, 1, __ATOMIC_SEQ_CST);
+    shared_futex_wake_all(&ring->published.value);
+    pthread_join(collector_thread, NULL);
+    assert(ring->written == ring->head);
+    ring = NULL;
+}
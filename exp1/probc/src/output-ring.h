@@ -0,0 +1,74 @@
+#ifndef __OUTPUT_RING__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "barrier.h"
+
+/**
+ *
+ * Shared-memory output ring.
+ *
+ * Particles hand their output to flush_output, which, once a ring is set up,
+ * no longer takes the stdout mutex: the particle reserves space in the ring
+ * with an atomic fetch-add on its head, copies the buffer in, and marks the
+ * record ready. A collector thread in the root process drains the ring in
+ * order, batching records into large write()s to stdout.
+ *
+ * A record never interleaves with another one; buffers too large for the
+ * ring are split at line boundaries. When the ring is full, writers sleep
+ * until the collector has freed enough space.
+ *
+ */
+
+// Default ring size
+#define OUTPUT_RING_BYTES (1 << 22)
+
+typedef struct {
+    long head __attribute__((aligned(CACHE_LINE_SIZE)));   // bytes reserved by writers
+    long tail __attribute__((aligned(CACHE_LINE_SIZE)));   // bytes taken out by the collector ...
+    long written;                                          // ... and written to stdout
+    padded_counter published;   // bumped by writers as records become ready
+    padded_counter drained;     // bumped by the collector as it frees space / writes
+    padded_counter sleeping;    // collector is waiting on published
+    padded_counter closed;
+    long capacity;
+    char *data;
+} output_ring;
+
+
+/**
+ * Called by the root, before forking any particles: allocate the ring and
+ * start the collector thread
+ *
+ */
+void output_ring_init(size_t capacity);
+
+/**
+ * Whether output goes through a ring (inherited across fork)
+ *
+ */
+bool output_ring_active();
+
+/**
+ * Append `length` bytes to the output, blocking while the ring is full
+ *
+ */
+void output_ring_write(const char *buffer, size_t length);
+
+/**
+ * Called by the root: wait until everything written so far is on stdout
+ * (e.g. before printing anything itself)
+ *
+ */
+void output_ring_sync();
+
+/**
+ * Called by the root, once all particles have exited: drain the ring and
+ * stop the collector
+ *
+ */
+void output_ring_close();
+
+#define __OUTPUT_RING__
+#endif
@@ -0,0 +1,169 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "probabilistic.h"
+#include "particle-state.h"
+
+// Every block is preceded by its size, and aligned for any type
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ARENA_ALIGN
+
+typedef struct {
+    void *ptr;
+    size_t bytes;
+} state_region;
+
+// Regions registered with particle_state (process-wide)
+static state_region *regions = NULL;
+static int num_regions = 0;
+static size_t region_bytes = 0;
+
+// Target of particle_alloc on this thread, if any
+static __thread particle_arena *active_arena = NULL;
+
+
+static inline size_t round_up(size_t bytes) {
+    return (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static inline size_t block_size(void *ptr) {
+    return *(size_t *)((char *)ptr - ARENA_HEADER);
+}
+
+static inline bool is_last_block(particle_arena *arena, void *ptr) {
+    return (char *)ptr + round_up(block_size(ptr)) == arena->base + arena->used;
+}
+
+static inline bool in_arena(particle_arena *arena, void *ptr) {
+    return arena != NULL && (char *)ptr >= arena->base && (char *)ptr < arena->base + arena->capacity;
+}
+
+
+/**
+ * Register a region of per-particle state. Registering the same address again
+ * (e.g. from every particle's main()) just updates its size.
+ *
+ */
+void particle_state(void *ptr, size_t bytes) {
+    for (int i=0; i<num_regions; i++) {
+        if (regions[i].ptr == ptr) {
+            region_bytes += bytes - regions[i].bytes;
+            regions[i].bytes = bytes;
+            return;
+        }
+    }
+    regions = realloc(regions, (num_regions + 1)*sizeof(state_region));
+    regions[num_regions++] = (state_region) { ptr, bytes };
+    region_bytes += bytes;
+}
+
+void *particle_alloc(size_t bytes) {
+    particle_arena *arena = active_arena;
+    if (arena == NULL) return malloc(bytes);
+
+    size_t needed = ARENA_HEADER + round_up(bytes);
+    if (arena->used + needed > arena->capacity) {
+        fprintf(stderr, "particle_alloc: arena of %zu bytes exhausted\n", arena->capacity);
+        exit(1);
+    }
+    char *block = arena->base + arena->used + ARENA_HEADER;
+    *(size_t *)(block - ARENA_HEADER) = bytes;
+    arena->used += needed;
+    return block;
+}
+
+void *particle_realloc(void *ptr, size_t bytes) {
+    particle_arena *arena = active_arena;
+    if (ptr == NULL) return particle_alloc(bytes);
+    if (!in_arena(arena, ptr)) return realloc(ptr, bytes);
+
+    // The most recent block can grow (or shrink) in place
+    size_t old_bytes = block_size(ptr);
+    if (is_last_block(arena, ptr)) {
+        size_t used = ((char *)ptr - arena->base) + round_up(bytes);
+        if (used > arena->capacity) {
+            fprintf(stderr, "particle_alloc: arena of %zu bytes exhausted\n", arena->capacity);
+            exit(1);
+        }
+        arena->used = used;
+        *(size_t *)((char *)ptr - ARENA_HEADER) = bytes;
+        return ptr;
+    }
+    void *block = particle_alloc(bytes);
+    memcpy(block, ptr, (old_bytes < bytes) ? old_bytes : bytes);
+    return block;
+}
+
+/**
+ * Only the most recent block is actually released; anything else is
+ * reclaimed when the arena is reset
+ *
+ */
+void particle_free(void *ptr) {
+    particle_arena *arena = active_arena;
+    if (ptr == NULL) return;
+    if (!in_arena(arena, ptr)) {
+        free(ptr);
+        return;
+    }
+    if (is_last_block(arena, ptr)) {
+        arena->used = ((char *)ptr - arena->base) - ARENA_HEADER;
+    }
+}
+
+
+void particle_arena_init(particle_arena *arena, size_t capacity) {
+    arena->capacity = round_up(capacity);
+    arena->used = 0;
+    arena->base = mmap(NULL, arena->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == arena->base) {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+void particle_arena_activate(particle_arena *arena) {
+    active_arena = arena;
+}
+
+void particle_arena_reset(particle_arena *arena) {
+    arena->used = 0;
+}
+
+
+int particle_state_count() {
+    return num_regions;
+}
+
+size_t particle_state_size(const particle_arena *arena) {
+    return region_bytes + sizeof(size_t) + ((arena != NULL) ? arena->used : 0);
+}
+
+void particle_state_save(const particle_arena *arena, char *buffer) {
+    for (int i=0; i<num_regions; i++) {
+        memcpy(buffer, regions[i].ptr, regions[i].bytes);
+        buffer += regions[i].bytes;
+    }
+    size_t used = (arena != NULL) ? arena->used : 0;
+    memcpy(buffer, &used, sizeof(size_t));
+    buffer += sizeof(size_t);
+    if (used > 0) memcpy(buffer, arena->base, used);
+}
+
+void particle_state_restore(particle_arena *arena, const char *buffer) {
+    for (int i=0; i<num_regions; i++) {
+        memcpy(regions[i].ptr, buffer, regions[i].bytes);
+        buffer += regions[i].bytes;
+    }
+    size_t used;
+    memcpy(&used, buffer, sizeof(size_t));
+    buffer += sizeof(size_t);
+    if (arena != NULL) {
+        assert(used <= arena->capacity);
+        arena->used = used;
+        if (used > 0) memcpy(arena->base, buffer, used);
+    }
+}
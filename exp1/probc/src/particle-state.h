@@ -0,0 +1,69 @@
+#ifndef __PARTICLE_STATE__
+
+#include <stddef.h>
+
+/**
+ *
+ * Engine side of the particle state API (particle_state / particle_alloc,
+ * declared in probabilistic.h).
+ *
+ * A particle's state is the set of regions registered with particle_state,
+ * plus its arena: a contiguous bump-allocated heap which particle_alloc
+ * serves from whenever an engine has activated one on the calling thread.
+ * Since the arena always lives at the same address, a particle is cloned by
+ * copying [base, base+used) and the registered regions into a flat buffer,
+ * and restored by copying them back; pointers into the arena stay valid.
+ *
+ * With no arena active, particle_alloc falls back to malloc.
+ *
+ */
+
+typedef struct {
+    char *base;
+    size_t capacity;
+    size_t used;
+} particle_arena;
+
+
+/**
+ * Reserve an arena of `capacity` bytes of address space (pages are only
+ * committed as they are used)
+ *
+ */
+void particle_arena_init(particle_arena *arena, size_t capacity);
+
+/**
+ * Make `arena` the target of particle_alloc on the calling thread (NULL: malloc)
+ *
+ */
+void particle_arena_activate(particle_arena *arena);
+
+/**
+ * Discard everything allocated in the arena, for a particle starting afresh
+ *
+ */
+void particle_arena_reset(particle_arena *arena);
+
+
+/**
+ * Number of regions registered with particle_state so far (process-wide)
+ *
+ */
+int particle_state_count();
+
+/**
+ * Bytes needed to save the registered regions plus the arena's contents
+ *
+ */
+size_t particle_state_size(const particle_arena *arena);
+
+/**
+ * Copy the registered regions and the arena into `buffer`, which must hold
+ * particle_state_size() bytes; and back again.
+ *
+ */
+void particle_state_save(const particle_arena *arena, char *buffer);
+void particle_state_restore(particle_arena *arena, const char *buffer);
+
+#define __PARTICLE_STATE__
+#endif
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "engine-shared.h"
+#include "perf-counters.h"
+
+
+static bool enabled = false;
+static pid_t root_pid = -1;
+static perf_table *table = NULL;
+
+// Process-local: open counters, and the observe we were born at
+static int descriptors[PERF_NUM_COUNTERS];
+static int current_observe = 0;
+static int birth_observe = 0;
+
+static const char *counter_names[PERF_NUM_COUNTERS] = {
+    "minor_faults", "major_faults", "context_switches", "task_clock_ms", "cycles", "instructions"
+};
+
+
+#ifdef __linux__
+static const struct { uint32_t type; uint64_t config; } counter_events[PERF_NUM_COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+};
+
+/**
+ * Count event `counter` for this process only (not its children); where
+ * perf_event_paranoid forbids counting in the kernel, count user space only
+ *
+ */
+static int open_counter(int counter) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[counter].type;
+    attr.config = counter_events[counter].config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+    int descriptor = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (descriptor < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        descriptor = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return descriptor;
+}
+
+// Scaled up for the time the counter was multiplexed out
+static uint64_t read_counter(int descriptor) {
+    uint64_t values[3];
+    if (read(descriptor, values, sizeof(values)) != sizeof(values) || values[2] == 0) return 0;
+    return (values[2] < values[1]) ? (uint64_t)((double)values[0]*values[1]/values[2]) : values[0];
+}
+#else
+static int open_counter(int counter) {
+    return -1;
+}
+
+static uint64_t read_counter(int descriptor) {
+    return 0;
+}
+#endif
+
+
+static void open_counters() {
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        descriptors[c] = table->available[c] ? open_counter(c) : -1;
+    }
+}
+
+static void read_counters(perf_counts *counts) {
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        counts->counts[c] = (descriptors[c] >= 0) ? read_counter(descriptors[c]) : 0;
+    }
+    counts->particles = 1;
+}
+
+/**
+ * Fork hook: drop the parent's counters, start our own
+ *
+ */
+static void after_fork_child() {
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        if (descriptors[c] >= 0) close(descriptors[c]);
+    }
+    birth_observe = current_observe;
+    open_counters();
+}
+
+
+void perf_counters_start(bool requested) {
+    enabled = requested;
+}
+
+void perf_counters_init() {
+    if (!enabled) return;
+    root_pid = getpid();
+    table = (perf_table *)shared_memory_alloc(sizeof(perf_table));
+    memset(table, 0, sizeof(perf_table));
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        descriptors[c] = open_counter(c);
+        table->available[c] = (descriptors[c] >= 0);
+    }
+    if (!table->available[PERF_MINOR_FAULTS]) {
+        perror("perf_event_open");
+    }
+    register_fork_hook(after_fork_child);
+}
+
+
+void perf_counters_observe(int observe) {
+    current_observe = observe;
+}
+
+void perf_counters_exit() {
+    if (table == NULL || getpid() == root_pid) return;
+    perf_counts counts;
+    read_counters(&counts);
+    int row = (birth_observe < PERF_MAX_OBSERVES) ? birth_observe : PERF_MAX_OBSERVES - 1;
+    perf_counts *into = &table->observes[row];
+    __atomic_add_fetch(&into->particles, 1, __ATOMIC_RELAXED);
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        __atomic_add_fetch(&into->counts[c], counts.counts[c], __ATOMIC_RELAXED);
+    }
+    int max = __atomic_load_n(&table->max_observe, __ATOMIC_RELAXED);
+    while (row > max && !__atomic_compare_exchange_n(&table->max_observe, &max, row, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+static void print_row(FILE *stream, const char *label, const perf_counts *counts) {
+    fprintf(stream, "perf,%s,%ld", label, counts->particles);
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        if (!table->available[c]) {
+            fprintf(stream, ",n/a");
+        } else if (c == PERF_TASK_CLOCK) {
+            fprintf(stream, ",%.3f", counts->counts[c] / 1e6 / counts->particles);
+        } else {
+            fprintf(stream, ",%.1f", (double)counts->counts[c] / counts->particles);
+        }
+    }
+    fprintf(stream, "\n");
+}
+
+void perf_counters_report() {
+    if (table == NULL || getpid() != root_pid) return;
+    fprintf(stderr, "perf,observe,particles");
+    for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+        fprintf(stderr, ",%s", counter_names[c]);
+    }
+    fprintf(stderr, "\n");
+
+    perf_counts all = { 0 };
+    char label[16];
+    for (int t=0; t<=table->max_observe; t++) {
+        perf_counts *counts = &table->observes[t];
+        if (counts->particles == 0) continue;
+        snprintf(label, sizeof(label), "%d", t);
+        print_row(stderr, label, counts);
+        all.particles += counts->particles;
+        for (int c=0; c<PERF_NUM_COUNTERS; c++) {
+            all.counts[c] += counts->counts[c];
+        }
+    }
+    if (all.particles > 0) print_row(stderr, "all", &all);
+
+    perf_counts root;
+    read_counters(&root);
+    print_row(stderr, "root", &root);
+    fflush(stderr);
+}
@@ -0,0 +1,87 @@
+#ifndef __PERF_COUNTERS__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ *
+ * Per-particle kernel and hardware counters (--perf_counters, Linux only).
+ *
+ * Most of the cost of fork() is not in the call itself but deferred to the
+ * child: the copy-on-write faults it takes as it writes to pages it shares
+ * with its parent. With --perf_counters, every process opens perf_event_open
+ * counters as it is born (in a fork hook), and reads them just before
+ * it exits. The counts are summed in shared memory by the observe at which
+ * the particle was born (0 for the initial particles), and the root prints,
+ * on stderr, the mean per particle for each observe and over the whole run,
+ * followed by the root's own counts:
+ *
+ *   perf,observe,particles,minor_faults,major_faults,context_switches,task_clock_ms,cycles,instructions
+ *   perf,0,100,...
+ *   perf,all,1650,...
+ *   perf,root,1,...
+ *
+ * Minor faults in a child are mostly copy-on-write faults. Counters the
+ * kernel won't open (e.g. cycles in a VM) are reported as "n/a".
+ *
+ */
+
+typedef enum {
+    PERF_MINOR_FAULTS,
+    PERF_MAJOR_FAULTS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_TASK_CLOCK,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_NUM_COUNTERS
+} perf_counter;
+
+// Observes past the last one are counted in the last row
+#define PERF_MAX_OBSERVES 4096
+
+typedef struct {
+    long particles;
+    uint64_t counts[PERF_NUM_COUNTERS];
+} perf_counts;
+
+typedef struct {
+    bool available[PERF_NUM_COUNTERS];
+    int max_observe;                        // highest row used
+    perf_counts observes[PERF_MAX_OBSERVES];
+} perf_table;
+
+
+/**
+ * Called first thing, with whether --perf_counters was given
+ *
+ */
+void perf_counters_start(bool requested);
+
+/**
+ * Called by the root before it forks any particles: allocate the table, and
+ * start counting for the root
+ *
+ */
+void perf_counters_init();
+
+/**
+ * Called by the engine as a particle reaches synchronizing observe
+ * `observe`: children forked from now on are counted under it
+ *
+ */
+void perf_counters_observe(int observe);
+
+/**
+ * Read this particle's counters into the table; called just before it exits
+ *
+ */
+void perf_counters_exit();
+
+/**
+ * Called by the root once inference is done: print the table
+ *
+ */
+void perf_counters_report();
+
+#define __PERF_COUNTERS__
+#endif
@@ -17,10 +17,14 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
-
-// Profiling
-clock_t start, end;
-FILE *fp;
+#include "resample.h"
+#include "zygote.h"
+#include "reaper.h"
+#include "output-ring.h"
+#include "sample-file.h"
+#include "aggregate.h"
+#include "profile.h"
+#include "perf-counters.h"
 
 // Set defaults for number of particles and iterations
 static int NUM_OBSERVES = 0;
@@ -36,6 +40,15 @@ static long INITIAL_SEED = -1;
 // Flag to mark whether or not to record walltime each iteration
 static bool TIME_ITERATION = false;
 
+// Scheme used to sample offspring counts
+static resampler_type RESAMPLER = RESAMPLE_MULTINOMIAL;
+
+// Fanout of the observe barrier's combining tree (0 = flat barrier)
+static int BARRIER_FANOUT = 0;
+
+// Standby children pre-forked per particle while waiting at an observe (0 = off)
+static int ZYGOTES = 0;
+
 // Flag for prerun
 static bool IS_PRERUN = true;
 
@@ -70,30 +83,30 @@ typedef struct {
     double *log_weights;
     int *n_offspring;
 
+    // First slot index taken by each particle's offspring after resampling
+    int *offspring_slot;
+
     // Retained particle trace
     retained_particle *retained;
 
     // Synchronization state
 
-    // Barrier: all particles have reached an observe
-    int begin_observe_counter;
-    pthread_mutex_t begin_observe_mutex;
-    pthread_cond_t begin_observe_cond;
+    // Barrier: all (non-retained) particles have reached an observe
+    shared_barrier begin_observe;
 
     // Condition: retained particle has been set
     bool is_retained_particle_set;
     pthread_mutex_t retained_particle_set_mutex;
     pthread_cond_t retained_particle_set_cond;
 
-    // Barrier: all particles have finished handling observe
-    int end_observe_counter;
-    pthread_mutex_t end_observe_mutex;
-    pthread_cond_t end_observe_cond;
+    // Latch: all particles have finished handling observe
+    shared_latch end_observe;
 
-    // Barrier: all particles completed program execution
-    int exec_complete_counter;
-    pthread_mutex_t exec_complete_mutex;
-    pthread_cond_t exec_complete_cond;
+    // Standby children, forked while particles wait at begin_observe
+    zygote_pool zygotes;
+
+    // Barrier: all (non-retained) particles completed program execution
+    shared_barrier exec_complete;
 
     // Barrier: all observations have retained a particle
     int retain_complete_counter;
@@ -112,9 +125,10 @@ typedef struct {
 typedef struct {
     double log_weight;
     int current_observe;
+    int particle_index;
     int live_offspring_count;
     pid_t *pid_trace;
-    UT_string *predict;
+    predict_buffer *predict;
 } process_locals;
 
 
@@ -122,39 +136,25 @@ static process_locals *locals;
 static shared_globals *globals;
 
 /**
- * Sample number of offspring, given particle weights
- * Basic multinomial resampling scheme
+ * Sample number of offspring, given particle weights,
+ * using the resampling scheme selected on the command line
  *
  */
-void multinomial_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = 0;
-    }
+void resample() {
 
-    // Draw number of offspring.
-    // If this is a conditional SMC run, we choose NUM_PARTICLES - 1 here.
+    // If this is a conditional SMC run, we choose NUM_PARTICLES - 1 here,
+    // and the retained particle (last index) gets one extra offspring.
     int offspring_to_sample = NUM_PARTICLES - ((globals->has_retained_particle) ? 1 : 0);
-    for (s=0; s<offspring_to_sample; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
-
-    // If this is conditional SMC, increase retained particle offspring count by 1.
+    enter_run_rng_stream();
+    resample_offspring(RESAMPLER, globals->log_weights, NUM_PARTICLES, offspring_to_sample, globals->n_offspring);
+    leave_run_rng_stream();
     if (globals->has_retained_particle) {
         globals->n_offspring[NUM_PARTICLES-1]++;
     }
 
 #if DEBUG_LEVEL >= 2
     // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] pmcmc iteration ??, observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
+    fprintf(stderr, "[resampling %d] pmcmc iteration ??, observe #%d (%s)\n", getpid(), locals->current_observe, resampler_name(RESAMPLER));
     fprintf(stderr, "LOG WEIGHT: <");
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
     fprintf(stderr, ">\n");
@@ -162,56 +162,6 @@ void multinomial_resample() {
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
     fprintf(stderr, ">\n");
 #endif
-
-    free(sampling_dist);
-}
-
-
-/**
- * Sample number of offspring, given particle weights
- * Residual resampling scheme
- *
- */
-void residual_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    int remainder = NUM_PARTICLES;
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = (int)floor(NUM_PARTICLES*sampling_dist[s]);
-        remainder -= globals->n_offspring[s];
-    }
-
-    if (globals->has_retained_particle && (globals->n_offspring[NUM_PARTICLES-1] == 0)) {
-        assert(remainder > 0);
-        globals->n_offspring[NUM_PARTICLES-1] = 1;
-        remainder--;
-    }
-
-    // Draw number of offspring.
-    for (s=0; s<remainder; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
-
-
-#if DEBUG_LEVEL >= 2
-    // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "LOG WEIGHT: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "N_OFFSPRING: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
-    fprintf(stderr, ">\n");
-#endif
-
-    free(sampling_dist);
 }
 
 
@@ -222,7 +172,9 @@ void residual_resample() {
 void destroy_particle() {
     assert(locals->live_offspring_count == 0);
     free(locals->pid_trace);
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
+    profile_flush();
+    perf_counters_exit();
     _exit(0);
 }
 
@@ -238,41 +190,33 @@ void destroy_particle() {
  * (3) if this particle is retained, wait for a branch signal. if not, exit.
  * (4) when we get the branch signal, go back to (1).
  *
+ * New children take slots first_slot, ..., first_slot + children_to_spawn - 1.
+ *
  */
-void retain_branch_loop(int children_to_spawn) {
-    // bool is_first_run = true;
+void retain_branch_loop(int children_to_spawn, int first_slot) {
+    // On the first pass we may already own children activated from the zygote pool
+    bool is_first_run = true;
     pid_t parent_pid = getpid();
     while (true) {
 
 //         int target_children = children_to_spawn;
-        assert(locals->live_offspring_count <= 1);
+        assert(is_first_run || locals->live_offspring_count <= 1);
+        is_first_run = false;
 
         // If there are babies to make, go make them
         debug_print(4,"Particle %d at observe %d is going to branch %d NEW children and wait to see if it is retained\n", getpid(), locals->current_observe, children_to_spawn);
-        while (children_to_spawn > 0) {
-            unsigned long int seed = gen_new_rng_seed();
-            start = clock();
-            pid_t child_pid = fork();
-            end = clock();
-            if (child_pid == 0) {
+        // All of them stay children of this (control) process, even though they
+        // are forked as a tree, so the live_offspring_count bookkeeping below holds
+        if (children_to_spawn > 0) {
+            int child_slot = zygote_pool_fork_tree(&globals->zygotes, first_slot, children_to_spawn,
+                                                   &locals->live_offspring_count);
+            if (child_slot >= 0) {
                 // New child. Update offspring, observe index, pid trace; then continue execution
-                set_rng_seed(seed);
-                debug_print(4,"new child rng seed: %ld\n", seed);
                 debug_print(4,"[%d -> %d]\n", parent_pid, getpid());
-                locals->live_offspring_count = 0;
+                locals->particle_index = child_slot;
                 locals->current_observe++;
                 locals->pid_trace[locals->current_observe] = getpid();
                 return;
-            } else if (child_pid > 0) {
-                // Parent (control) process.
-                children_to_spawn--;
-                locals->live_offspring_count++;
-            } else {
-                fprintf(fp, "%lu, ", (end - start));
-                // If there was an error, it's probably because the process table is full.
-                // Wait a second, then retry.
-                perror("fork");
-                sleep(1);
             }
         }
 
@@ -283,13 +227,8 @@ void retain_branch_loop(int children_to_spawn) {
 
         // Count how many observes are complete; if they all are, let the other particles
         // know it is time to move to the next observe.
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        globals->end_observe_counter++;
-        debug_print(3,"[end_observe] counter = %d (wait until %d)\n", globals->end_observe_counter, NUM_PARTICLES);
-        if(globals->end_observe_counter == NUM_PARTICLES) {
-            pthread_cond_broadcast(&globals->end_observe_cond);
-        }
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        debug_print(3,"[end_observe] count down (pid %d)\n", getpid());
+        shared_latch_count_down(&globals->end_observe);
 
 
         while (!globals->is_retained_particle_set) {
@@ -303,7 +242,7 @@ void retain_branch_loop(int children_to_spawn) {
         debug_print(4,"observe %d, pid %d; retaining %d. Is retained? %d\n", locals->current_observe, getpid(), globals->retained[locals->current_observe].retained_pid, is_retained);
         if (!is_retained) {
             // Not retained? gobble up ALL children, and exit
-            cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+            reaper_release_children(&locals->live_offspring_count);
             destroy_particle();
         }
 
@@ -338,6 +277,7 @@ void retain_branch_loop(int children_to_spawn) {
         }
         // Time to branch. Get number of children to spawn
         children_to_spawn = globals->n_offspring[NUM_PARTICLES-1] - 1;
+        first_slot = globals->offspring_slot[NUM_PARTICLES-1];
         pthread_mutex_unlock(&(globals->retained[locals->current_observe].branch_mutex));
 
         // If the number of children to spawn is NEGATIVE, it means it is time to
@@ -345,14 +285,14 @@ void retain_branch_loop(int children_to_spawn) {
         assert(locals->live_offspring_count == 1);
         if (children_to_spawn < 0) {
             debug_print(4,"Removing retained particle node %d (currently has %d children)\n", getpid(), locals->live_offspring_count);
-            cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+            reaper_release_children(&locals->live_offspring_count);
             destroy_particle();
         }
 
         // Re-print retained particle PREDICT directives at end of execution trace.
         if (locals->current_observe == NUM_OBSERVES-1) {
             assert(globals->has_retained_particle);
-            flush_output(&globals->stdout_mutex, locals->predict);
+            flush_predicts(&globals->stdout_mutex, locals->predict);
         }
     }
 }
@@ -364,20 +304,19 @@ void retain_branch_loop(int children_to_spawn) {
  */
 void set_retained_particle() {
 
-    // Update shared globals (synchronized via mutex)
-    pthread_mutex_lock(&(globals->exec_complete_mutex));
-    int shared_globals_index = globals->exec_complete_counter;
-    globals->exec_complete_counter += 1;
-    debug_print(3,"%d of %d particles at end of program (+%d reprint)\n", globals->exec_complete_counter, NUM_PARTICLES, globals->has_retained_particle);
+    // The retained particle (slot NUM_PARTICLES-1) does not re-run the program
+    int shared_globals_index = locals->particle_index;
+    int participants = NUM_PARTICLES - (globals->has_retained_particle ? 1 : 0);
+    debug_print(3,"particle %d of %d at end of program (+%d reprint)\n", shared_globals_index, participants, globals->has_retained_particle);
 
     // Wait until processes are synchronized
-    if (globals->exec_complete_counter + globals->has_retained_particle >= NUM_PARTICLES) {
+    int sense;
+    if (shared_barrier_arrive(&globals->exec_complete, shared_globals_index, participants, &sense)) {
 
         globals->next_to_retain = uniform_discrete_rng(NUM_PARTICLES);
 
-        debug_print(3,"[broadcast retain_cond] retained particle index = %d\n", globals->next_to_retain);
+        debug_print(3,"[release exec_complete] retained particle index = %d\n", globals->next_to_retain);
 
-        pthread_cond_broadcast(&globals->exec_complete_cond);
         //debug_print(4,"End of iteration; retaining %d\n", globals->next_to_retain);
 
         // If we're retaining the previously retained particle, handle that separately.
@@ -394,13 +333,11 @@ void set_retained_particle() {
         // Set static property: from now on, we are now running conditional SMC
         globals->has_retained_particle = true;
 
+        shared_barrier_release(&globals->exec_complete);
     } else {
-        while(globals->exec_complete_counter + globals->has_retained_particle < NUM_PARTICLES) {
-            debug_print(3,"[wait retain_cond] retained counter = %d\n", globals->exec_complete_counter);
-            pthread_cond_wait(&globals->exec_complete_cond, &globals->exec_complete_mutex);
-        }
+        debug_print(3,"[wait exec_complete] particle %d\n", shared_globals_index);
+        shared_barrier_wait(&globals->exec_complete, sense);
     }
-    pthread_mutex_unlock(&globals->exec_complete_mutex);
 
     // debug_print(4,"retained me? at index %d, retain %d\n", shared_globals_index, globals->next_to_retain);
     if (globals->next_to_retain == shared_globals_index) {
@@ -428,7 +365,7 @@ void predict(const char *format, ...) {
 	if (IS_PRERUN) { return; }
     va_list args;
     va_start(args, format);
-    utstring_printf_va(locals->predict, format, args);
+    predict_buffer_printf_va(locals->predict, format, args);
     va_end(args);
 }
 
@@ -438,8 +375,12 @@ void predict(const char *format, ...) {
  */
 void predict_value(const char *name, const double value) {
 	if (IS_PRERUN) { return; }
-    // generate "predict" queries, given name and value.
-    utstring_printf(locals->predict,"%s,%f\n", name, value);
+    predict_buffer_add_double(locals->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+	if (IS_PRERUN) { return; }
+    predict_buffer_add_int(locals->predict, name, value);
 }
 
 void weight_trace(const double ln_p, const bool synchronize) {
@@ -456,39 +397,42 @@ void weight_trace(const double ln_p, const bool synchronize) {
  		    locals->log_weight += ln_p;
  		    return;
  		}
+        profile_user_pause();
+        perf_counters_observe(locals->current_observe + 1);
 
-		// We want to branch and resample on every synchronizing observe
- 		pthread_mutex_lock(&(globals->begin_observe_mutex));
+		// We want to branch and resample on every synchronizing observe.
+		// Each particle owns a fixed slot; the retained particle's is the last one.
  		int particles_to_count = NUM_PARTICLES - (globals->has_retained_particle ? 1 : 0);
- 		int shared_globals_index = globals->begin_observe_counter;
+ 		int shared_globals_index = locals->particle_index;
  		locals->log_weight += ln_p;
  		globals->log_weights[shared_globals_index] = locals->log_weight;
- 		globals->begin_observe_counter += 1;
 
-        debug_print(4,"[OBSERVE %d, %d] #%d, %0.4f\n", locals->current_observe, getpid(), globals->begin_observe_counter, ln_p);
-
-        // TODO check, fix
+        debug_print(4,"[OBSERVE %d, %d] slot #%d, %0.4f\n", locals->current_observe, getpid(), shared_globals_index, ln_p);
 
  		// Wait until processes are synchronized
-        debug_print(3,"[observe #%d] #%d\n", locals->current_observe, globals->begin_observe_counter);
- 		if (globals->begin_observe_counter >= particles_to_count) {
- 			debug_print(4,"%d: observed %d of %d particles, moving on\n", getpid(), globals->begin_observe_counter, particles_to_count);
+ 		int sense;
+ 		bool is_standby = false;
+ 		unsigned long standby_seed = 0;
+ 		int standby_slot = 0;
+ 		if (shared_barrier_arrive(&globals->begin_observe, shared_globals_index, particles_to_count, &sense)) {
+ 			debug_print(4,"%d: observed all %d particles, moving on\n", getpid(), particles_to_count);
 
  			// Sample number of children
  			// Get update from retained particle, if there is one
  			if (globals->has_retained_particle) {
-                // TODO check, fix
                 debug_print(4,"YES THERE IS A RETAINED PARTICLE, it has log weight %f\n", globals->retained[locals->current_observe].retained_ln_p);
  				globals->log_weights[NUM_PARTICLES-1] = globals->retained[locals->current_observe].retained_ln_p; // retained_node->log_weight;
  			}
 
-            // Reset observe counters to zero
-            globals->begin_observe_counter = 0;
-            globals->end_observe_counter = 0;
+            // Every control process counts down once after branching, as does every killed particle
+            shared_latch_set(&globals->end_observe, NUM_PARTICLES);
 
  			// sample offspring counts
-	    multinomial_resample();
-            //residual_resample();
+            uint64_t resample_start = profile_clock();
+ 			resample();
+ 			resample_assign_slots(globals->n_offspring, NUM_PARTICLES, globals->offspring_slot);
+ 			zygote_pool_plan(&globals->zygotes, globals->n_offspring, NUM_PARTICLES);
+            profile_end(PROFILE_RESAMPLE, resample_start);
 
  			// Signal retained node to create children
             if (globals->has_retained_particle) {
@@ -501,44 +445,52 @@ void weight_trace(const double ln_p, const bool synchronize) {
             }
 
             // Inform peer particles that synchronization for this observe is complete
-            debug_print(3,"[broadcast begin_observe] observe = %d\n", locals->current_observe);
- 			pthread_cond_broadcast(&globals->begin_observe_cond);
+            debug_print(3,"[release begin_observe] observe = %d\n", locals->current_observe);
+ 			shared_barrier_release(&globals->begin_observe);
  		} else {
- 			debug_print(4,"%d: observed %d of %d particles, waiting...\n", getpid(), globals->begin_observe_counter, particles_to_count);
- 			// This *looks* strange, but the begin_observe_counter is incremented every
- 			// time this function is called, and then reset to zero before broadcast().
- 			while (globals->begin_observe_counter != 0) {
-                debug_print(3,"[wait begin_observe] observe barrier counter = %d (pid %d)\n", globals->begin_observe_counter, getpid());
-     			pthread_cond_wait(&globals->begin_observe_cond, &globals->begin_observe_mutex);
-     		}
+ 			debug_print(4,"%d: waiting for %d particles at observe...\n", getpid(), particles_to_count);
+            // Use the idle time to pre-fork children we may need after resampling
+            is_standby = zygote_pool_fill(&globals->zygotes, shared_globals_index, locals->log_weight, &globals->begin_observe, sense,
+                                          &locals->live_offspring_count, &standby_seed, &standby_slot);
+            if (!is_standby) {
+                uint64_t wait_start = profile_clock();
+                shared_barrier_wait(&globals->begin_observe, sense);
+                profile_end(PROFILE_BARRIER, wait_start);
+            }
  		}
- 		pthread_mutex_unlock(&(globals->begin_observe_mutex));
 
         // Enter main control loop
         int n_offspring = globals->n_offspring[shared_globals_index];
-        if (n_offspring > 0) {
-            retain_branch_loop(n_offspring);
+        if (is_standby) {
+            // Activated standby: carry on exactly like a child forked in retain_branch_loop
+            set_rng_seed(standby_seed);
+            debug_print(4,"[%d -> %d] (standby)\n", getppid(), getpid());
+            locals->live_offspring_count = 0;
+            locals->particle_index = standby_slot;
+            locals->current_observe++;
+            locals->pid_trace[locals->current_observe] = getpid();
+        } else if (n_offspring > 0) {
+            int first_slot = globals->offspring_slot[shared_globals_index];
+            int activated = zygote_pool_activate(&globals->zygotes, shared_globals_index, n_offspring, first_slot + n_offspring - 1);
+            zygote_pool_discard(&globals->zygotes, shared_globals_index);
+            retain_branch_loop(n_offspring - activated, first_slot);
         } else {
-            pthread_mutex_lock(&globals->end_observe_mutex);
-            globals->end_observe_counter++;
-            debug_print(3,"[end_observe] counter = %d (wait until %d) (%d had no children)\n", globals->end_observe_counter, NUM_PARTICLES, getpid());
-            if(globals->end_observe_counter == NUM_PARTICLES) {
-                pthread_cond_broadcast(&globals->end_observe_cond);
-            }
-            pthread_mutex_unlock(&globals->end_observe_mutex);
+            zygote_pool_discard(&globals->zygotes, shared_globals_index);
+            debug_print(3,"[end_observe] count down (%d had no children)\n", getpid());
+            shared_latch_count_down(&globals->end_observe);
+            zygote_pool_reap(&locals->live_offspring_count);
             destroy_particle();
         }
 
  		// Wait until all particles have finished handling this observation
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        while (globals->end_observe_counter < NUM_PARTICLES) {
-            debug_print(3,"[wait end_observe] only seen %d of %d\n", globals->end_observe_counter, NUM_PARTICLES);
-            pthread_cond_wait(&globals->end_observe_cond, &globals->end_observe_mutex);
-        }
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        debug_print(3,"[wait end_observe] pid %d\n", getpid());
+        uint64_t wait_start = profile_clock();
+        shared_latch_wait(&globals->end_observe);
+        profile_end(PROFILE_BARRIER, wait_start);
 
         // Reset (local) log_weight for next observe
         locals->log_weight = 0;
+        profile_user_resume();
 
 	}
 }
@@ -555,20 +507,19 @@ void anglican_init_globals() {
     globals = (shared_globals *)shared_memory_alloc(sizeof(shared_globals));
     globals->log_weights = (double *)shared_memory_alloc(NUM_PARTICLES*sizeof(double));
     globals->n_offspring = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
+    globals->offspring_slot = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
 
-    // Initialize process locks
-    init_shared_mutex(&globals->exec_complete_mutex, &globals->exec_complete_cond);
-    init_shared_mutex(&globals->begin_observe_mutex, &globals->begin_observe_cond);
-    init_shared_mutex(&globals->end_observe_mutex, &globals->end_observe_cond);
+    // Initialize process locks and barriers
+    shared_barrier_init(&globals->exec_complete, NUM_PARTICLES, BARRIER_FANOUT);
+    shared_barrier_init(&globals->begin_observe, NUM_PARTICLES, BARRIER_FANOUT);
+    shared_latch_set(&globals->end_observe, 0);
+    zygote_pool_init(&globals->zygotes, NUM_PARTICLES, ZYGOTES, INFINITY);
     init_shared_mutex(&globals->retained_particle_set_mutex, &globals->retained_particle_set_cond);
     init_shared_mutex(&globals->retain_complete_mutex, &globals->retain_complete_cond);
     init_shared_mutex(&globals->stdout_mutex, NULL);
 
     // Initialize globals
-    globals->begin_observe_counter = 0;
-    globals->end_observe_counter = 0;
     globals->has_retained_particle = false;
-    globals->exec_complete_counter = 0;
 }
 
 
@@ -578,15 +529,12 @@ void anglican_init_globals() {
  *
  */
 int infer(int (*f)(int, char**), int argc, char **argv) {
-fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
-
 
     pid_t main_pid = getpid();
     debug_print(1, "Main process pid: %d\n", main_pid);
 
     // Initialize random number generators
-    erp_rng_init();
-    if (INITIAL_SEED >= 0) set_rng_seed(INITIAL_SEED);
+    erp_rng_init(INITIAL_SEED);
 
     // Create shared globals
     anglican_init_globals();
@@ -596,7 +544,7 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
     locals = &_locals;
     locals->live_offspring_count = 0;
     locals->current_observe = 0;
-	utstring_new(locals->predict);
+	locals->predict = predict_buffer_new();
 
 	// Do initial prerun (at the moment, all this does is count the number of observes)
     pid_t prerun_pid = fork();
@@ -619,8 +567,19 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
 
 	debug_print(1, "Number of observes: %d\n", NUM_OBSERVES-1);
 
+    // Orphaned particles are collected here, so particles need not wait for their children
+    reaper_init();
+
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
+    // Particles hand their output to a collector thread, rather than each writing it out
+    output_ring_init(OUTPUT_RING_BYTES);
+
     // Get memory required for struct
-    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + sizeof(int)) + (NUM_OBSERVES+1)*sizeof(retained_particle);
+    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + 2*sizeof(int)) + (NUM_OBSERVES+1)*sizeof(retained_particle);
     debug_print(1, "Shared memory size: %d bytes\n", mem_size);
 
     // Allocate variables which depend on observe count
@@ -648,7 +607,6 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
 #endif
 
         globals->is_retained_particle_set = false;
-        globals->exec_complete_counter = 0;
         globals->retain_complete_counter = 0;
 
         int particles_to_start = globals->has_retained_particle ? NUM_PARTICLES - 1 : NUM_PARTICLES;
@@ -657,22 +615,24 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
             unsigned long int seed = gen_new_rng_seed();
 
             // Fork and run
-            start = clock();
+            uint64_t fork_start = profile_clock();
             pid_t child_pid = fork();
-            end = clock();
             if (child_pid == 0) {
 
                 // Child process: run program
                 locals->live_offspring_count = 0;
+                locals->particle_index = i;
                 debug_print(4,"new child rng seed: %ld\n", seed);
                 set_rng_seed(seed);
 
                 debug_print(4,"[%d -> %d]\n", main_pid, getpid());
 
                 locals->pid_trace[0] = getpid();
+                profile_user_resume();
                 f(argc, argv);
+                profile_user_pause();
                 observe(0); // "dummy" observe to mark end of program.
-                flush_output(&globals->stdout_mutex, locals->predict);
+                flush_predicts(&globals->stdout_mutex, locals->predict);
 
                 set_retained_particle();
 
@@ -681,10 +641,11 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
                 // Error
                 perror("fork");
                 free(locals->pid_trace);
-                utstring_free(locals->predict);
+                predict_buffer_free(locals->predict);
                 exit(1);
             } else {
-                fprintf(fp, "%lu, ", (end - start));
+                profile_end(PROFILE_FORK, fork_start);
+                reaper_track(child_pid);
                 locals->live_offspring_count++;
             }
 
@@ -692,6 +653,11 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
             assert(child_pid > 0);
         }
 
+        // Collect terminated child processes (all but the retained one), and
+        // orphaned descendants, as they exit
+        debug_print(4,"Done launching particles -- waiting for %d of them to finish\n", locals->live_offspring_count-1);
+        reaper_wait_children(locals->live_offspring_count-1, &locals->live_offspring_count);
+
         // Chill out here until the retained particle has been set.
         pthread_mutex_lock(&(globals->retain_complete_mutex));
         while (globals->retain_complete_counter < NUM_OBSERVES) {
@@ -707,12 +673,13 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
         }
 #endif
 
-        // Collect terminated child processes
-        debug_print(4,"Done launching particles -- waiting for %d of them to finish\n", locals->live_offspring_count-1);
-        cleanup_children(locals->live_offspring_count-1, &locals->live_offspring_count);
-
         // Print out per-iteration timing info
         if (TIME_ITERATION) print_walltime(&globals->stdout_mutex, iter+1, &start_time);
+
+        // Print summaries so far
+        if (aggregate_every() > 0 && (iter+1) % aggregate_every() == 0 && iter+1 < NUM_ITERATIONS) {
+            aggregate_print(stdout, iter+1);
+        }
     }
 
 #if DEBUG_LEVEL >= 3
@@ -733,10 +700,20 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/fork.csv", "w");
         pthread_mutex_unlock(&(globals->retained[i].branch_mutex));
     }
 
-    //printf("collecting last retained particle\n");
-    wait(NULL);
+    // Collect the last retained particle, and anything still exiting
+    reaper_wait_all(&locals->live_offspring_count);
+    output_ring_close();
+    sample_file_close();
+    aggregate_print(stdout, 0);
+
+    // Report how much fork latency the zygote pool hid
+    if (ZYGOTES > 0) zygote_pool_print_stats(&globals->zygotes, stderr);
+
+    // Report process counts
+    if (DEBUG_LEVEL >= 1) reaper_print_stats(stderr);
+
     free(locals->pid_trace);
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
 
     return 0;
 }
@@ -749,11 +726,18 @@ void parse_args(int argc, char **argv) {
         {"particles", required_argument, 0, 'p'},
         {"iterations", required_argument, 0, 'i'},
         {"timeit", no_argument, 0, 't'},
-        {"rng_seed", required_argument, 0, 'r'}
+        {"rng_seed", required_argument, 0, 'r'},
+        {"resampler", required_argument, 0, 'R'},
+        {"barrier_fanout", required_argument, 0, 'b'},
+        {"zygotes", required_argument, 0, 'z'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
     };
     int c, option_index;
 
-    while((c = getopt_long(argc, argv, "p:i:tr:", long_options, &option_index)) != -1) {
+    while((c = getopt_long(argc, argv, "p:i:tr:R:b:z:o:O:A::", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 NUM_PARTICLES = atoi(optarg);
@@ -767,6 +751,30 @@ void parse_args(int argc, char **argv) {
             case 'r':
                 INITIAL_SEED = atol(optarg);
                 break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
+            case 'R':
+                if (!resampler_from_name(optarg, &RESAMPLER)) {
+                    fprintf(stderr, "Unknown resampler: %s (multinomial, stratified or systematic; residual is the same as systematic)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                BARRIER_FANOUT = atoi(optarg);
+                break;
+            case 'z':
+                ZYGOTES = atoi(optarg);
+                break;
         }
     }
 
@@ -17,6 +17,15 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
+#include "resample.h"
+#include "zygote.h"
+#include "reaper.h"
+#include "output-ring.h"
+#include "sync-policy.h"
+#include "sample-file.h"
+#include "aggregate.h"
+#include "profile.h"
+#include "perf-counters.h"
 
 
 // Set defaults for number of particles and iterations
@@ -32,6 +41,18 @@ static long INITIAL_SEED = -1;
 // Flag to mark whether or not to record walltime each iteration
 static bool TIME_ITERATION = false;
 
+// Scheme used to sample offspring counts
+static resampler_type RESAMPLER = RESAMPLE_MULTINOMIAL;
+
+// Fanout of the observe barrier's combining tree (0 = flat barrier)
+static int BARRIER_FANOUT = 0;
+
+// Standby children pre-forked per particle while waiting at an observe (0 = off)
+static int ZYGOTES = 0;
+
+// Which synchronizing observes are barriers
+static sync_policy SYNC_POLICY = { SYNC_ALWAYS, 1 };
+
 
 /**
  * Struct containing global (shared) state variables
@@ -43,6 +64,9 @@ typedef struct {
     double *log_weights;
     int *n_offspring;
 
+    // First slot index taken by each particle's offspring after resampling
+    int *offspring_slot;
+
     // Store per-particle predict buffer
     char **buffer;
     int *bufsize;
@@ -56,20 +80,20 @@ typedef struct {
     
     // Synchronization state
 
+    // Which upcoming synchronizing observes are barriers (updated by barrier leaders)
+    sync_schedule schedule;
+
     // Barrier: all particles have reached an observe
-    int begin_observe_counter;
-    pthread_mutex_t begin_observe_mutex;
-    pthread_cond_t begin_observe_cond;
+    shared_barrier begin_observe;
     
-    // Barrier: all particles have completed an observe
-    int end_observe_counter;
-    pthread_mutex_t end_observe_mutex;
-    pthread_cond_t end_observe_cond;
+    // Latch: all particles have completed an observe
+    shared_latch end_observe;
+
+    // Standby children, forked while particles wait at begin_observe
+    zygote_pool zygotes;
     
     // Barrier: all particles completed program execution
-    int exec_complete_counter;
-    pthread_mutex_t exec_complete_mutex;
-    pthread_cond_t exec_complete_cond;
+    shared_barrier exec_complete;
     
     // Mutex: stdout lock
     pthread_mutex_t stdout_mutex;
@@ -83,8 +107,11 @@ typedef struct {
 typedef struct {
     double log_weight;
     int current_observe;
+    int sync_index;
+    bool force_sync;
+    int particle_index;
     int live_offspring_count;
-    UT_string *predict;
+    predict_buffer *predict;
 } process_locals;
 
 
@@ -93,75 +120,19 @@ static shared_globals *globals;
 
 
 /**
- * Sample number of offspring, given particle weights
- * Basic multinomial resampling scheme
- *
- */
-void multinomial_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = 0;
-    }
-
-    // Draw number of offspring.
-    for (s=0; s<NUM_PARTICLES; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
-
-
-#if DEBUG_LEVEL >= 2
-    // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "LOG WEIGHT: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "N_OFFSPRING: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
-    fprintf(stderr, ">\n");
-#endif
-        
-    free(sampling_dist);
-}
-
-
-/**
- * Sample number of offspring, given particle weights
- * Residual resampling scheme
+ * Sample number of offspring, given particle weights,
+ * using the resampling scheme selected on the command line
  *
  */
-void residual_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    int remainder = NUM_PARTICLES;
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = (int)floor(NUM_PARTICLES*sampling_dist[s]);
-        remainder -= globals->n_offspring[s];
-    }
-
-    // Draw number of offspring.
-    for (s=0; s<remainder; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
+void resample() {
 
+    enter_run_rng_stream();
+    resample_offspring(RESAMPLER, globals->log_weights, NUM_PARTICLES, NUM_PARTICLES, globals->n_offspring);
+    leave_run_rng_stream();
 
 #if DEBUG_LEVEL >= 2
     // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
+    fprintf(stderr, "[resampling %d] observe #%d (%s)\n", getpid(), locals->current_observe, resampler_name(RESAMPLER));
     fprintf(stderr, "LOG WEIGHT: <");
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
     fprintf(stderr, ">\n");
@@ -169,8 +140,6 @@ void residual_resample() {
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
     fprintf(stderr, ">\n");
 #endif
-        
-    free(sampling_dist);
 }
 
 
@@ -180,7 +149,9 @@ void residual_resample() {
  */
 void destroy_particle() {
     assert(locals->live_offspring_count == 0);
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
+    profile_flush();
+    perf_counters_exit();
     _exit(0);
 }
 
@@ -192,19 +163,18 @@ void destroy_particle() {
  */
 void mh_step() {
 
-    // Update shared globals (synchronized via mutex)
-    pthread_mutex_lock(&(globals->exec_complete_mutex));
-    int shared_globals_index = globals->exec_complete_counter;
-    globals->exec_complete_counter += 1;
-    debug_print(3,"%d of %d particles at end of program\n", globals->exec_complete_counter, NUM_PARTICLES);
-
     // Wait until processes are synchronized
-    if (globals->exec_complete_counter == NUM_PARTICLES) {
+    int shared_globals_index = locals->particle_index;
+    int sense;
+    debug_print(3,"particle %d at end of program\n", shared_globals_index);
+    if (shared_barrier_arrive(&globals->exec_complete, shared_globals_index, NUM_PARTICLES, &sense)) {
 
         // TODO Metropolis-Hastings based on evidence ratio
 
         double log_ratio = globals->log_Z_hat - globals->log_Z_hat_prev;
+        enter_run_rng_stream();
         globals->accept = log(uniform_rng(0, 1)) < log_ratio;
+        leave_run_rng_stream();
         debug_print(2,"log(Z): %f -> %f\n", globals->log_Z_hat_prev, globals->log_Z_hat);
         debug_print(2,"accept ratio: %f\n", exp(log_ratio));
         debug_print(2,"accept proposal? %s\n", globals->accept ? "yes" : "no");
@@ -213,26 +183,26 @@ void mh_step() {
             globals->log_Z_hat_prev = globals->log_Z_hat;
         }
        
-        debug_print(3,"[broadcast exec_complete] %d\n", getpid());
+        debug_print(3,"[release exec_complete] %d\n", getpid());
 
-        pthread_cond_broadcast(&globals->exec_complete_cond);
+        shared_barrier_release(&globals->exec_complete);
         
     } else {
-        while(globals->exec_complete_counter < NUM_PARTICLES) {
-            debug_print(3,"[wait retain_cond] retained counter = %d\n", globals->exec_complete_counter);
-            pthread_cond_wait(&globals->exec_complete_cond, &globals->exec_complete_mutex);
-        }
+        debug_print(3,"[wait exec_complete] particle %d\n", shared_globals_index);
+        shared_barrier_wait(&globals->exec_complete, sense);
     }
-    pthread_mutex_unlock(&globals->exec_complete_mutex);
 
     if (globals->accept) {
-        char *newbuf = utstring_body(locals->predict);
-        int bufsize = utstring_len(locals->predict)+1;
+        UT_string *formatted;
+        utstring_new(formatted);
+        predict_buffer_format(locals->predict, formatted);
+        int bufsize = utstring_len(formatted)+1;
         assert(bufsize < globals->bufsize[shared_globals_index]);
-        memcpy(globals->buffer[shared_globals_index], newbuf, bufsize);
+        memcpy(globals->buffer[shared_globals_index], utstring_body(formatted), bufsize);
+        utstring_free(formatted);
     } else {
-        utstring_clear(locals->predict);
-        utstring_printf(locals->predict, "%s", globals->buffer[shared_globals_index]);
+        predict_buffer_clear(locals->predict);
+        predict_buffer_printf(locals->predict, "%s", globals->buffer[shared_globals_index]);
     }
 }
 
@@ -243,7 +213,7 @@ void mh_step() {
 void predict(const char *format, ...) {
     va_list args;
     va_start(args, format);
-    utstring_printf_va(locals->predict, format, args);
+    predict_buffer_printf_va(locals->predict, format, args);
     va_end(args);
 }
 
@@ -252,8 +222,11 @@ void predict(const char *format, ...) {
  *
  */ 
 void predict_value(const char *name, const double value) {
-    // generate "predict" queries, given name and value.
-    utstring_printf(locals->predict,"%s,%f\n", name, value);
+    predict_buffer_add_double(locals->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    predict_buffer_add_int(locals->predict, name, value);
 }
 
 void weight_trace(const double ln_p, const bool synchronize) {
@@ -265,29 +238,33 @@ void weight_trace(const double ln_p, const bool synchronize) {
         return;
     }
 
+    // Not a barrier under the current schedule: just reweight
+    int sync_index = locals->sync_index++;
+    if (!locals->force_sync && !sync_schedule_is_barrier(&globals->schedule, sync_index)) {
+        locals->log_weight += ln_p;
+        return;
+    }
+
     assert(locals->current_observe == globals->current_observe);
 
-    // We want to branch and resample on every synchronizing observe
-    pthread_mutex_lock(&(globals->begin_observe_mutex));
-    int particles_to_count = NUM_PARTICLES;
-    int shared_globals_index = globals->begin_observe_counter;
+    // We want to branch and resample on every synchronizing observe.
+    // Each particle owns a fixed slot in the shared weight vector.
+    int shared_globals_index = locals->particle_index;
     locals->log_weight += ln_p;
     globals->log_weights[shared_globals_index] = locals->log_weight;
-    globals->begin_observe_counter += 1;
     debug_print(3, "Incrementing observe counter %d to one higher than global observe counter %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid()); 
     locals->current_observe += 1;
+    perf_counters_observe(locals->current_observe);
 
-    debug_print(4,"[OBSERVE %d, %d] #%d, %0.4f\n", locals->current_observe, getpid(), globals->begin_observe_counter, ln_p);
-
-    // TODO check, fix
+    debug_print(4,"[OBSERVE %d, %d] slot #%d, %0.4f\n", locals->current_observe, getpid(), shared_globals_index, ln_p);
 
     // Wait until processes are synchronized
-    debug_print(3,"[observe #%d] #%d\n", locals->current_observe, globals->begin_observe_counter);
-    if (globals->begin_observe_counter >= particles_to_count) {
-        debug_print(4,"%d: observed %d of %d particles, moving on\n", getpid(), globals->begin_observe_counter, particles_to_count);
-
-        // Reset observe counters to zero
-        globals->begin_observe_counter = 0;
+    int sense;
+    bool is_standby = false;
+    unsigned long standby_seed = 0;
+    int standby_slot = 0;
+    if (shared_barrier_arrive(&globals->begin_observe, shared_globals_index, NUM_PARTICLES, &sense)) {
+        debug_print(4,"%d: observed all %d particles, moving on\n", getpid(), NUM_PARTICLES);
 
         // current observe?
         ++(globals->current_observe);
@@ -300,101 +277,87 @@ void weight_trace(const double ln_p, const bool synchronize) {
         }
         ESS = 1 / ESS;
         debug_print(2,"ESS at observe %d: %f\n", locals->current_observe, ESS);
-        if (ESS < 0.5*NUM_PARTICLES) {
+        bool resampled = (ESS < 0.5*NUM_PARTICLES);
+        if (resampled) {
 
             globals->log_Z_hat += log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
             debug_print(2,"[resample] estimate of log(Z) at %d: %f\n", locals->current_observe, globals->log_Z_hat);
 
             // sample offspring counts
-            multinomial_resample();
-            //residual_resample();
+            resample();
 
             for (int i=0; i<NUM_PARTICLES; i++) {
                 globals->log_weights[i] = 0;
             }
         }
+        sync_schedule_update(&globals->schedule, &SYNC_POLICY, 0.5, sync_index, ESS/NUM_PARTICLES, resampled);
+        resample_assign_slots(globals->n_offspring, NUM_PARTICLES, globals->offspring_slot);
+        zygote_pool_plan(&globals->zygotes, globals->n_offspring, NUM_PARTICLES);
 
-//        int total_offspring = 0;
-//        for (int i=0; i<NUM_PARTICLES; i++) {
-//            total_offspring += globals->n_offspring[i];
-//        }
-//        assert(total_offspring == NUM_PARTICLES);
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        globals->end_observe_counter = NUM_PARTICLES;
+        // Every surviving particle counts down once, as does every killed one
+        int end_observe_count = NUM_PARTICLES;
         for (int i=0; i<NUM_PARTICLES; i++) {
-            if (globals->n_offspring[i] == 0) globals->end_observe_counter++;
+            if (globals->n_offspring[i] == 0) end_observe_count++;
         }
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        shared_latch_set(&globals->end_observe, end_observe_count);
 
         // Inform peer particles that synchronization for this observe is complete
-        debug_print(3,"[broadcast begin_observe] observe = %d\n", locals->current_observe);
+        debug_print(3,"[release begin_observe] observe = %d\n", locals->current_observe);
         debug_print(2,"New observe global: %d (at local: %d)\n", globals->current_observe, locals->current_observe);
-        //assert(globals->end_observe_counter == 0);
-        pthread_cond_broadcast(&globals->begin_observe_cond);
+        shared_barrier_release(&globals->begin_observe);
     } else {
-        debug_print(4,"%d: observed %d of %d particles, waiting...\n", getpid(), globals->begin_observe_counter, particles_to_count);
-        // This *looks* strange, but the begin_observe_counter is incremented every 
-        // time this function is called, and then reset to zero before broadcast().
-        debug_print(3,"[wait begin_observe %d %d] observe barrier counter = %d (pid %d)\n", locals->current_observe, globals->current_observe, globals->begin_observe_counter, getpid());
-        while (globals->begin_observe_counter != 0) {
-        //while (locals->current_observe != globals->current_observe) {
-            pthread_cond_wait(&globals->begin_observe_cond, &globals->begin_observe_mutex);
+        debug_print(3,"[wait begin_observe %d %d] (pid %d)\n", locals->current_observe, globals->current_observe, getpid());
+        // Use the idle time to pre-fork children we may need after resampling
+        is_standby = zygote_pool_fill(&globals->zygotes, shared_globals_index, locals->log_weight, &globals->begin_observe, sense,
+                                      &locals->live_offspring_count, &standby_seed, &standby_slot);
+        if (!is_standby) {
+            shared_barrier_wait(&globals->begin_observe, sense);
         }
     }
-    pthread_mutex_unlock(&(globals->begin_observe_mutex));
-    debug_print(2, "Mutex released, asserting local %d == global %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid()); 
+    debug_print(2, "Barrier released, asserting local %d == global %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid()); 
     assert(locals->current_observe == globals->current_observe);
     locals->log_weight = globals->log_weights[shared_globals_index];
 
 
     // Spawn children
     int n_offspring = globals->n_offspring[shared_globals_index];
-    if (n_offspring == 0) {
+    int first_slot = globals->offspring_slot[shared_globals_index];
+    if (is_standby) {
+        // Activated standby: carry on exactly like a freshly forked child
+        set_rng_seed(standby_seed);
+        locals->live_offspring_count = 0;
+        locals->particle_index = standby_slot;
+    } else if (n_offspring == 0) {
+        zygote_pool_discard(&globals->zygotes, shared_globals_index);
         debug_print(4, "Post resample: terminating process %d (waiting %d children)\n", getpid(), locals->live_offspring_count);
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        globals->end_observe_counter--;
-        if (globals->end_observe_counter == 0) {
-            pthread_cond_broadcast(&globals->end_observe_cond);
-        }
-        debug_print(2, "Killed particle %d, counter down to %d\n", getpid(), globals->end_observe_counter);
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        shared_latch_count_down(&globals->end_observe);
+        debug_print(2, "Killed particle %d\n", getpid());
 
-        cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+        reaper_release_children(&locals->live_offspring_count);
         destroy_particle();
         assert(false); // Unreachable line of code, hopefully
     } else {
-        while (n_offspring > 1) {
-            unsigned long seed = gen_new_rng_seed();
-            pid_t child_pid = fork();
-            if (child_pid == 0) {
-                set_rng_seed(seed);
-                locals->live_offspring_count = 0;
-                break;
-            } else if (child_pid > 0) {
-                n_offspring--;
-                locals->live_offspring_count++;
-            } else {
-                debug_print(2, "ERROR WHILE FORKING %d\n", locals->current_observe);
-                perror("fork");
-                sleep(1);
-            }
+        // The parent keeps the first slot of its block; each child takes one of the rest
+        locals->particle_index = first_slot;
+        n_offspring -= zygote_pool_activate(&globals->zygotes, shared_globals_index, n_offspring - 1, first_slot + n_offspring - 1);
+        zygote_pool_discard(&globals->zygotes, shared_globals_index);
+        // Activated standbys took the top slots; fork the rest as a tree
+        int child_slot = zygote_pool_fork_tree(&globals->zygotes, first_slot + 1, n_offspring - 1,
+                                               &locals->live_offspring_count);
+        if (child_slot >= 0) {
+            locals->particle_index = child_slot;
         }
     }
     
-    pthread_mutex_lock(&globals->end_observe_mutex);
-    globals->end_observe_counter--;
-    debug_print(2, "%d particles remaining [index %d, %d]\n", globals->end_observe_counter, shared_globals_index, getpid());
-    if (globals->end_observe_counter == 0) {
+    if (shared_latch_count_down(&globals->end_observe)) {
         debug_print(2,"END OF OBSERVE %d\n", globals->current_observe);
-        pthread_cond_broadcast(&globals->end_observe_cond);
+        zygote_pool_reap(&locals->live_offspring_count);
     } else {
-        while (globals->end_observe_counter > 0) {
-            pthread_cond_wait(&globals->end_observe_cond, &globals->end_observe_mutex);
-        }
+        zygote_pool_reap(&locals->live_offspring_count);
+        shared_latch_wait(&globals->end_observe);
     }
-    pthread_mutex_unlock(&globals->end_observe_mutex);
     assert(locals->current_observe == globals->current_observe);
-    debug_print(2, "[index %d, %d] I am through with observe %d\n", shared_globals_index, getpid(), locals->current_observe);
+    debug_print(2, "[index %d, %d] I am through with observe %d\n", locals->particle_index, getpid(), locals->current_observe);
 }
 
 
@@ -409,6 +372,7 @@ void init_globals() {
     globals = (shared_globals *)shared_memory_alloc(sizeof(shared_globals));
     globals->log_weights = (double *)shared_memory_alloc(NUM_PARTICLES*sizeof(double));
     globals->n_offspring = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
+    globals->offspring_slot = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
 
     // Set print buffer
     globals->buffer = (char **)shared_memory_alloc(NUM_PARTICLES*sizeof(char*));
@@ -420,15 +384,13 @@ void init_globals() {
         globals->bufsize[i] = buf_init;
     }
     
-    // Initialize process locks
-    init_shared_mutex(&globals->exec_complete_mutex, &globals->exec_complete_cond);
-    init_shared_mutex(&globals->begin_observe_mutex, &globals->begin_observe_cond);
-    init_shared_mutex(&globals->end_observe_mutex, &globals->end_observe_cond);
+    // Initialize process locks and barriers
+    shared_barrier_init(&globals->exec_complete, NUM_PARTICLES, BARRIER_FANOUT);
+    shared_barrier_init(&globals->begin_observe, NUM_PARTICLES, BARRIER_FANOUT);
+    shared_latch_set(&globals->end_observe, 0);
+    zygote_pool_init(&globals->zygotes, NUM_PARTICLES, ZYGOTES, 0.5);
     init_shared_mutex(&globals->stdout_mutex, NULL);
-    
-    // Initialize globals
-    globals->begin_observe_counter = 0;
-    globals->exec_complete_counter = 0;
+    sync_schedule_init(&globals->schedule, &SYNC_POLICY);
 }
 
 
@@ -443,8 +405,7 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
     debug_print(1, "Main process pid: %d\n", main_pid);
     
     // Initialize random number generators
-    erp_rng_init();
-    if (INITIAL_SEED >= 0) set_rng_seed(INITIAL_SEED);
+    erp_rng_init(INITIAL_SEED);
 
     // Create shared globals
     init_globals();
@@ -453,11 +414,22 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
     process_locals _locals;
     locals = &_locals;
     locals->live_offspring_count = 0;
-	utstring_new(locals->predict);
+	locals->predict = predict_buffer_new();
+
+
+    // Orphaned particles are collected here, so particles need not wait for their children
+    reaper_init();
 
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
+    // Particles hand their output to a collector thread, rather than each writing it out
+    output_ring_init(OUTPUT_RING_BYTES);
 
     // Get memory required for struct
-    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + sizeof(int));
+    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + 2*sizeof(int));
     debug_print(1, "Shared memory size: %d bytes\n", mem_size);
 
     // Start timer
@@ -473,7 +445,10 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
     for (int iter=0; iter<NUM_ITERATIONS; iter++) {
 
         locals->current_observe = 0;
+        locals->sync_index = 0;
+        locals->force_sync = false;
         globals->current_observe = 0;
+        sync_schedule_restart(&globals->schedule, &SYNC_POLICY);
         globals->log_Z_hat = 0;
 
 #if DEBUG_LEVEL >= 3
@@ -482,8 +457,6 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
         debug_print(1, "PMCMC iteration %d of %d\n", 1+iter, NUM_ITERATIONS);
 #endif
 
-        globals->exec_complete_counter = 0;
-        
         for (int i=0; i<NUM_PARTICLES; i++) {
             // We need to set each particle with a distinct random number seed
             unsigned long int seed = gen_new_rng_seed();
@@ -494,32 +467,37 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
 
                 // Child process: run program
                 locals->live_offspring_count = 0;
+                locals->particle_index = i;
                 debug_print(4,"new child rng seed: %ld\n", seed);
                 set_rng_seed(seed);
 
                 debug_print(4,"[%d -> %d]\n", main_pid, getpid());
 
                 f(argc, argv);
-                observe(0); // "dummy" observe to mark end of program.
+
+                // "dummy" observe to mark end of program; always a barrier, as we resample
+                locals->force_sync = true;
+                observe(0);
                 
                 double excess_weight = log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
                 if (excess_weight > 0) {
                     globals->log_Z_hat += excess_weight;
-                    multinomial_resample();
+                    resample();
                 }
 
                 mh_step();
 
-                flush_output(&globals->stdout_mutex, locals->predict);
+                flush_predicts(&globals->stdout_mutex, locals->predict);
 
-                cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+                reaper_release_children(&locals->live_offspring_count);
                 destroy_particle();
             } else if (child_pid < 0) {
                 // Error
                 perror("fork");
-                utstring_free(locals->predict);
+                predict_buffer_free(locals->predict);
                 exit(1);
             } else {
+                reaper_track(child_pid);
                 locals->live_offspring_count++;
             }
 
@@ -533,22 +511,34 @@ int infer(int (*f)(int, char**), int argc, char **argv) {
         }
 #endif
 
-        pthread_mutex_lock(&globals->exec_complete_mutex);
-        while (globals->exec_complete_counter < NUM_PARTICLES) {
-            debug_print(3, "Blocking on exec complete cond in main process: %d of %d complete\n", globals->exec_complete_counter, NUM_PARTICLES);
-            pthread_cond_wait(&globals->exec_complete_cond, &globals->exec_complete_mutex);
-        }
-        pthread_mutex_unlock(&globals->exec_complete_mutex);
-
-        // Collect terminated child processes
+        // Collect terminated particles, including orphaned descendants;
+        // this returns once every particle has finished the iteration
         debug_print(4,"Done launching particles -- waiting for %d of them to finish\n", locals->live_offspring_count);
-        cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+        reaper_wait_all(&locals->live_offspring_count);
 
         // Print out per-iteration timing info
         if (TIME_ITERATION) print_walltime(&globals->stdout_mutex, iter+1, &start_time);
+
+        // Print summaries so far
+        if (aggregate_every() > 0 && (iter+1) % aggregate_every() == 0 && iter+1 < NUM_ITERATIONS) {
+            aggregate_print(stdout, iter+1);
+        }
     }
 
-    utstring_free(locals->predict);
+    output_ring_close();
+    sample_file_close();
+    aggregate_print(stdout, 0);
+
+    // Report how much fork latency the zygote pool hid
+    if (ZYGOTES > 0) zygote_pool_print_stats(&globals->zygotes, stderr);
+
+    // Report how many synchronizing observes were actually barriers
+    if (SYNC_POLICY.type != SYNC_ALWAYS) sync_schedule_print_stats(&globals->schedule, &SYNC_POLICY, stderr);
+
+    // Report process counts
+    if (DEBUG_LEVEL >= 1) reaper_print_stats(stderr);
+
+    predict_buffer_free(locals->predict);
     return 0;
 }
 
@@ -561,11 +551,19 @@ void parse_args(int argc, char **argv) {
         {"particles", required_argument, 0, 'p'},
         {"iterations", required_argument, 0, 'i'},
         {"timeit", no_argument, 0, 't'},
-        {"rng_seed", required_argument, 0, 'r'}
+        {"rng_seed", required_argument, 0, 'r'},
+        {"resampler", required_argument, 0, 'R'},
+        {"barrier_fanout", required_argument, 0, 'b'},
+        {"zygotes", required_argument, 0, 'z'},
+        {"sync_policy", required_argument, 0, 's'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
     };
     int c, option_index;
 
-    while((c = getopt_long(argc, argv, "p:i:tr:", long_options, &option_index)) != -1) {
+    while((c = getopt_long(argc, argv, "p:i:tr:R:b:z:s:o:O:A::", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 NUM_PARTICLES = atoi(optarg);
@@ -579,6 +577,36 @@ void parse_args(int argc, char **argv) {
             case 'r':
                 INITIAL_SEED = atol(optarg);
                 break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
+            case 'R':
+                if (!resampler_from_name(optarg, &RESAMPLER)) {
+                    fprintf(stderr, "Unknown resampler: %s (multinomial, stratified or systematic; residual is the same as systematic)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                BARRIER_FANOUT = atoi(optarg);
+                break;
+            case 'z':
+                ZYGOTES = atoi(optarg);
+                break;
+            case 's':
+                if (!sync_policy_from_name(optarg, &SYNC_POLICY)) {
+                    fprintf(stderr, "Unknown sync policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
         }
     }
 
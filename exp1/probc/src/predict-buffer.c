@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uthash.h"
+#include "predict-buffer.h"
+#include "sample-file.h"
+
+
+typedef struct {
+    char *name;
+    int id;
+    UT_hash_handle hh;
+} interned_name;
+
+// Process-wide name table; the lock is only contended by coro's threads
+static interned_name *names_by_string = NULL;
+static char **names = NULL;
+static int num_names = 0;
+static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int intern(const char *name) {
+    pthread_mutex_lock(&names_mutex);
+    interned_name *entry;
+    HASH_FIND_STR(names_by_string, name, entry);
+    if (entry == NULL) {
+        entry = malloc(sizeof(interned_name));
+        entry->name = strdup(name);
+        entry->id = num_names;
+        names = realloc(names, (num_names + 1)*sizeof(char *));
+        names[num_names++] = entry->name;
+        HASH_ADD_KEYPTR(hh, names_by_string, entry->name, strlen(entry->name), entry);
+    }
+    int id = entry->id;
+    pthread_mutex_unlock(&names_mutex);
+    return id;
+}
+
+static inline void add_record(predict_buffer *buffer, predict_record *record) {
+    utstring_bincpy(buffer->records, record, sizeof(predict_record));
+}
+
+static inline int num_records(const predict_buffer *buffer) {
+    return utstring_len(buffer->records) / sizeof(predict_record);
+}
+
+static inline const predict_record *record_at(const predict_buffer *buffer, int index) {
+    return (const predict_record *)utstring_body(buffer->records) + index;
+}
+
+
+predict_buffer *predict_buffer_new() {
+    predict_buffer *buffer = malloc(sizeof(predict_buffer));
+    utstring_new(buffer->records);
+    utstring_new(buffer->text);
+    return buffer;
+}
+
+void predict_buffer_free(predict_buffer *buffer) {
+    utstring_free(buffer->records);
+    utstring_free(buffer->text);
+    free(buffer);
+}
+
+void predict_buffer_clear(predict_buffer *buffer) {
+    utstring_clear(buffer->records);
+    utstring_clear(buffer->text);
+}
+
+void predict_buffer_copy(predict_buffer *dst, const predict_buffer *src) {
+    predict_buffer_clear(dst);
+    utstring_concat(dst->records, src->records);
+    utstring_concat(dst->text, src->text);
+}
+
+
+void predict_buffer_printf_va(predict_buffer *buffer, const char *format, va_list args) {
+    predict_record record = { .name = -1, .type = PREDICT_TEXT };
+    record.value.text.offset = utstring_len(buffer->text);
+    utstring_printf_va(buffer->text, format, args);
+    record.value.text.length = utstring_len(buffer->text) - record.value.text.offset;
+
+    // Consecutive text records are merged
+    int count = num_records(buffer);
+    if (count > 0 && record_at(buffer, count-1)->type == PREDICT_TEXT) {
+        ((predict_record *)record_at(buffer, count-1))->value.text.length += record.value.text.length;
+    } else {
+        add_record(buffer, &record);
+    }
+}
+
+void predict_buffer_printf(predict_buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    predict_buffer_printf_va(buffer, format, args);
+    va_end(args);
+}
+
+void predict_buffer_add_double(predict_buffer *buffer, const char *name, double value) {
+    predict_record record = { .name = intern(name), .type = PREDICT_DOUBLE, .value.d = value };
+    add_record(buffer, &record);
+}
+
+void predict_buffer_add_int(predict_buffer *buffer, const char *name, long value) {
+    predict_record record = { .name = intern(name), .type = PREDICT_INT, .value.i = value };
+    add_record(buffer, &record);
+}
+
+
+/**
+ * Format records, with `suffix` (if not NULL) appended to every line
+ *
+ */
+static void format_records(const predict_buffer *buffer, UT_string *out, const char *suffix) {
+    pthread_mutex_lock(&names_mutex);
+    int count = num_records(buffer);
+    for (int r=0; r<count; r++) {
+        const predict_record *record = record_at(buffer, r);
+        switch (record->type) {
+            case PREDICT_DOUBLE:
+                utstring_printf(out, "%s,%f%s\n", names[record->name], record->value.d, suffix ? suffix : "");
+                break;
+            case PREDICT_INT:
+                utstring_printf(out, "%s,%ld%s\n", names[record->name], record->value.i, suffix ? suffix : "");
+                break;
+            case PREDICT_TEXT: {
+                const char *text = utstring_body(buffer->text) + record->value.text.offset;
+                int length = record->value.text.length;
+                if (suffix == NULL) {
+                    utstring_bincpy(out, text, length);
+                    break;
+                }
+                // Only complete lines get a suffix (and are output)
+                const char *end = text + length;
+                const char *newline;
+                while (text < end && (newline = memchr(text, '\n', end - text)) != NULL) {
+                    utstring_printf(out, "%.*s%s\n", (int)(newline - text), text, suffix);
+                    text = newline + 1;
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&names_mutex);
+}
+
+void predict_buffer_format(const predict_buffer *buffer, UT_string *out) {
+    format_records(buffer, out, NULL);
+}
+
+void predict_buffer_format_weighted(const predict_buffer *buffer, UT_string *out, double log_weight, long id) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ",%f,%ld", log_weight, id);
+    format_records(buffer, out, suffix);
+}
+
+
+/**
+ * Parse one line of predict(format, ...) text, "name,value"; lines whose
+ * value is not a number are skipped (with a warning, once)
+ *
+ */
+static void visit_line(const char *line, size_t length, predict_visitor visit, void *context) {
+    static bool warned = false;
+    const char *comma = memchr(line, ',', length);
+    size_t value_length = (comma == NULL) ? 0 : length - (comma + 1 - line);
+    char value[64];
+    if (comma != NULL && value_length > 0 && value_length < sizeof(value)) {
+        memcpy(value, comma + 1, value_length);
+        value[value_length] = '\0';
+        char *end;
+        double d = strtod(value, &end);
+        while (*end == ' ' || *end == '\t' || *end == '\r') end++;
+        if (end != value && *end == '\0') {
+            strtol(value, &end, 10);
+            while (*end == ' ' || *end == '\t' || *end == '\r') end++;
+            visit(line, comma - line, d, *end == '\0', context);
+            return;
+        }
+    }
+    if (!warned) {
+        fprintf(stderr, "predict: skipping non-numeric line \"%.*s\"\n", (int)length, line);
+        warned = true;
+    }
+}
+
+void predict_buffer_visit(const predict_buffer *buffer, predict_visitor visit, void *context) {
+    pthread_mutex_lock(&names_mutex);
+    int count = num_records(buffer);
+    for (int r=0; r<count; r++) {
+        const predict_record *record = record_at(buffer, r);
+        switch (record->type) {
+            case PREDICT_DOUBLE:
+                visit(names[record->name], strlen(names[record->name]), record->value.d, false, context);
+                break;
+            case PREDICT_INT:
+                visit(names[record->name], strlen(names[record->name]), record->value.i, true, context);
+                break;
+            case PREDICT_TEXT: {
+                const char *text = utstring_body(buffer->text) + record->value.text.offset;
+                const char *end = text + record->value.text.length;
+                const char *newline;
+                while (text < end && (newline = memchr(text, '\n', end - text)) != NULL) {
+                    visit_line(text, newline - text, visit, context);
+                    text = newline + 1;
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&names_mutex);
+}
+
+
+typedef struct {
+    UT_string *out;
+    bool weighted;
+    double log_weight;
+    long id;
+} encoding;
+
+static void encode_value(const char *name, size_t name_length, double value, bool is_int, void *context) {
+    encoding *encode = context;
+    sample_file_add_row(encode->out, name, name_length, value, is_int, encode->weighted, encode->log_weight, encode->id);
+}
+
+void predict_buffer_encode(const predict_buffer *buffer, UT_string *out) {
+    encoding encode = { out, false, 0, -1 };
+    predict_buffer_visit(buffer, encode_value, &encode);
+}
+
+void predict_buffer_encode_weighted(const predict_buffer *buffer, UT_string *out, double log_weight, long id) {
+    encoding encode = { out, true, log_weight, id };
+    predict_buffer_visit(buffer, encode_value, &encode);
+}
@@ -0,0 +1,90 @@
+#ifndef __PREDICT_BUFFER__
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utstring.h"
+
+/**
+ *
+ * Per-particle buffer of predicts, formatted lazily.
+ *
+ * predict_value / predict_double / predict_int append a compact binary record
+ * (interned name id, type tag, value) rather than printing text; only the
+ * particles which survive to the end of the program get formatted, when their
+ * output is written. predict(format, ...) is still supported: its text is
+ * formatted immediately and kept, in order, between the typed records.
+ *
+ * Names are interned in a process-wide table, which forked particles inherit,
+ * so a buffer can always be formatted by the process (or, under coro, any
+ * thread) holding it.
+ *
+ */
+
+typedef enum {
+    PREDICT_TEXT,       // value.text: byte range in the buffer's text
+    PREDICT_DOUBLE,
+    PREDICT_INT
+} predict_type;
+
+typedef struct {
+    int name;
+    int type;
+    union {
+        double d;
+        long i;
+        struct { int offset, length; } text;
+    } value;
+} predict_record;
+
+typedef struct {
+    UT_string *records;     // predict_record array
+    UT_string *text;        // output of predict(format, ...)
+} predict_buffer;
+
+
+predict_buffer *predict_buffer_new();
+void predict_buffer_free(predict_buffer *buffer);
+void predict_buffer_clear(predict_buffer *buffer);
+
+/**
+ * Replace the contents of `dst` with a copy of `src`
+ *
+ */
+void predict_buffer_copy(predict_buffer *dst, const predict_buffer *src);
+
+/**
+ * Append a record
+ *
+ */
+void predict_buffer_printf_va(predict_buffer *buffer, const char *format, va_list args);
+void predict_buffer_printf(predict_buffer *buffer, const char *format, ...);
+void predict_buffer_add_double(predict_buffer *buffer, const char *name, double value);
+void predict_buffer_add_int(predict_buffer *buffer, const char *name, long value);
+
+/**
+ * Format the buffer as `name,value` lines, appended to `out`; the weighted
+ * version appends `,log_weight,id` to every line
+ *
+ */
+void predict_buffer_format(const predict_buffer *buffer, UT_string *out);
+void predict_buffer_format_weighted(const predict_buffer *buffer, UT_string *out, double log_weight, long id);
+
+/**
+ * Call `visit` for each predicted value, in order: typed records directly,
+ * and text parsed back into `name,value` pairs (non-numeric lines are skipped)
+ *
+ */
+typedef void (*predict_visitor)(const char *name, size_t name_length, double value, bool is_int, void *context);
+void predict_buffer_visit(const predict_buffer *buffer, predict_visitor visit, void *context);
+
+/**
+ * Format the buffer as binary rows for the sample file (see sample-file.h)
+ *
+ */
+void predict_buffer_encode(const predict_buffer *buffer, UT_string *out);
+void predict_buffer_encode_weighted(const predict_buffer *buffer, UT_string *out, double log_weight, long id);
+
+#define __PREDICT_BUFFER__
+#endif
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 
 #include "erp.h"
@@ -62,16 +63,37 @@ void predict_double(const char *name, const double value);
 void predict_int(const char *name, const int value);
 
 
+/**
+ *
+ * Optional declaration of a program's mutable state, for engines which clone
+ * particles by copying memory rather than by fork() (currently "coro").
+ *
+ * "particle_state" registers a region (typically a global or static variable)
+ * which holds per-particle state; call it from main() before the first observe.
+ * "particle_alloc" and friends allocate heap memory which belongs to the
+ * current particle, and is duplicated along with it.
+ *
+ * Under fork-based engines, registration is a no-op and particle_alloc is
+ * malloc, so programs which do not opt in are unaffected.
+ *
+ */
+void particle_state(void *ptr, size_t bytes);
+void *particle_alloc(size_t bytes);
+void *particle_realloc(void *ptr, size_t bytes);
+void particle_free(void *ptr);
+
+
 /**
  *
  * The "main" method, for kicking off inference.
  * Don't call this directly; it will be used as an alternate program entry point.
+ * Once inference is done, it reports the run's resource usage (see run-stats.h).
  *
  */
 int program_execution_wrapper(int argc, char **argv);
 
 int __program(int argc, char **argv);
-#define main main(int argc, char **argv) { clock_t start, end; start = clock(); int re = program_execution_wrapper(argc, argv); end = clock(); printf("%lu", end-start); return re;} int __program
+#define main main(int argc, char **argv) { return program_execution_wrapper(argc, argv); } int __program
 
 #define __PROBABILISTIC__
 #endif
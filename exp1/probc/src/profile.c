@@ -0,0 +1,161 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "engine-shared.h"
+#include "profile.h"
+
+
+bool profile_enabled = false;
+
+static const char *profile_path = NULL;
+static const char *program = "";
+static uint64_t start_ns = 0;
+static pid_t root_pid = -1;
+static profile_table *table = NULL;
+
+static const char *phase_names[PROFILE_NUM_PHASES] = {
+    "user", "fork", "barrier", "resample", "reap", "flush"
+};
+
+// Process-local: buffered durations (phase in the top bits), and when the
+// program last resumed (0 while it is paused)
+#define PHASE_SHIFT 60
+static uint64_t buffer[PROFILE_BUFFER];
+static int buffered = 0;
+static uint64_t user_since = 0;
+
+
+static inline int bucket_index(uint64_t ns) {
+    if (ns < PROFILE_SUB_BUCKETS) return ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exponent - 3)) & (PROFILE_SUB_BUCKETS - 1);
+    return (exponent - 2)*PROFILE_SUB_BUCKETS + sub;
+}
+
+// Middle of the range of durations which fall in bucket `index`
+static inline uint64_t bucket_value(int index) {
+    if (index < PROFILE_SUB_BUCKETS) return index;
+    int exponent = index/PROFILE_SUB_BUCKETS + 2;
+    uint64_t width = 1ULL << (exponent - 3);
+    return (PROFILE_SUB_BUCKETS + index%PROFILE_SUB_BUCKETS)*width + width/2;
+}
+
+
+/**
+ * Fork hook: the parent's durations are its own to report
+ *
+ */
+static void after_fork_child() {
+    buffered = 0;
+    user_since = 0;
+}
+
+void profile_start(const char *program_path, const char *option) {
+    root_pid = getpid();
+    const char *slash = strrchr(program_path, '/');
+    program = (slash != NULL) ? slash + 1 : program_path;
+    profile_enabled = (option != NULL);
+    if (option != NULL && option[0] != '\0') profile_path = option;
+    start_ns = profile_clock();
+}
+
+void profile_init() {
+    if (!profile_enabled) return;
+    table = (profile_table *)shared_memory_alloc(sizeof(profile_table));
+    memset(table, 0, sizeof(profile_table));
+    register_fork_hook(after_fork_child);
+}
+
+
+void profile_flush() {
+    if (table == NULL) return;
+    for (int i=0; i<buffered; i++) {
+        profile_histogram *h = &table->phases[buffer[i] >> PHASE_SHIFT];
+        uint64_t ns = buffer[i] & ((1ULL << PHASE_SHIFT) - 1);
+        __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->total_ns, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+        while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    buffered = 0;
+}
+
+void profile_record(profile_phase phase, uint64_t ns) {
+    if (table == NULL) return;
+    if (buffered == PROFILE_BUFFER) profile_flush();
+    buffer[buffered++] = ((uint64_t)phase << PHASE_SHIFT) | (ns & ((1ULL << PHASE_SHIFT) - 1));
+}
+
+
+void profile_user_resume() {
+    user_since = profile_clock();
+}
+
+void profile_user_pause() {
+    if (user_since == 0) return;
+    profile_end(PROFILE_USER, user_since);
+    user_since = 0;
+}
+
+
+/**
+ * Smallest duration (bucket midpoint, at most the maximum) which at least a
+ * fraction q of the segments do not exceed
+ *
+ */
+static double percentile_us(profile_histogram *h, double q) {
+    long rank = (long)ceil(q*h->count), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i=0; i<PROFILE_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t ns = bucket_value(i);
+            return ((ns < h->max_ns) ? ns : h->max_ns) / 1e3;
+        }
+    }
+    return h->max_ns / 1e3;
+}
+
+void profile_report() {
+    if (table == NULL || getpid() != root_pid) return;
+    profile_flush();
+    double wall = (profile_clock() - start_ns) / 1e9;
+
+    FILE *stream = stderr;
+    if (profile_path != NULL) {
+        stream = fopen(profile_path, "w");
+        if (stream == NULL) {
+            perror(profile_path);
+            stream = stderr;
+        }
+    }
+    // Time spent working, rather than waiting for other particles
+    uint64_t busy_ns = 0;
+    for (int p=0; p<PROFILE_NUM_PHASES; p++) {
+        if (p != PROFILE_BARRIER) busy_ns += table->phases[p].total_ns;
+    }
+    uint64_t fork_ns = table->phases[PROFILE_FORK].total_ns;
+    fprintf(stream, "{\"program\":\"%s\",\"wall_s\":%.6f,\"fork_ratio\":%.6f,\"phases\":{",
+            program, wall, (busy_ns > 0) ? (double)fork_ns / busy_ns : 0.0);
+    for (int p=0; p<PROFILE_NUM_PHASES; p++) {
+        profile_histogram *h = &table->phases[p];
+        fprintf(stream, "%s\"%s\":{\"count\":%ld,\"total_s\":%.6f,\"mean_us\":%.3f,"
+                        "\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}",
+                (p > 0) ? "," : "", phase_names[p], h->count, h->total_ns / 1e9,
+                (h->count > 0) ? h->total_ns / 1e3 / h->count : 0.0,
+                (h->count > 0) ? percentile_us(h, 0.5) : 0.0,
+                (h->count > 0) ? percentile_us(h, 0.99) : 0.0,
+                h->max_ns / 1e3);
+    }
+    fprintf(stream, "}}\n");
+    if (stream != stderr) {
+        fclose(stream);
+    } else {
+        fflush(stream);
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef __PROFILE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ *
+ * Per-phase timers for the engines' hot paths (--profile[=path]).
+ *
+ * Each process times the phases below with the monotonic clock, and keeps
+ * the durations in a small process-local buffer. When the buffer fills, and
+ * when a particle exits, they are folded into log-scale histograms in shared
+ * memory (a fork()ed child starts with an empty buffer). Once inference is
+ * done, the root writes one JSON line with, per phase, the number of timed
+ * segments, their total, mean, p50, p99 and maximum (percentiles to within
+ * an eighth of a power of two):
+ *
+ *   {"program":"hmm","wall_s":1.23,"fork_ratio":0.04,
+ *    "phases":{"user":{"count":...,"total_s":...,"mean_us":...,"p50_us":...,
+ *                      "p99_us":...,"max_us":...},"fork":{...},...}}
+ *
+ * to stderr, or, with --profile=path, to that file. Totals are summed over
+ * all processes; fork_ratio is the share of fork() in the time they spent
+ * working, i.e. in every phase but barrier waits.
+ *
+ * Without --profile, every timer is a single branch on profile_enabled.
+ *
+ */
+
+typedef enum {
+    PROFILE_USER,           // the program itself, between synchronizing observes
+    PROFILE_FORK,           // fork(), as seen by the parent
+    PROFILE_BARRIER,        // waiting for the other particles at an observe
+    PROFILE_RESAMPLE,       // computing offspring counts and slots
+    PROFILE_REAP,           // collecting terminated children
+    PROFILE_FLUSH,          // handing output to flush_output
+    PROFILE_NUM_PHASES
+} profile_phase;
+
+// Log-linear histogram: 8 buckets per power of two
+#define PROFILE_SUB_BUCKETS 8
+#define PROFILE_BUCKETS 512
+
+// Durations buffered per process before they are folded into shared memory
+#define PROFILE_BUFFER 512
+
+typedef struct {
+    long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    long buckets[PROFILE_BUCKETS];
+} profile_histogram;
+
+typedef struct {
+    profile_histogram phases[PROFILE_NUM_PHASES];
+} profile_table;
+
+
+extern bool profile_enabled;
+
+/**
+ * Current time in nanoseconds (0 while profiling is off)
+ *
+ */
+static inline uint64_t profile_clock() {
+    if (!profile_enabled) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+void profile_record(profile_phase phase, uint64_t ns);
+
+/**
+ * Record a segment of `phase` which started at `since` (from profile_clock)
+ *
+ */
+static inline void profile_end(profile_phase phase, uint64_t since) {
+    if (profile_enabled) profile_record(phase, profile_clock() - since);
+}
+
+/**
+ * Called first thing, with argv[0] and the value of --profile: NULL if it is
+ * not given, "" for plain --profile (report on stderr), or --profile=path.
+ * Starts the wall clock.
+ *
+ */
+void profile_start(const char *program_path, const char *option);
+
+/**
+ * Called by the root before it forks any particles: allocate the histograms
+ *
+ */
+void profile_init();
+
+/**
+ * Mark where a particle starts or resumes running the program (after forking,
+ * and on leaving weight_trace), and where it stops (on entering weight_trace
+ * at a synchronizing observe, and at the end of the program)
+ *
+ */
+void profile_user_resume();
+void profile_user_pause();
+
+/**
+ * Fold this process's buffered durations into shared memory; called by
+ * particles just before they exit
+ *
+ */
+void profile_flush();
+
+/**
+ * Called by the root once inference is done: write the report
+ *
+ */
+void profile_report();
+
+#define __PROFILE__
+#endif
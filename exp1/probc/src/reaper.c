@@ -0,0 +1,204 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // prctl, signalfd
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#endif
+
+#include "uthash.h"
+#include "engine-shared.h"
+#include "reaper.h"
+#include "profile.h"
+
+
+typedef struct {
+    pid_t pid;
+    UT_hash_handle hh;
+} tracked_child;
+
+// Shared by every process forked after reaper_init
+static reaper_stats *stats = NULL;
+static bool active = false;
+
+// Root only: its own children, and the SIGCHLD signalfd (-1 elsewhere)
+static tracked_child *children = NULL;
+static int signal_fd = -1;
+static sigset_t saved_mask;
+
+
+static inline void count_spawned() {
+    long unreaped = __atomic_add_fetch(&stats->spawned, 1, __ATOMIC_RELAXED)
+                  - __atomic_load_n(&stats->reaped, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&stats->peak_unreaped, __ATOMIC_RELAXED);
+    while (unreaped > peak && !__atomic_compare_exchange_n(&stats->peak_unreaped, &peak, unreaped,
+                                                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Fork hook: count the new process; in a direct child of the root, also drop
+ * the root's signalfd and SIGCHLD mask
+ *
+ */
+static void after_fork_child() {
+    count_spawned();
+    if (signal_fd >= 0) {
+        close(signal_fd);
+        signal_fd = -1;
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        HASH_CLEAR(hh, children);
+    }
+}
+
+
+void reaper_init() {
+    stats = (reaper_stats *)shared_memory_alloc(sizeof(reaper_stats));
+    *stats = (reaper_stats) { 0 };
+    register_fork_hook(after_fork_child);
+
+#ifdef __linux__
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+        perror("prctl(PR_SET_CHILD_SUBREAPER)");
+        return;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        prctl(PR_SET_CHILD_SUBREAPER, 0);
+        return;
+    }
+    active = true;
+#endif
+}
+
+bool reaper_is_active() {
+    return active;
+}
+
+void reaper_track(pid_t pid) {
+    tracked_child *child = malloc(sizeof(tracked_child));
+    child->pid = pid;
+    HASH_ADD_INT(children, pid, child);
+}
+
+
+/**
+ * Block until SIGCHLD is pending (without a signalfd, collect() blocks instead)
+ *
+ */
+static void wait_for_exit() {
+#ifdef __linux__
+    if (signal_fd < 0) return;
+    struct pollfd fd = { signal_fd, POLLIN, 0 };
+    while (poll(&fd, 1, -1) < 0 && errno == EINTR);
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+#endif
+}
+
+/**
+ * Reap every terminated child (or block for one, without a signalfd).
+ * Returns how many of them the root had forked itself; *none_left is set
+ * once there are no children at all.
+ *
+ */
+static int collect(int *const total_children, bool *none_left) {
+    uint64_t start = profile_clock();
+    int own = 0, zombies = 0;
+    *none_left = false;
+    while (true) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, (signal_fd >= 0) ? WNOHANG : 0);
+        if (pid == 0) break;
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            *none_left = true;
+            break;
+        }
+        if (status != 0) {
+            debug_print(4,"[ERROR] child process %d of %d exited with status %d\n", pid, getpid(), status);
+        }
+        zombies++;
+        tracked_child *child;
+        HASH_FIND_INT(children, &pid, child);
+        if (child != NULL) {
+            HASH_DEL(children, child);
+            free(child);
+            own++;
+            (*total_children)--;
+        } else {
+            stats->adopted++;
+        }
+        if (signal_fd < 0) break;
+    }
+    __atomic_add_fetch(&stats->reaped, zombies, __ATOMIC_RELAXED);
+    stats->collections++;
+    if (zombies > stats->peak_zombies) stats->peak_zombies = zombies;
+    profile_end(PROFILE_REAP, start);
+    return own;
+}
+
+void reaper_wait_children(int count, int *const total_children) {
+    debug_print(4,"Root %d waiting for %d of its %d children\n", getpid(), count, *total_children);
+    bool none_left = false;
+    while (count > 0) {
+        count -= collect(total_children, &none_left);
+        if (count > 0 && none_left) {
+            fprintf(stderr, "reaper: no children left, still expecting %d\n", count);
+            return;
+        }
+        if (count > 0) wait_for_exit();
+    }
+}
+
+void reaper_wait_all(int *const total_children) {
+    bool none_left = false;
+    collect(total_children, &none_left);
+    while (!none_left) {
+        wait_for_exit();
+        collect(total_children, &none_left);
+    }
+    assert(*total_children == 0);
+}
+
+
+void reaper_release_children(int *const total_children) {
+    if (active) {
+        // Re-parented to the root once we exit
+        *total_children = 0;
+    } else {
+        uint64_t start = profile_clock();
+        cleanup_children(*total_children, total_children);
+        profile_end(PROFILE_REAP, start);
+    }
+}
+
+
+void reaper_note_reaped(int count) {
+    if (stats != NULL) __atomic_add_fetch(&stats->reaped, count, __ATOMIC_RELAXED);
+}
+
+
+void reaper_print_stats(FILE *stream) {
+    if (stats == NULL) return;
+    fprintf(stream, "reaper: %s, %ld processes forked, %ld reaped, at most %ld alive or zombie at once\n",
+            active ? "subreaper" : "parents reap", stats->spawned, stats->reaped, stats->peak_unreaped);
+    fprintf(stream, "reaper: %ld orphans collected centrally, over %ld wakeups (at most %ld zombies waiting)\n",
+            stats->adopted, stats->collections, stats->peak_zombies);
+}
@@ -0,0 +1,91 @@
+#ifndef __REAPER__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ *
+ * Central reaping of particle processes.
+ *
+ * Without it, a particle which is done (it drew no offspring, or reached the
+ * end of the program) has to stay alive, blocked in wait(), until all of its
+ * own descendants have finished, so that they are not orphaned. Long runs
+ * build up chains of such processes, each holding on to its memory.
+ *
+ * With a reaper, the root process marks itself a child subreaper (Linux,
+ * PR_SET_CHILD_SUBREAPER): orphaned descendants are re-parented to it rather
+ * than to init. Particles then just exit once their job is done, and the root
+ * collects everything, woken by SIGCHLD through a signalfd.
+ *
+ * The root tells its own children (reaper_track) apart from adopted ones, so
+ * an engine can still wait for "k of the particles I started".
+ * Elsewhere (or if the kernel refuses), particles wait for their children as
+ * before.
+ *
+ */
+
+typedef struct {
+    long spawned;           // processes forked since reaper_init
+    long reaped;            // ... and reaped, by their parent or by the root
+    long peak_unreaped;     // most processes alive or zombie at once
+    long adopted;           // orphans reaped by the root
+    long collections;       // times the root woke up to reap ...
+    long peak_zombies;      // ... and the most zombies it found waiting at once
+} reaper_stats;
+
+
+/**
+ * Called by the root before it forks any particles
+ *
+ */
+void reaper_init();
+
+/**
+ * Whether orphaned particles are collected by the root (inherited across fork)
+ *
+ */
+bool reaper_is_active();
+
+/**
+ * Called by the root after forking a particle directly
+ *
+ */
+void reaper_track(pid_t pid);
+
+/**
+ * Called by the root: reap until `count` of its own (tracked) children have
+ * terminated, collecting any adopted orphans on the way. Each one decrements
+ * *total_children.
+ *
+ */
+void reaper_wait_children(int count, int *const total_children);
+
+/**
+ * Called by the root: reap until there are no descendants left at all
+ *
+ */
+void reaper_wait_all(int *const total_children);
+
+/**
+ * Called by a particle which is about to exit: with an active reaper, leave
+ * the children to it; otherwise wait for them (cleanup_children).
+ *
+ */
+void reaper_release_children(int *const total_children);
+
+/**
+ * Bookkeeping for processes reaped outside of the above (no-op before
+ * reaper_init)
+ *
+ */
+void reaper_note_reaped(int count);
+
+/**
+ * Print process counts
+ *
+ */
+void reaper_print_stats(FILE *stream);
+
+#define __REAPER__
+#endif
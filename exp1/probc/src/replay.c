@@ -0,0 +1,556 @@
+#include <assert.h>
+#include <fcntl.h>    /* For O_* constants */
+#include <getopt.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "utstring.h"
+#include "probabilistic.h"
+#include "engine-shared.h"
+#include "resample.h"
+#include "sample-file.h"
+#include "aggregate.h"
+
+/**
+ *
+ * Seed-and-replay SMC.
+ *
+ * Particles are not processes. Each particle is a log of RNG seeds, one per
+ * segment of program execution between synchronizing observes. To advance the
+ * population to observe t, a fixed pool of worker processes re-executes the
+ * program for every particle, reseeding from its log at each observe, until it
+ * reaches observe t, where execution is abandoned (via longjmp) and only the
+ * log weight of the newest segment is kept.
+ *
+ * Resampling copies seed logs rather than address spaces, so memory per particle
+ * is O(#observes) and the population size is not limited by the process table.
+ * The price is re-execution: O(#observes^2) program steps per particle overall.
+ *
+ * Programs must (re)initialize any state they use inside main(), as every
+ * particle runs main() from the start in a long-lived worker. Memory allocated
+ * by the program before the observe at which a replay stops is not reclaimed.
+ *
+ */
+
+// Set defaults for number of particles
+static int NUM_PARTICLES = 100;
+
+// Number of worker processes (0 = one per online CPU)
+static int NUM_WORKERS = 0;
+
+// We can print out an estimate of the marginal likelihood
+static bool ESTIMATE_MARGINAL_LIKELIHOOD = false;
+
+// Tau \in [0, 1] determines the frequency of resampling
+static double TAU = 0.5;
+
+// Possibly default initial seed
+static long INITIAL_SEED = -1;
+
+// Flag to mark whether or not to record walltime
+static bool TIME_EXECUTION = false;
+
+// Flag to mark whether to output weighted or unweighted particle set
+static bool WEIGHTED_OUTPUT = false;
+
+// Scheme used to sample offspring counts
+static resampler_type RESAMPLER = RESAMPLE_MULTINOMIAL;
+
+// Number of synchronizing observes (including the final "dummy" one), from the prerun
+static int NUM_OBSERVES = 0;
+
+
+/**
+ * Struct containing global (shared) state variables
+ *
+ */
+typedef struct {
+
+    // Per-particle seed logs: seeds[i*(NUM_OBSERVES+1) + s] seeds segment s of particle i.
+    // Double buffered, since resampling builds the next generation from the current one.
+    unsigned long *seeds;
+    unsigned long *next_seeds;
+
+    // Hold per-particle log-weights and number of offspring, for resampling
+    double *log_weights;
+    int *n_offspring;
+
+    // Work handed out to workers: replay every particle up to observe `target`
+    int target;
+    bool final_pass;
+    bool quit;
+    int next_particle;
+
+    // Generation counter: bumped (and futex-woken) by the main process to start a pass
+    padded_counter generation;
+
+    // Latch: all workers have finished the current pass
+    shared_latch pass_complete;
+
+    // Set if some particle reached the end of the program early (or late)
+    bool observe_count_mismatch;
+
+    // Mutex: stdout lock
+    pthread_mutex_t stdout_mutex;
+
+    // Marginal likelihood estimate
+    double log_marginal_likelihood;
+
+} shared_globals;
+
+/**
+ * Struct containing local state of the particle currently being replayed
+ *
+ */
+typedef struct {
+    int particle;
+    int current_observe;
+    int target;
+    double segment_weight;
+    bool is_prerun;
+    bool keep_predicts;
+    jmp_buf stop;
+    predict_buffer *predict;
+    UT_string *output;
+} process_locals;
+
+
+static process_locals *locals;
+static shared_globals *globals;
+
+
+static inline unsigned long *seed_log(unsigned long *seeds, int particle) {
+    return &seeds[particle*(NUM_OBSERVES+1)];
+}
+
+
+/**
+ * Sample number of offspring, given particle weights,
+ * using the resampling scheme selected on the command line
+ *
+ */
+void resample() {
+
+    enter_run_rng_stream();
+    resample_offspring(RESAMPLER, globals->log_weights, NUM_PARTICLES, NUM_PARTICLES, globals->n_offspring);
+    leave_run_rng_stream();
+
+#if DEBUG_LEVEL >= 2
+    // print all the offspring counts (debug)
+    fprintf(stderr, "[resampling] observe #%d (%s)\n", globals->target, resampler_name(RESAMPLER));
+    fprintf(stderr, "LOG WEIGHT: <");
+    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
+    fprintf(stderr, ">\n");
+    fprintf(stderr, "N_OFFSPRING: <");
+    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
+    fprintf(stderr, ">\n");
+#endif
+}
+
+
+/**
+ * Special printf function which writes to the output file.
+ * Only the final pass keeps predicts; earlier replays would just discard them.
+ *
+ */
+void predict(const char *format, ...) {
+    if (!locals->keep_predicts) return;
+    va_list args;
+    va_start(args, format);
+    predict_buffer_printf_va(locals->predict, format, args);
+    va_end(args);
+}
+
+/**
+ * Special printf function "predict", for named doubles
+ *
+ */
+void predict_value(const char *name, const double value) {
+    if (!locals->keep_predicts) return;
+    predict_buffer_add_double(locals->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    if (!locals->keep_predicts) return;
+    predict_buffer_add_int(locals->predict, name, value);
+}
+
+void weight_trace(const double ln_p, const bool synchronize) {
+
+    if (locals->is_prerun) {
+        if (synchronize) NUM_OBSERVES++;
+        return;
+    }
+
+    // Only the newest segment contributes to the particle's weight
+    if (locals->current_observe == locals->target - 1) {
+        locals->segment_weight += ln_p;
+    }
+    if (!synchronize) return;
+
+    locals->current_observe++;
+    if (locals->current_observe == locals->target) {
+        // Reached the frontier: abandon this execution
+        longjmp(locals->stop, 1);
+    }
+    if (locals->current_observe > NUM_OBSERVES) {
+        globals->observe_count_mismatch = true;
+        longjmp(locals->stop, 1);
+    }
+
+    // Continue along the logged trace
+    set_rng_seed(seed_log(globals->seeds, locals->particle)[locals->current_observe]);
+}
+
+
+/**
+ * Re-execute the program for one particle, up to observe `target`
+ * (or to completion, if target <= 0). Returns the newest segment's log weight.
+ *
+ */
+static double replay_particle(int (*f)(int, char**), int argc, char **argv, int particle, int target) {
+    locals->particle = particle;
+    locals->current_observe = 0;
+    locals->target = (target > 0) ? target : NUM_OBSERVES + 1;
+    locals->segment_weight = 0;
+    predict_buffer_clear(locals->predict);
+    set_rng_seed(seed_log(globals->seeds, particle)[0]);
+
+    if (setjmp(locals->stop) == 0) {
+        f(argc, argv);
+        if (!WEIGHTED_OUTPUT) {
+            observe(0); // "dummy" observe to mark end of program.
+        }
+        if (target > 0) {
+            // Ran off the end of the program before reaching the target observe
+            globals->observe_count_mismatch = true;
+        }
+    }
+    return locals->segment_weight;
+}
+
+
+/**
+ * A worker writes out many particles, so it batches their predicts and
+ * writes them out in large chunks (rather than one flush_output each)
+ *
+ */
+#define OUTPUT_BATCH_BYTES (1 << 16)
+
+static void write_output(bool force) {
+    if (utstring_len(locals->output) == 0) return;
+    if (!force && utstring_len(locals->output) < OUTPUT_BATCH_BYTES) return;
+    flush_output(&globals->stdout_mutex, locals->output);
+    utstring_clear(locals->output);
+}
+
+/**
+ * Final pass: run a particle to completion and queue its predicts for output
+ *
+ */
+static void output_particle(int (*f)(int, char**), int argc, char **argv, int particle) {
+    double tail_weight = replay_particle(f, argc, argv, particle, 0);
+
+    if (!WEIGHTED_OUTPUT) {
+        format_predicts(locals->predict, locals->output);
+    } else {
+        double log_weight = globals->log_weights[particle] + tail_weight;
+        format_weighted_predicts(locals->predict, locals->output, log_weight, particle);
+        globals->log_weights[particle] = log_weight;
+    }
+}
+
+
+/**
+ * Worker process: wait for a pass to start, then claim particles until none are left
+ *
+ */
+static void worker_loop(int (*f)(int, char**), int argc, char **argv) {
+    int generation = 0;
+    while (true) {
+        while (__atomic_load_n(&globals->generation.value, __ATOMIC_ACQUIRE) == generation) {
+            shared_futex_wait(&globals->generation.value, generation);
+        }
+        generation = globals->generation.value;
+        if (globals->quit) break;
+        locals->keep_predicts = globals->final_pass;
+
+        int particle;
+        while ((particle = __atomic_fetch_add(&globals->next_particle, 1, __ATOMIC_RELAXED)) < NUM_PARTICLES) {
+            if (globals->final_pass) {
+                output_particle(f, argc, argv, particle);
+                write_output(false);
+            } else {
+                globals->log_weights[particle] += replay_particle(f, argc, argv, particle, globals->target);
+            }
+        }
+        write_output(true);
+        shared_latch_count_down(&globals->pass_complete);
+    }
+    predict_buffer_free(locals->predict);
+    utstring_free(locals->output);
+    _exit(0);
+}
+
+
+/**
+ * Main process: hand out one pass over the population and wait for it to finish
+ *
+ */
+static void run_pass(int num_workers, int target, bool final_pass) {
+    globals->target = target;
+    globals->final_pass = final_pass;
+    globals->next_particle = 0;
+    shared_latch_set(&globals->pass_complete, num_workers);
+    __atomic_add_fetch(&globals->generation.value, 1, __ATOMIC_RELEASE);
+    shared_futex_wake_all(&globals->generation.value);
+    shared_latch_wait(&globals->pass_complete);
+}
+
+
+/**
+ * Main process, after the population has reached an observe: resample if the ESS
+ * is low, then extend every particle's seed log with a fresh seed for the next segment.
+ *
+ */
+static void resample_and_extend(int observe_index) {
+    double ESS = 0;
+    double normalization = log_sum_exp(globals->log_weights, NUM_PARTICLES);
+    for (int i=0; i<NUM_PARTICLES; i++) {
+        ESS += pow(exp(globals->log_weights[i] - normalization), 2);
+        globals->n_offspring[i] = 1;
+    }
+    ESS = 1 / ESS;
+    debug_print(2,"ESS at observe %d: %f\n", observe_index, ESS);
+
+    bool resampled = (ESS < TAU*NUM_PARTICLES);
+    if (resampled) {
+        globals->log_marginal_likelihood += normalization - log(NUM_PARTICLES);
+        resample();
+    }
+
+    // Copy each ancestor's seed log to its offspring; this is all a resampled particle costs
+    int next = 0;
+    for (int i=0; i<NUM_PARTICLES; i++) {
+        for (int k=0; k<globals->n_offspring[i]; k++) {
+            memcpy(seed_log(globals->next_seeds, next), seed_log(globals->seeds, i), observe_index*sizeof(unsigned long));
+            seed_log(globals->next_seeds, next)[observe_index] = gen_new_rng_seed();
+            if (resampled) globals->log_weights[next] = 0;
+            next++;
+        }
+    }
+    assert(next == NUM_PARTICLES);
+
+    unsigned long *tmp = globals->seeds;
+    globals->seeds = globals->next_seeds;
+    globals->next_seeds = tmp;
+}
+
+
+/**
+ *
+ * Initialize global state
+ *
+ */
+void init_globals() {
+
+    // Allocate shared memory
+    globals = (shared_globals *)shared_memory_alloc(sizeof(shared_globals));
+    globals->seeds = (unsigned long *)shared_memory_alloc(NUM_PARTICLES*(NUM_OBSERVES+1)*sizeof(unsigned long));
+    globals->next_seeds = (unsigned long *)shared_memory_alloc(NUM_PARTICLES*(NUM_OBSERVES+1)*sizeof(unsigned long));
+    globals->log_weights = (double *)shared_memory_alloc(NUM_PARTICLES*sizeof(double));
+    globals->n_offspring = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
+
+    // Initialize process locks
+    shared_latch_set(&globals->pass_complete, 0);
+    init_shared_mutex(&globals->stdout_mutex, NULL);
+
+    // Initialize globals
+    globals->generation.value = 0;
+    globals->quit = false;
+    globals->observe_count_mismatch = false;
+    globals->log_marginal_likelihood = 0.0;
+}
+
+
+/**
+ *
+ * initialize engine and start inference over a supplied program
+ *
+ */
+int infer(int (*f)(int, char**), int argc, char **argv) {
+
+    pid_t main_pid = getpid();
+    debug_print(1, "Main process pid: %d\n", main_pid);
+
+    // Initialize random number generators
+    erp_rng_init(INITIAL_SEED);
+
+    // Create initial state
+    process_locals _locals;
+    locals = &_locals;
+    locals->keep_predicts = false;
+    locals->predict = predict_buffer_new();
+    utstring_new(locals->output);
+
+    // Prerun, in this process: count the number of synchronizing observes
+    locals->is_prerun = true;
+    f(argc, argv);
+    if (!WEIGHTED_OUTPUT) observe(0);
+    locals->is_prerun = false;
+    debug_print(1, "Number of observes: %d\n", NUM_OBSERVES);
+
+    // Create shared globals
+    init_globals();
+
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
+    // Get memory required for struct
+    long mem_size = sizeof(shared_globals) + NUM_PARTICLES*(2*(NUM_OBSERVES+1)*sizeof(unsigned long) + sizeof(double) + sizeof(int));
+    debug_print(1, "Shared memory size: %ld bytes\n", mem_size);
+
+    // Initial seed logs: every particle starts from its own seed
+    for (int i=0; i<NUM_PARTICLES; i++) {
+        seed_log(globals->seeds, i)[0] = gen_new_rng_seed();
+        globals->log_weights[i] = 0;
+    }
+
+    // Start timer
+    struct timeval start_time;
+    if (TIME_EXECUTION) {
+        gettimeofday(&start_time, NULL);
+        debug_print(1, "Starting timer at %ld.%06d\n", start_time.tv_sec, (int)start_time.tv_usec);
+    }
+
+    // Start the worker pool; these are the only processes created
+    int num_workers = (NUM_WORKERS > 0) ? NUM_WORKERS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > NUM_PARTICLES) num_workers = NUM_PARTICLES;
+    int live_workers = 0;
+    for (int w=0; w<num_workers; w++) {
+        pid_t child_pid = fork();
+        if (child_pid == 0) {
+            worker_loop(f, argc, argv);
+        } else if (child_pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        live_workers++;
+    }
+
+    // Run SMC once: advance the population one observe at a time
+    for (int observe_index=1; observe_index<=NUM_OBSERVES; observe_index++) {
+        debug_print(2, "Replaying %d particles up to observe %d\n", NUM_PARTICLES, observe_index);
+        run_pass(num_workers, observe_index, false);
+        if (globals->observe_count_mismatch) {
+            fprintf(stderr, "replay: particles disagree on the number of synchronizing observes\n");
+            exit(1);
+        }
+        resample_and_extend(observe_index);
+    }
+
+    // Run every particle to completion, writing out predicts
+    run_pass(num_workers, 0, true);
+
+    // Shut down the worker pool
+    globals->quit = true;
+    __atomic_add_fetch(&globals->generation.value, 1, __ATOMIC_RELEASE);
+    shared_futex_wake_all(&globals->generation.value);
+    cleanup_children(live_workers, &live_workers);
+
+    // Rearrange the spooled output into the sample file
+    sample_file_close();
+    aggregate_print(stdout, 0);
+
+    // Print out timing info
+    if (TIME_EXECUTION) print_walltime(&globals->stdout_mutex, 1, &start_time);
+
+    // Print marginal likelihood estimate
+    if (ESTIMATE_MARGINAL_LIKELIHOOD) {
+        globals->log_marginal_likelihood += log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
+        pthread_mutex_lock(&globals->stdout_mutex);
+        fprintf(stdout, "log_marginal_likelihood,%0.8f,,%d\n", globals->log_marginal_likelihood, NUM_PARTICLES);
+        fflush(stdout);
+        pthread_mutex_unlock(&globals->stdout_mutex);
+    }
+
+    predict_buffer_free(locals->predict);
+    utstring_free(locals->output);
+    return 0;
+}
+
+
+void parse_args(int argc, char **argv) {
+
+    // Parse args
+    static struct option long_options[] = {
+        {"particles", required_argument, 0, 'p'},
+        {"workers", required_argument, 0, 'j'},
+        {"timeit", no_argument, 0, 't'},
+        {"weighted", no_argument, 0, 'w'},
+        {"evidence", no_argument, 0, 'e'},
+        {"rng_seed", required_argument, 0, 'r'},
+        {"resampler", required_argument, 0, 'R'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
+    };
+    int c, option_index;
+
+    while((c = getopt_long(argc, argv, "p:j:twer:R:o:O:A::", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'p':
+                NUM_PARTICLES = atoi(optarg);
+                break;
+            case 'j':
+                NUM_WORKERS = atoi(optarg);
+                break;
+            case 't':
+                TIME_EXECUTION = true;
+                break;
+            case 'w':
+                WEIGHTED_OUTPUT = true;
+                break;
+            case 'e':
+                ESTIMATE_MARGINAL_LIKELIHOOD = true;
+                break;
+            case 'r':
+                INITIAL_SEED = atol(optarg);
+                break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
+            case 'R':
+                if (!resampler_from_name(optarg, &RESAMPLER)) {
+                    fprintf(stderr, "Unknown resampler: %s (multinomial, stratified or systematic; residual is the same as systematic)\n", optarg);
+                    exit(1);
+                }
+                break;
+        }
+    }
+
+    debug_print(1, "Running with %d particles\n", NUM_PARTICLES);
+}
@@ -0,0 +1,292 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "erp.h"
+#include "resample.h"
+
+#define MAX_RESAMPLE_THREADS 64
+
+// Multithreaded path settings; num_threads < 0 means "one per online CPU"
+static int RESAMPLE_THREADS = -1;
+static int RESAMPLE_PARALLEL_MIN_COUNT = 65536;
+
+static const char *RESAMPLER_NAMES[] = { "multinomial", "stratified", "systematic", "residual" };
+
+
+bool resampler_from_name(const char *name, resampler_type *type) {
+    for (int i=0; i<(int)(sizeof(RESAMPLER_NAMES)/sizeof(RESAMPLER_NAMES[0])); i++) {
+        if (strcmp(name, RESAMPLER_NAMES[i]) == 0) {
+            *type = (resampler_type)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *resampler_name(resampler_type type) {
+    return RESAMPLER_NAMES[type];
+}
+
+void resample_set_threads(int num_threads, int min_count) {
+    RESAMPLE_THREADS = num_threads;
+    if (min_count > 0) RESAMPLE_PARALLEL_MIN_COUNT = min_count;
+}
+
+
+/**
+ * State shared by the per-chunk passes. Chunk t covers particles [begin[t], begin[t+1]).
+ *
+ */
+typedef struct {
+    resampler_type type;
+    const double *log_weights;
+    int count;
+    int num_draws;
+    int *n_offspring;
+
+    // Per-particle selection mass (normalized weight, or residual weight)
+    double *mass;
+
+    // Sorted draw positions, scaled to [0, total mass)
+    double *positions;
+    int num_positions;
+
+    int num_chunks;
+    int begin[MAX_RESAMPLE_THREADS+1];
+    double chunk_max[MAX_RESAMPLE_THREADS];
+    double chunk_mass[MAX_RESAMPLE_THREADS];
+    int chunk_fixed[MAX_RESAMPLE_THREADS];
+    double chunk_offset[MAX_RESAMPLE_THREADS+1];
+
+    double max_log_weight;
+    double total_weight;
+} resample_job;
+
+typedef struct {
+    resample_job *job;
+    int chunk;
+    void (*pass)(resample_job *, int);
+} resample_task;
+
+
+/**
+ * Pass 1: maximum log weight in the chunk (for a stable exp)
+ *
+ */
+static void pass_max(resample_job *job, int t) {
+    double m = -DBL_MAX;
+    for (int i=job->begin[t]; i<job->begin[t+1]; i++) {
+        if (job->log_weights[i] > m) m = job->log_weights[i];
+    }
+    job->chunk_max[t] = m;
+}
+
+/**
+ * Pass 2: unnormalized weights and their chunk sum
+ *
+ */
+static void pass_exp(resample_job *job, int t) {
+    double sum = 0;
+    const double shift = job->max_log_weight;
+    for (int i=job->begin[t]; i<job->begin[t+1]; i++) {
+        // If every weight is zero (log weight -inf), fall back to uniform mass
+        job->mass[i] = (shift <= -DBL_MAX) ? 1.0 : exp(job->log_weights[i] - shift);
+        sum += job->mass[i];
+    }
+    job->chunk_mass[t] = sum;
+}
+
+/**
+ * Pass 3 (residual only): deterministic copies, leaving the residual as selection mass
+ *
+ */
+static void pass_residual(resample_job *job, int t) {
+    double sum = 0;
+    int fixed = 0;
+    const double scale = job->num_draws / job->total_weight;
+    for (int i=job->begin[t]; i<job->begin[t+1]; i++) {
+        const double expected = scale * job->mass[i];
+        const int copies = (int)floor(expected);
+        job->n_offspring[i] = copies;
+        job->mass[i] = expected - copies;
+        fixed += copies;
+        sum += job->mass[i];
+    }
+    job->chunk_fixed[t] = fixed;
+    job->chunk_mass[t] = sum;
+}
+
+/**
+ * Pass 4: merge the sorted positions against the running CDF of this chunk
+ *
+ */
+static int lower_bound(const double *values, int n, double x) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (values[mid] < x) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void pass_merge(resample_job *job, int t) {
+    const int first = (t == 0) ? 0 : lower_bound(job->positions, job->num_positions, job->chunk_offset[t]);
+    const int last = (t == job->num_chunks-1) ? job->num_positions : lower_bound(job->positions, job->num_positions, job->chunk_offset[t+1]);
+    const bool keep_fixed = (job->type == RESAMPLE_RESIDUAL);
+
+    int j = first;
+    double cumsum = job->chunk_offset[t];
+    for (int i=job->begin[t]; i<job->begin[t+1]; i++) {
+        int n = keep_fixed ? job->n_offspring[i] : 0;
+        cumsum += job->mass[i];
+        if (i == job->begin[t+1]-1) {
+            // The last particle in the chunk absorbs any rounding slack
+            n += last - j;
+            j = last;
+        } else {
+            while (j < last && job->positions[j] < cumsum) {
+                n++;
+                j++;
+            }
+        }
+        job->n_offspring[i] = n;
+    }
+}
+
+
+static void *run_task(void *arg) {
+    resample_task *task = (resample_task *)arg;
+    task->pass(task->job, task->chunk);
+    return NULL;
+}
+
+/**
+ * Run a pass over every chunk; chunk 0 runs on the calling thread
+ *
+ */
+static void run_pass(resample_job *job, void (*pass)(resample_job *, int)) {
+    if (job->num_chunks == 1) {
+        pass(job, 0);
+        return;
+    }
+    pthread_t threads[MAX_RESAMPLE_THREADS];
+    resample_task tasks[MAX_RESAMPLE_THREADS];
+    bool started[MAX_RESAMPLE_THREADS] = { false };
+    for (int t=1; t<job->num_chunks; t++) {
+        tasks[t] = (resample_task) { job, t, pass };
+        started[t] = (pthread_create(&threads[t], NULL, run_task, &tasks[t]) == 0);
+        if (!started[t]) pass(job, t);
+    }
+    pass(job, 0);
+    for (int t=1; t<job->num_chunks; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+}
+
+
+/**
+ * Fill positions[0..n) with sorted points in [0, 1), according to the scheme
+ *
+ */
+static void generate_positions(resampler_type type, double *positions, int n) {
+    if (n == 0) return;
+    switch (type) {
+        case RESAMPLE_MULTINOMIAL: {
+            // Sorted uniforms via normalized cumulative exponential spacings
+            double total = 0;
+            for (int j=0; j<n; j++) {
+                total += exponential_rng(1);
+                positions[j] = total;
+            }
+            total += exponential_rng(1);
+            for (int j=0; j<n; j++) positions[j] /= total;
+            break;
+        }
+        case RESAMPLE_STRATIFIED:
+            for (int j=0; j<n; j++) positions[j] = (j + uniform_rng(0, 1)) / n;
+            break;
+        case RESAMPLE_SYSTEMATIC:
+        case RESAMPLE_RESIDUAL: {
+            const double u = uniform_rng(0, 1);
+            for (int j=0; j<n; j++) positions[j] = (j + u) / n;
+            break;
+        }
+    }
+}
+
+
+void resample_offspring(resampler_type type, const double *log_weights, int count, int num_draws, int *n_offspring) {
+    assert(count > 0);
+    assert(num_draws >= 0);
+
+    resample_job *job = malloc(sizeof(resample_job));
+    job->type = type;
+    job->log_weights = log_weights;
+    job->count = count;
+    job->num_draws = num_draws;
+    job->n_offspring = n_offspring;
+    job->mass = malloc(count*sizeof(double));
+    job->positions = malloc((num_draws+1)*sizeof(double));
+
+    // Decide how many chunks to split the population into
+    int threads = RESAMPLE_THREADS;
+    if (threads < 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_RESAMPLE_THREADS) threads = MAX_RESAMPLE_THREADS;
+    if (threads < 1 || count < RESAMPLE_PARALLEL_MIN_COUNT) threads = 1;
+    job->num_chunks = threads;
+    for (int t=0; t<=threads; t++) {
+        job->begin[t] = (int)(((long)count * t) / threads);
+    }
+
+    // Normalizing constant
+    run_pass(job, pass_max);
+    job->max_log_weight = -DBL_MAX;
+    for (int t=0; t<job->num_chunks; t++) {
+        if (job->chunk_max[t] > job->max_log_weight) job->max_log_weight = job->chunk_max[t];
+    }
+    run_pass(job, pass_exp);
+    job->total_weight = 0;
+    for (int t=0; t<job->num_chunks; t++) job->total_weight += job->chunk_mass[t];
+
+    // Residual resampling fixes most offspring deterministically
+    job->num_positions = num_draws;
+    if (type == RESAMPLE_RESIDUAL) {
+        run_pass(job, pass_residual);
+        int fixed = 0;
+        for (int t=0; t<job->num_chunks; t++) fixed += job->chunk_fixed[t];
+        job->num_positions = num_draws - fixed;
+        assert(job->num_positions >= 0);
+    }
+
+    // Prefix sums over chunks, then scale the sorted positions onto [0, total mass)
+    double total_mass = 0;
+    for (int t=0; t<job->num_chunks; t++) {
+        job->chunk_offset[t] = total_mass;
+        total_mass += job->chunk_mass[t];
+    }
+    job->chunk_offset[job->num_chunks] = total_mass;
+    generate_positions(type, job->positions, job->num_positions);
+    for (int j=0; j<job->num_positions; j++) job->positions[j] *= total_mass;
+
+    run_pass(job, pass_merge);
+
+    free(job->mass);
+    free(job->positions);
+    free(job);
+}
+
+
+void resample_assign_slots(const int *n_offspring, int count, int *first_slot) {
+    int next = 0;
+    for (int i=0; i<count; i++) {
+        first_slot[i] = next;
+        next += n_offspring[i];
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef __RESAMPLE__
+
+#include <stdbool.h>
+
+/**
+ *
+ * Shared resampling schemes for the SMC-based engines (smc, pg, pimh).
+ *
+ * Every scheme runs in O(N + M) time for N particles and M draws: particle
+ * masses are turned into a running CDF once, and a sorted vector of M
+ * positions in [0, 1) is merged against it in a single pass.
+ *
+ *  - multinomial: M i.i.d. uniforms, generated already sorted (exponential spacings)
+ *  - stratified:  one uniform per stratum [j/M, (j+1)/M)
+ *  - systematic:  a single uniform offset shared by all strata
+ *  - residual:    floor(M w_i) deterministic copies, remainder drawn systematically.
+ *                 With a systematic remainder this gives exactly the same counts
+ *                 as systematic, so it is kept only as another name for it.
+ *
+ * For very large populations the exp / prefix-sum / merge passes are split
+ * over several threads, so the leader particle at an observe barrier does not
+ * stall the population for O(N) serial work (--resample_threads).
+ *
+ */
+
+typedef enum {
+    RESAMPLE_MULTINOMIAL,
+    RESAMPLE_STRATIFIED,
+    RESAMPLE_SYSTEMATIC,
+    RESAMPLE_RESIDUAL
+} resampler_type;
+
+/**
+ * Look up a resampling scheme by its command line name
+ * ("multinomial", "stratified", "systematic", "residual").
+ * Returns false if the name is not recognized.
+ *
+ */
+bool resampler_from_name(const char *name, resampler_type *type);
+const char *resampler_name(resampler_type type);
+
+/**
+ * Sample offspring counts from unnormalized log weights.
+ *
+ * Writes n_offspring[0..count), which sums to num_draws. The log weights are
+ * not modified, so they may live in shared memory which other processes read.
+ *
+ */
+void resample_offspring(resampler_type type, const double *log_weights, int count, int num_draws, int *n_offspring);
+
+/**
+ * Given offspring counts, assign each particle the first of a contiguous block
+ * of n_offspring[i] slots in [0, sum(n_offspring)): an exclusive prefix sum.
+ * Surviving particles and their children take these as their next slot index.
+ *
+ */
+void resample_assign_slots(const int *n_offspring, int count, int *first_slot);
+
+/**
+ * Configure the multithreaded path: populations of at least min_count particles
+ * are split across num_threads worker threads. num_threads <= 1 disables it;
+ * min_count <= 0 keeps the current threshold. Defaults: one thread per online
+ * CPU, for populations of 65536 or more. Set from --resample_threads=N[,min].
+ *
+ */
+void resample_set_threads(int num_threads, int min_count);
+
+#define __RESAMPLE__
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "run-stats.h"
+
+
+static const char *stats_file = NULL;
+static const char *program = "";
+static struct timespec start_time;
+static pid_t root_pid = -1;
+
+
+static inline double seconds(struct timeval t) {
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// ru_maxrss is in kilobytes on Linux, bytes on OS X
+static inline long rss_kb(long max_rss) {
+#ifdef __APPLE__
+    return max_rss / 1024;
+#else
+    return max_rss;
+#endif
+}
+
+
+void run_stats_start(const char *program_path, const char *path) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    root_pid = getpid();
+    const char *slash = strrchr(program_path, '/');
+    program = (slash != NULL) ? slash + 1 : program_path;
+    stats_file = path;
+}
+
+void run_stats_report() {
+    if (getpid() != root_pid) return;
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double wall = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    FILE *stream = stderr;
+    if (stats_file != NULL) {
+        stream = fopen(stats_file, "a");
+        if (stream == NULL) {
+            perror(stats_file);
+            stream = stderr;
+        }
+    }
+    fprintf(stream, "{\"program\":\"%s\",\"wall_s\":%.6f,"
+                    "\"self_user_s\":%.6f,\"self_sys_s\":%.6f,"
+                    "\"children_user_s\":%.6f,\"children_sys_s\":%.6f,\"cpu_s\":%.6f,"
+                    "\"self_max_rss_kb\":%ld,\"children_max_rss_kb\":%ld,"
+                    "\"voluntary_switches\":%ld,\"involuntary_switches\":%ld}\n",
+            program, wall,
+            seconds(self.ru_utime), seconds(self.ru_stime),
+            seconds(children.ru_utime), seconds(children.ru_stime),
+            seconds(self.ru_utime) + seconds(self.ru_stime) + seconds(children.ru_utime) + seconds(children.ru_stime),
+            rss_kb(self.ru_maxrss), rss_kb(children.ru_maxrss),
+            self.ru_nvcsw + children.ru_nvcsw, self.ru_nivcsw + children.ru_nivcsw);
+    if (stream != stderr) {
+        fclose(stream);
+    } else {
+        fflush(stream);
+    }
+}
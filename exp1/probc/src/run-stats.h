@@ -0,0 +1,38 @@
+#ifndef __RUN_STATS__
+
+/**
+ *
+ * Resource usage of a whole run, reported once by the root process as it
+ * finishes: wall time (monotonic clock), the root's own CPU time, the CPU time
+ * of every particle it (or, as subreaper, its re-parented descendants) waited
+ * for, peak resident set sizes, and context switches.
+ *
+ * The record is one JSON line, written to stderr, or appended to the file given
+ * with --stats_file (stdout is left to predicts):
+ *
+ *   {"program":"hmm","wall_s":1.23,"self_user_s":...,"self_sys_s":...,
+ *    "children_user_s":...,"children_sys_s":...,"cpu_s":...,
+ *    "self_max_rss_kb":...,"children_max_rss_kb":...,
+ *    "voluntary_switches":...,"involuntary_switches":...}
+ *
+ * cpu_s is the total over the root and its children; context switches are
+ * likewise totals.
+ *
+ */
+
+
+/**
+ * Called first thing, with argv[0] and the value of --stats_file (or NULL):
+ * start the clocks
+ *
+ */
+void run_stats_start(const char *program_path, const char *path);
+
+/**
+ * Called by the root once inference is done: write the record
+ *
+ */
+void run_stats_report();
+
+#define __RUN_STATS__
+#endif
@@ -0,0 +1,235 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "uthash.h"
+#include "sample-format.h"
+#include "sample-file.h"
+
+
+// Spooled row, followed by the name (padded so the next row is aligned)
+typedef struct {
+    uint32_t name_length;
+    uint32_t flags;
+    double value;
+    double log_weight;
+    int64_t id;
+} spool_row;
+
+#define ROW_INT 1
+#define ROW_WEIGHTED 2
+
+typedef struct {
+    const char *name;           // points into the spool
+    uint32_t name_length;
+    bool is_int;
+    uint64_t count;
+    uint64_t filled;
+    sample_file_variable *variable;
+    UT_hash_handle hh;
+} column;
+
+static bool enabled = false;
+static const char *path = SAMPLE_FILE_DEFAULT_PATH;
+static int spool_fd = -1;
+static pid_t owner_pid = -1;
+
+
+static inline uint64_t align(uint64_t bytes) {
+    return (bytes + 7) & ~(uint64_t)7;
+}
+
+static inline uint64_t row_size(const spool_row *row) {
+    return sizeof(spool_row) + align(row->name_length);
+}
+
+
+bool sample_file_set_format(const char *name) {
+    if (strcmp(name, "csv") == 0) {
+        enabled = false;
+    } else if (strcmp(name, "bin") == 0) {
+        enabled = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void sample_file_set_path(const char *new_path) {
+    path = new_path;
+}
+
+bool sample_file_enabled() {
+    return enabled;
+}
+
+
+void sample_file_open() {
+    if (!enabled) return;
+    size_t length = strlen(path) + 32;
+    char spool_path[length];
+    snprintf(spool_path, length, "%s.spool.XXXXXX", path);
+    spool_fd = mkstemp(spool_path);
+    if (spool_fd < 0) {
+        perror(spool_path);
+        exit(1);
+    }
+    // Only ever reached through the descriptor, which every particle inherits
+    unlink(spool_path);
+    fcntl(spool_fd, F_SETFL, fcntl(spool_fd, F_GETFL) | O_APPEND);
+    owner_pid = getpid();
+}
+
+int sample_file_fd() {
+    return (spool_fd >= 0) ? spool_fd : STDOUT_FILENO;
+}
+
+
+void sample_file_add_row(UT_string *out, const char *name, size_t name_length, double value,
+                         bool is_int, bool weighted, double log_weight, long id) {
+    spool_row row = {
+        .name_length = name_length,
+        .flags = (is_int ? ROW_INT : 0) | (weighted ? ROW_WEIGHTED : 0),
+        .value = value,
+        .log_weight = weighted ? log_weight : 0,
+        .id = weighted ? id : -1
+    };
+    static const char padding[8] = { 0 };
+    utstring_bincpy(out, &row, sizeof(row));
+    utstring_bincpy(out, name, name_length);
+    utstring_bincpy(out, padding, align(name_length) - name_length);
+}
+
+size_t sample_file_whole_rows(const char *buffer, size_t length) {
+    size_t position = 0;
+    spool_row row;
+    while (position + sizeof(row) <= length) {
+        memcpy(&row, buffer + position, sizeof(row));
+        if (position + row_size(&row) > length) break;
+        position += row_size(&row);
+    }
+    return position;
+}
+
+
+/**
+ * Rearrange the spooled rows into columns: one pass to find the variables and
+ * count their samples, which fixes the layout of the file, then another to
+ * copy each value into place in the (mmap'd) output
+ *
+ */
+void sample_file_close() {
+    if (spool_fd < 0 || getpid() != owner_pid) return;
+
+    struct stat info;
+    fstat(spool_fd, &info);
+    size_t spool_size = info.st_size;
+    const char *spool = NULL;
+    if (spool_size > 0) {
+        spool = mmap(NULL, spool_size, PROT_READ, MAP_SHARED, spool_fd, 0);
+        if (spool == MAP_FAILED) {
+            perror("sample_file_close: mmap");
+            exit(1);
+        }
+    }
+
+    column *columns = NULL;
+    column *entry, *tmp;
+    bool weighted = true;
+    uint64_t num_samples = 0;
+    spool_row row;
+    for (uint64_t position = 0; position < spool_size; position += row_size(&row)) {
+        memcpy(&row, spool + position, sizeof(row));
+        const char *name = spool + position + sizeof(row);
+        HASH_FIND(hh, columns, name, row.name_length, entry);
+        if (entry == NULL) {
+            entry = calloc(1, sizeof(column));
+            entry->name = name;
+            entry->name_length = row.name_length;
+            entry->is_int = true;
+            HASH_ADD_KEYPTR(hh, columns, entry->name, entry->name_length, entry);
+        }
+        entry->count++;
+        if (!(row.flags & ROW_INT)) entry->is_int = false;
+        if (!(row.flags & ROW_WEIGHTED)) weighted = false;
+        num_samples++;
+    }
+    if (num_samples == 0) weighted = false;
+
+    // Layout: header, variables, names, then each variable's columns
+    uint64_t num_variables = HASH_COUNT(columns);
+    uint64_t file_size = sizeof(sample_file_header) + num_variables * sizeof(sample_file_variable);
+    uint64_t name_offset = file_size;
+    HASH_ITER(hh, columns, entry, tmp) {
+        file_size += align(entry->name_length);
+    }
+
+    uint64_t total_size = file_size + num_samples * (weighted ? 3 : 1) * sizeof(double);
+
+    int descriptor = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (descriptor < 0 || ftruncate(descriptor, total_size) != 0) {
+        perror(path);
+        exit(1);
+    }
+    char *file = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    if (file == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+
+    sample_file_header *header = (sample_file_header *)file;
+    memcpy(header->magic, SAMPLE_FILE_MAGIC, sizeof(header->magic));
+    header->version = SAMPLE_FILE_VERSION;
+    header->flags = weighted ? SAMPLE_FILE_WEIGHTED : 0;
+    header->num_variables = num_variables;
+    header->num_samples = num_samples;
+    header->file_size = total_size;
+
+    sample_file_variable *variable = (sample_file_variable *)(file + sizeof(sample_file_header));
+    HASH_ITER(hh, columns, entry, tmp) {
+        entry->variable = variable;
+        variable->name_offset = name_offset;
+        variable->name_length = entry->name_length;
+        variable->type = entry->is_int ? SAMPLE_TYPE_INT : SAMPLE_TYPE_DOUBLE;
+        variable->count = entry->count;
+        memcpy(file + name_offset, entry->name, entry->name_length);
+        name_offset += align(entry->name_length);
+
+        uint64_t bytes = entry->count * sizeof(double);
+        variable->values_offset = file_size;
+        file_size += bytes;
+        if (weighted) {
+            variable->log_weights_offset = file_size;
+            variable->ids_offset = file_size + bytes;
+            file_size += 2*bytes;
+        }
+        variable++;
+    }
+
+    for (uint64_t position = 0; position < spool_size; position += row_size(&row)) {
+        memcpy(&row, spool + position, sizeof(row));
+        HASH_FIND(hh, columns, spool + position + sizeof(row), row.name_length, entry);
+        uint64_t index = entry->filled++;
+        ((double *)(file + entry->variable->values_offset))[index] = row.value;
+        if (weighted) {
+            ((double *)(file + entry->variable->log_weights_offset))[index] = row.log_weight;
+            ((int64_t *)(file + entry->variable->ids_offset))[index] = row.id;
+        }
+    }
+
+    munmap(file, total_size);
+    close(descriptor);
+    HASH_ITER(hh, columns, entry, tmp) {
+        HASH_DEL(columns, entry);
+        free(entry);
+    }
+    if (spool != NULL) munmap((void *)spool, spool_size);
+    close(spool_fd);
+    spool_fd = -1;
+}
@@ -0,0 +1,74 @@
+#ifndef __SAMPLE_FILE__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utstring.h"
+
+/**
+ *
+ * Binary sample output (--output_format=bin, --output_file=path).
+ *
+ * Particles don't format their predicts as text: each line becomes a
+ * fixed-size row (value, log weight, particle id, flags) followed by the
+ * variable's name, which goes through the usual output path (the output ring,
+ * or the stdout mutex) into a spool file the root opened before forking.
+ * Once every particle is done, the root rearranges the spooled rows into the
+ * columnar file described in sample-format.h, and deletes the spool.
+ *
+ * Other output (e.g. timings, the log marginal likelihood) still goes to stdout.
+ *
+ */
+
+#define SAMPLE_FILE_DEFAULT_PATH "samples.bin"
+
+
+/**
+ * Select the output format, "csv" (the default) or "bin"; returns false if
+ * unrecognized
+ *
+ */
+bool sample_file_set_format(const char *name);
+void sample_file_set_path(const char *path);
+
+/**
+ * Whether binary output was selected (inherited across fork)
+ *
+ */
+bool sample_file_enabled();
+
+/**
+ * Called by the root, before forking any particles: open the spool
+ *
+ */
+void sample_file_open();
+
+/**
+ * File descriptor particle output is written to: stdout, or the spool
+ *
+ */
+int sample_file_fd();
+
+/**
+ * Append one spooled row to `out`
+ *
+ */
+void sample_file_add_row(UT_string *out, const char *name, size_t name_length, double value,
+                         bool is_int, bool weighted, double log_weight, long id);
+
+/**
+ * Length of the longest run of whole rows at the start of `buffer`, up to
+ * `length` bytes
+ *
+ */
+size_t sample_file_whole_rows(const char *buffer, size_t length);
+
+/**
+ * Called by the root, once all particle output has been written: write the
+ * columnar file and remove the spool
+ *
+ */
+void sample_file_close();
+
+#define __SAMPLE_FILE__
+#endif
@@ -0,0 +1,55 @@
+#ifndef __SAMPLE_FORMAT__
+
+#include <stdint.h>
+
+/**
+ *
+ * Columnar binary sample file (--output_format=bin).
+ *
+ * All offsets are in bytes from the start of the file, and every block starts
+ * on an 8-byte boundary, so the file can be mmap'd and its columns used in
+ * place. Multi-byte fields are in the host's byte order.
+ *
+ *   sample_file_header
+ *   sample_file_variable[num_variables]
+ *   variable names (not NUL-terminated)
+ *   per variable: double values[count],
+ *                 then, if SAMPLE_FILE_WEIGHTED, double log_weights[count]
+ *                 and int64_t particle_ids[count]
+ *
+ * Variables appear in the order they were first output. A variable's samples
+ * are in output order, as the CSV stream would have listed them.
+ *
+ */
+
+#define SAMPLE_FILE_MAGIC "PROBCBIN"
+#define SAMPLE_FILE_VERSION 1
+
+// Header flags
+#define SAMPLE_FILE_WEIGHTED 1
+
+// Variable types; values are always stored as doubles
+#define SAMPLE_TYPE_DOUBLE 0
+#define SAMPLE_TYPE_INT 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t num_variables;
+    uint64_t num_samples;       // over all variables
+    uint64_t file_size;
+} sample_file_header;
+
+typedef struct {
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t type;
+    uint64_t count;
+    uint64_t values_offset;
+    uint64_t log_weights_offset;    // 0 if unweighted
+    uint64_t ids_offset;            // 0 if unweighted
+} sample_file_variable;
+
+#define __SAMPLE_FORMAT__
+#endif
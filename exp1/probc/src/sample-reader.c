@@ -0,0 +1,140 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sample-reader.h"
+
+
+static bool in_bounds(const sample_reader *reader, uint64_t offset, uint64_t bytes) {
+    return offset % 8 == 0 && offset <= reader->size && bytes <= reader->size - offset;
+}
+
+/**
+ * Check every offset in the file, so that columns can be used unchecked
+ *
+ */
+static bool validate(const sample_reader *reader, const char *path) {
+    const sample_file_header *header = reader->header;
+    if (reader->size < sizeof(sample_file_header) ||
+        memcmp(header->magic, SAMPLE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s: not a sample file\n", path);
+        return false;
+    }
+    if (header->version != SAMPLE_FILE_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", path, header->version);
+        return false;
+    }
+    if (header->file_size != reader->size) {
+        fprintf(stderr, "%s: truncated (%zu of %llu bytes)\n", path, reader->size, (unsigned long long)header->file_size);
+        return false;
+    }
+    uint64_t num_variables = header->num_variables;
+    if (num_variables > reader->size / sizeof(sample_file_variable) ||
+        !in_bounds(reader, sizeof(sample_file_header), num_variables * sizeof(sample_file_variable))) {
+        fprintf(stderr, "%s: bad variable table\n", path);
+        return false;
+    }
+    bool weighted = header->flags & SAMPLE_FILE_WEIGHTED;
+    for (uint64_t i=0; i<num_variables; i++) {
+        const sample_file_variable *variable = &reader->variables[i];
+        uint64_t bytes = variable->count * sizeof(double);
+        bool ok = variable->count <= reader->size / sizeof(double) &&
+                  variable->name_offset <= reader->size &&
+                  variable->name_length <= reader->size - variable->name_offset &&
+                  in_bounds(reader, variable->values_offset, bytes);
+        if (weighted) {
+            ok = ok && in_bounds(reader, variable->log_weights_offset, bytes) &&
+                       in_bounds(reader, variable->ids_offset, bytes);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: bad offsets for variable %llu\n", path, (unsigned long long)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int sample_reader_open(sample_reader *reader, const char *path) {
+    *reader = (sample_reader) { 0 };
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(descriptor, &info) != 0) {
+        perror(path);
+        close(descriptor);
+        return -1;
+    }
+    reader->size = info.st_size;
+    if (reader->size > 0) {
+        void *data = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, descriptor, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(descriptor);
+            return -1;
+        }
+        reader->data = data;
+    }
+    close(descriptor);
+
+    reader->header = (const sample_file_header *)reader->data;
+    reader->variables = (const sample_file_variable *)(reader->data + sizeof(sample_file_header));
+    if (!validate(reader, path)) {
+        sample_reader_close(reader);
+        return -1;
+    }
+    return 0;
+}
+
+void sample_reader_close(sample_reader *reader) {
+    if (reader->data != NULL) {
+        munmap((void *)reader->data, reader->size);
+    }
+    *reader = (sample_reader) { 0 };
+}
+
+
+long sample_reader_num_variables(const sample_reader *reader) {
+    return reader->header->num_variables;
+}
+
+bool sample_reader_weighted(const sample_reader *reader) {
+    return reader->header->flags & SAMPLE_FILE_WEIGHTED;
+}
+
+sample_column sample_reader_column(const sample_reader *reader, long index) {
+    const sample_file_variable *variable = &reader->variables[index];
+    sample_column column = {
+        .name = reader->data + variable->name_offset,
+        .name_length = variable->name_length,
+        .is_int = variable->type == SAMPLE_TYPE_INT,
+        .count = variable->count,
+        .values = (const double *)(reader->data + variable->values_offset),
+        .log_weights = NULL,
+        .ids = NULL
+    };
+    if (sample_reader_weighted(reader)) {
+        column.log_weights = (const double *)(reader->data + variable->log_weights_offset);
+        column.ids = (const int64_t *)(reader->data + variable->ids_offset);
+    }
+    return column;
+}
+
+long sample_reader_find(const sample_reader *reader, const char *name) {
+    size_t length = strlen(name);
+    for (long i=0; i<sample_reader_num_variables(reader); i++) {
+        const sample_file_variable *variable = &reader->variables[i];
+        if (variable->name_length == length &&
+            memcmp(reader->data + variable->name_offset, name, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
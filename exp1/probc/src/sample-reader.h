@@ -0,0 +1,60 @@
+#ifndef __SAMPLE_READER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample-format.h"
+
+/**
+ *
+ * Reader for columnar sample files (see sample-format.h).
+ *
+ * The file is mmap'd read-only and validated once, when opened; columns then
+ * point straight into the mapping, and stay valid until sample_reader_close.
+ * Has no dependencies on the rest of the library, so tools can link it alone.
+ *
+ */
+
+typedef struct {
+    const char *name;           // not NUL-terminated
+    int name_length;
+    bool is_int;
+    long count;
+    const double *values;
+    const double *log_weights;  // NULL if unweighted
+    const int64_t *ids;         // NULL if unweighted
+} sample_column;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    const sample_file_header *header;
+    const sample_file_variable *variables;
+} sample_reader;
+
+
+/**
+ * Map and validate a sample file; returns 0, or -1 after printing why to stderr
+ *
+ */
+int sample_reader_open(sample_reader *reader, const char *path);
+void sample_reader_close(sample_reader *reader);
+
+long sample_reader_num_variables(const sample_reader *reader);
+bool sample_reader_weighted(const sample_reader *reader);
+
+/**
+ * Column `index`, in the order the variables were first output
+ *
+ */
+sample_column sample_reader_column(const sample_reader *reader, long index);
+
+/**
+ * Index of the variable called `name`, or -1
+ *
+ */
+long sample_reader_find(const sample_reader *reader, const char *name);
+
+#define __SAMPLE_READER__
+#endif
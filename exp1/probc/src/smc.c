@@ -24,10 +24,15 @@
 #include "utstring.h"
 #include "probabilistic.h"
 #include "engine-shared.h"
-
-// Profiling
-clock_t start, end;
-FILE *fp;
+#include "resample.h"
+#include "zygote.h"
+#include "reaper.h"
+#include "output-ring.h"
+#include "sync-policy.h"
+#include "sample-file.h"
+#include "aggregate.h"
+#include "profile.h"
+#include "perf-counters.h"
 
 // Set defaults for number of particles
 static int NUM_PARTICLES = 100;
@@ -47,6 +52,45 @@ static bool TIME_EXECUTION = false;
 // Flag to mark whether to output weighted or unweighted particle set
 static bool WEIGHTED_OUTPUT = false;
 
+// Scheme used to sample offspring counts
+static resampler_type RESAMPLER = RESAMPLE_MULTINOMIAL;
+
+// Fanout of the observe barrier's combining tree (0 = flat barrier)
+static int BARRIER_FANOUT = 0;
+
+// Standby children pre-forked per particle while waiting at an observe (0 = off)
+static int ZYGOTES = 0;
+
+// Which synchronizing observes are barriers
+static sync_policy SYNC_POLICY = { SYNC_ALWAYS, 1 };
+
+// Asynchronous mode: no observe barrier. Each particle resamples as soon as it
+// arrives, against the running average weight of the peers which have reached
+// the same observe before it, and may run at most MAX_LAG observes ahead of the
+// slowest particle.
+static bool ASYNC = false;
+static int MAX_LAG = 2;
+
+// Asynchronous mode: hard limit on the particles reaching any observe, as a
+// multiple of -p
+static int ASYNC_POPULATION_CAP = 2;
+
+// Number of synchronizing observes, from the prerun (asynchronous mode only)
+static int NUM_OBSERVES = 0;
+static bool IS_PRERUN = false;
+
+
+/**
+ * Per-observe arrival statistics, for asynchronous mode
+ *
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    int arrived;
+    int offspring;
+    double log_avg_weight;
+} async_observe;
+
 
 /**
  * Struct containing global (shared) state variables
@@ -58,24 +102,27 @@ typedef struct {
     double *log_weights;
     int *n_offspring;
 
+    // First slot index taken by each particle's offspring after resampling
+    int *offspring_slot;
+
     int current_observe;
 
     // Synchronization state
 
+    // Which upcoming synchronizing observes are barriers (updated by barrier leaders)
+    sync_schedule schedule;
+
     // Barrier: all particles have reached an observe
-    int begin_observe_counter;
-    pthread_mutex_t begin_observe_mutex;
-    pthread_cond_t begin_observe_cond;
+    shared_barrier begin_observe;
+
+    // Latch: all particles have completed an observe
+    shared_latch end_observe;
 
-    // Barrier: all particles have completed an observe
-    int end_observe_counter;
-    pthread_mutex_t end_observe_mutex;
-    pthread_cond_t end_observe_cond;
+    // Standby children, forked while particles wait at begin_observe
+    zygote_pool zygotes;
 
-    // Barrier: all particles completed program execution
-    int exec_complete_counter;
-    pthread_mutex_t exec_complete_mutex;
-    pthread_cond_t exec_complete_cond;
+    // Latch: all particles completed program execution
+    shared_latch exec_complete;
 
     // Mutex: stdout lock
     pthread_mutex_t stdout_mutex;
@@ -87,6 +134,18 @@ typedef struct {
     // Marginal likelihood estimate
     double log_marginal_likelihood;
 
+    // Synchronizing observes per particle (in asynchronous mode, from the prerun);
+    // asynchronous mode: per-observe statistics, and the frontier, i.e. the number of observes every particle has passed
+    int num_observes;
+    async_observe *observes;
+    padded_counter frontier;
+    pthread_mutex_t frontier_mutex;
+    bool observe_count_mismatch;
+
+    // Log of the summed final weights of all particles, for the evidence estimate
+    double log_final_weight_sum;
+    int num_finished;
+
 } shared_globals;
 
 /**
@@ -97,8 +156,11 @@ typedef struct {
     double log_weight;
     double log_likelihood;
     int current_observe;
+    int sync_index;
+    bool force_sync;
+    int particle_index;
     int live_offspring_count;
-    UT_string *predict;
+    predict_buffer *predict;
 } process_locals;
 
 
@@ -107,75 +169,19 @@ static shared_globals *globals;
 
 
 /**
- * Sample number of offspring, given particle weights
- * Basic multinomial resampling scheme
- *
- */
-void multinomial_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = 0;
-    }
-
-    // Draw number of offspring.
-    for (s=0; s<NUM_PARTICLES; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
-
-
-#if DEBUG_LEVEL >= 2
-    // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "LOG WEIGHT: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
-    fprintf(stderr, ">\n");
-    fprintf(stderr, "N_OFFSPRING: <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
-    fprintf(stderr, ">\n");
-#endif
-
-    free(sampling_dist);
-}
-
-
-/**
- * Sample number of offspring, given particle weights
- * Residual resampling scheme
+ * Sample number of offspring, given particle weights,
+ * using the resampling scheme selected on the command line
  *
  */
-void residual_resample() {
-
-    // Generate sampling distribution from unnormalized weights
-    int s;
-    double log_denominator = log_sum_exp(globals->log_weights, NUM_PARTICLES);
-    double *sampling_dist = malloc(NUM_PARTICLES*sizeof(double));
-    int remainder = NUM_PARTICLES;
-    for (s=0; s<NUM_PARTICLES; s++) {
-        sampling_dist[s] = exp(globals->log_weights[s] - log_denominator);
-        globals->n_offspring[s] = (int)floor(NUM_PARTICLES*sampling_dist[s]);
-        remainder -= globals->n_offspring[s];
-    }
-
-    // Draw number of offspring.
-    for (s=0; s<remainder; s++) {
-        globals->n_offspring[discrete_rng(sampling_dist, NUM_PARTICLES)]++;
-    }
+void resample() {
 
+    enter_run_rng_stream();
+    resample_offspring(RESAMPLER, globals->log_weights, NUM_PARTICLES, NUM_PARTICLES, globals->n_offspring);
+    leave_run_rng_stream();
 
 #if DEBUG_LEVEL >= 2
     // print all the offspring counts (debug)
-    fprintf(stderr, "[resampling %d] observe #%d\n", getpid(), locals->current_observe);
-    fprintf(stderr, "P(CHILD): <");
-    for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", sampling_dist[i]); }
-    fprintf(stderr, ">\n");
+    fprintf(stderr, "[resampling %d] observe #%d (%s)\n", getpid(), locals->current_observe, resampler_name(RESAMPLER));
     fprintf(stderr, "LOG WEIGHT: <");
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%0.4f ", globals->log_weights[i]); }
     fprintf(stderr, ">\n");
@@ -183,8 +189,6 @@ void residual_resample() {
     for (int i=0; i<NUM_PARTICLES; i++) { fprintf(stderr, "%d ", globals->n_offspring[i]); }
     fprintf(stderr, ">\n");
 #endif
-
-    free(sampling_dist);
 }
 
 
@@ -196,7 +200,9 @@ void residual_resample() {
  */
 void destroy_particle() {
     assert(locals->live_offspring_count == 0);
-    utstring_free(locals->predict);
+    predict_buffer_free(locals->predict);
+    profile_flush();
+    perf_counters_exit();
     _exit(0);
 }
 
@@ -208,7 +214,7 @@ void destroy_particle() {
 void predict(const char *format, ...) {
     va_list args;
     va_start(args, format);
-    utstring_printf_va(locals->predict, format, args);
+    predict_buffer_printf_va(locals->predict, format, args);
     va_end(args);
 }
 
@@ -217,12 +223,153 @@ void predict(const char *format, ...) {
  *
  */
 void predict_value(const char *name, const double value) {
-    // generate "predict" queries, given name and value.
-    utstring_printf(locals->predict,"%s,%f\n", name, value);
+    predict_buffer_add_double(locals->predict, name, value);
+}
+
+void predict_int(const char *name, const int value) {
+    predict_buffer_add_int(locals->predict, name, value);
+}
+
+/**
+ * Asynchronous mode: advance the frontier past every observe at which all the
+ * particles expected there have arrived. The number expected at an observe is
+ * final once the one before it is complete.
+ *
+ */
+static void advance_frontier() {
+    pthread_mutex_lock(&globals->frontier_mutex);
+    int frontier = globals->frontier.value;
+    while (frontier < NUM_OBSERVES) {
+        int expected = (frontier == 0) ? NUM_PARTICLES : __atomic_load_n(&globals->observes[frontier-1].offspring, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&globals->observes[frontier].arrived, __ATOMIC_ACQUIRE) < expected) break;
+        frontier++;
+    }
+    if (frontier != globals->frontier.value) {
+        debug_print(2, "Frontier advanced to observe %d\n", frontier);
+        __atomic_store_n(&globals->frontier.value, frontier, __ATOMIC_RELEASE);
+        shared_futex_wake_all(&globals->frontier.value);
+    }
+    pthread_mutex_unlock(&globals->frontier_mutex);
 }
 
+/**
+ * Asynchronous mode: a particle stops all the others; used when it disagrees
+ * with the prerun on the number of observes
+ *
+ */
+static void abort_async() {
+    globals->observe_count_mismatch = true;
+    __atomic_store_n(&globals->frontier.value, NUM_OBSERVES + MAX_LAG + 1, __ATOMIC_RELEASE);
+    shared_futex_wake_all(&globals->frontier.value);
+    reaper_release_children(&locals->live_offspring_count);
+    destroy_particle();
+}
+
+/**
+ * Asynchronous mode: the number of particles which will reach observe t.
+ *
+ * Exact once the frontier has passed t - 1. Otherwise, it is extrapolated from
+ * the frontier: at each observe s between them, the particles still to arrive
+ * are expected to bring the total up to N (as async_resample aims for), but
+ * no lower than the offspring already drawn there.
+ *
+ */
+static double async_expected_arrivals(int t) {
+    int frontier = __atomic_load_n(&globals->frontier.value, __ATOMIC_ACQUIRE);
+    if (frontier > t) frontier = t;
+    double expected = (frontier == 0) ? NUM_PARTICLES : __atomic_load_n(&globals->observes[frontier-1].offspring, __ATOMIC_ACQUIRE);
+    for (int s = frontier; s < t; s++) {
+        int arrived = __atomic_load_n(&globals->observes[s].arrived, __ATOMIC_ACQUIRE);
+        int offspring = __atomic_load_n(&globals->observes[s].offspring, __ATOMIC_ACQUIRE);
+        expected = (arrived < expected) ? fmax(offspring, NUM_PARTICLES) : offspring;
+    }
+    return fmax(expected, 1);
+}
+
+/**
+ * Asynchronous mode: resample at observe t without waiting for the population.
+ *
+ * The particle's expected offspring count m is its weight relative to the
+ * running average at this observe, times the share of the population still to
+ * be drawn that falls to each particle yet to arrive: (N - offspring so far) /
+ * (arrivals still expected at t). So the total at every observe is steered
+ * back towards N, rather than drifting. With C = ASYNC_POPULATION_CAP:
+ *
+ *   - the share is kept within [1/C, C], and the relative weight at least
+ *     1/C^2, so that a heavy early arrival cannot starve the rest;
+ *   - m is capped so that no observe gets more than C * N offspring, or, past
+ *     that, at most 1/C each. An observe reached by M particles thus passes on
+ *     at most C * N + M / C, and the population never exceeds C^2 / (C - 1) * N.
+ *
+ * Each offspring carries the particle's weight divided by m. As the offspring
+ * count is drawn with mean m, whatever m is, the expected total weight is
+ * preserved, so the final weights give an unbiased evidence estimate.
+ *
+ */
+static void async_resample() {
+    int t = locals->current_observe;
+    if (t >= NUM_OBSERVES) abort_async();
+    async_observe *obs = &globals->observes[t];
+
+    double expected_arrivals = async_expected_arrivals(t);
+
+    pthread_mutex_lock(&obs->mutex);
+    int arrived = obs->arrived;
+    if (arrived == 0) {
+        obs->log_avg_weight = locals->log_weight;
+    } else {
+        obs->log_avg_weight = log_sum_exp((double[2]){ log(arrived) + obs->log_avg_weight, locals->log_weight }, 2) - log(arrived + 1);
+    }
+    int n_offspring = 1;
+    double new_log_weight = locals->log_weight;
+    if (t + 1 < NUM_OBSERVES) {
+        // No point in branching at the final observe
+        double share = (NUM_PARTICLES - obs->offspring) / fmax(expected_arrivals - arrived, 1);
+        share = fmin(fmax(share, 1.0 / ASYNC_POPULATION_CAP), ASYNC_POPULATION_CAP);
+        double mean = fmax(exp(locals->log_weight - obs->log_avg_weight), 1.0 / (ASYNC_POPULATION_CAP * ASYNC_POPULATION_CAP)) * share;
+        mean = fmin(mean, fmax(ASYNC_POPULATION_CAP * NUM_PARTICLES - obs->offspring, 1.0 / ASYNC_POPULATION_CAP));
+        n_offspring = (int)floor(mean) + flip_rng(mean - floor(mean));
+        new_log_weight = locals->log_weight - log(mean);
+    }
+    obs->offspring += n_offspring;
+    __atomic_store_n(&obs->arrived, arrived + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&obs->mutex);
+    advance_frontier();
+
+    debug_print(3, "[OBSERVE %d] process %d, arrival #%d, number of offspring %d\n", t, getpid(), arrived + 1, n_offspring);
+    locals->current_observe = t + 1;
+    perf_counters_observe(locals->current_observe);
+    locals->log_weight = new_log_weight;
+
+    if (n_offspring == 0) {
+        reaper_release_children(&locals->live_offspring_count);
+        destroy_particle();
+    }
+    if (n_offspring > 1) {
+        zygote_pool_fork_offspring(&globals->zygotes, n_offspring - 1, &locals->live_offspring_count);
+    }
+
+    // Bounded lag: carry on once every particle has passed observe t - MAX_LAG
+    uint64_t wait_start = profile_clock();
+    int frontier;
+    while ((frontier = __atomic_load_n(&globals->frontier.value, __ATOMIC_ACQUIRE)) <= t - MAX_LAG) {
+        shared_futex_wait(&globals->frontier.value, frontier);
+    }
+    profile_end(PROFILE_BARRIER, wait_start);
+    if (globals->observe_count_mismatch) {
+        reaper_release_children(&locals->live_offspring_count);
+        destroy_particle();
+    }
+}
+
+
 void weight_trace(const double ln_p, const bool synchronize) {
 
+    if (IS_PRERUN) {
+        if (synchronize) globals->num_observes++;
+        return;
+    }
+
     // Accumulate overall log-likelihood
     locals->log_likelihood += ln_p;
 
@@ -233,29 +380,43 @@ void weight_trace(const double ln_p, const bool synchronize) {
         return;
     }
 
+    if (ASYNC) {
+        locals->log_weight += ln_p;
+        profile_user_pause();
+        async_resample();
+        profile_user_resume();
+        return;
+    }
+
+    // Not a barrier under the current schedule: just reweight
+    int sync_index = locals->sync_index++;
+    if (!locals->force_sync && !sync_schedule_is_barrier(&globals->schedule, sync_index)) {
+        locals->log_weight += ln_p;
+        return;
+    }
+    profile_user_pause();
+
     assert(locals->current_observe == globals->current_observe);
 
-    // We want to branch and resample on every synchronizing observe
-    pthread_mutex_lock(&(globals->begin_observe_mutex));
-    int particles_to_count = NUM_PARTICLES;
-    int shared_globals_index = globals->begin_observe_counter;
+    // We want to branch and resample on every synchronizing observe.
+    // Each particle owns a fixed slot in the shared weight vector.
+    int shared_globals_index = locals->particle_index;
     locals->log_weight += ln_p;
     globals->log_weights[shared_globals_index] = locals->log_weight;
-    globals->begin_observe_counter += 1;
     debug_print(3, "Incrementing observe counter %d to one higher than global observe counter %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid());
     locals->current_observe += 1;
+    perf_counters_observe(locals->current_observe);
 
-    debug_print(4,"[OBSERVE %d, %d] #%d, %0.4f\n", locals->current_observe, getpid(), globals->begin_observe_counter, ln_p);
-
-    // TODO check, fix
+    debug_print(4,"[OBSERVE %d, %d] slot #%d, %0.4f\n", locals->current_observe, getpid(), shared_globals_index, ln_p);
 
     // Wait until processes are synchronized
-    debug_print(3,"[observe #%d] #%d\n", locals->current_observe, globals->begin_observe_counter);
-    if (globals->begin_observe_counter >= particles_to_count) {
-        debug_print(4,"%d: observed %d of %d particles, moving on\n", getpid(), globals->begin_observe_counter, particles_to_count);
-
-        // Reset observe counters to zero
-        globals->begin_observe_counter = 0;
+    int sense;
+    bool is_standby = false;
+    unsigned long standby_seed = 0;
+    int standby_slot = 0;
+    if (shared_barrier_arrive(&globals->begin_observe, shared_globals_index, NUM_PARTICLES, &sense)) {
+        debug_print(4,"%d: observed all %d particles, moving on\n", getpid(), NUM_PARTICLES);
+        uint64_t resample_start = profile_clock();
 
         // current observe?
         ++(globals->current_observe);
@@ -268,99 +429,95 @@ void weight_trace(const double ln_p, const bool synchronize) {
         }
         ESS = 1 / ESS;
         debug_print(2,"ESS at observe %d: %f\n", locals->current_observe, ESS);
-        if (ESS < TAU*NUM_PARTICLES) {
+        bool resampled = (ESS < TAU*NUM_PARTICLES);
+        if (resampled) {
 
-            globals->log_marginal_likelihood += normalization - log(NUM_PARTICLES);
+            // The final forced barrier only resamples for output: its weights
+            // are already in log_final_weight_sum
+            if (!locals->force_sync) {
+                globals->log_marginal_likelihood += normalization - log(NUM_PARTICLES);
+            }
 
             // sample offspring counts
-            multinomial_resample();
-            //residual_resample();
+            resample();
             for (int i=0; i<NUM_PARTICLES; i++) {
                 globals->log_weights[i] = 0;
             }
         }
+        sync_schedule_update(&globals->schedule, &SYNC_POLICY, TAU, sync_index, ESS/NUM_PARTICLES, resampled);
+        resample_assign_slots(globals->n_offspring, NUM_PARTICLES, globals->offspring_slot);
+        zygote_pool_plan(&globals->zygotes, globals->n_offspring, NUM_PARTICLES);
+        profile_end(PROFILE_RESAMPLE, resample_start);
 
-//        int total_offspring = 0;
-//        for (int i=0; i<NUM_PARTICLES; i++) {
-//            total_offspring += globals->n_offspring[i];
-//        }
-//        assert(total_offspring == NUM_PARTICLES);
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        globals->end_observe_counter = NUM_PARTICLES;
+        // Every surviving particle counts down once, as does every killed one
+        int end_observe_count = NUM_PARTICLES;
         for (int i=0; i<NUM_PARTICLES; i++) {
-            if (globals->n_offspring[i] == 0) globals->end_observe_counter++;
+            if (globals->n_offspring[i] == 0) end_observe_count++;
         }
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        shared_latch_set(&globals->end_observe, end_observe_count);
 
         // Inform peer particles that synchronization for this observe is complete
-        debug_print(3,"[broadcast begin_observe] observe = %d\n", locals->current_observe);
+        debug_print(3,"[release begin_observe] observe = %d\n", locals->current_observe);
         debug_print(2,"New observe global: %d (at local: %d)\n", globals->current_observe, locals->current_observe);
-        //assert(globals->end_observe_counter == 0);
-        pthread_cond_broadcast(&globals->begin_observe_cond);
+        shared_barrier_release(&globals->begin_observe);
     } else {
-        debug_print(4,"%d: observed %d of %d particles, waiting...\n", getpid(), globals->begin_observe_counter, particles_to_count);
-        // This *looks* strange, but the begin_observe_counter is incremented every
-        // time this function is called, and then reset to zero before broadcast().
-        debug_print(3,"[wait begin_observe %d %d] observe barrier counter = %d (pid %d)\n", locals->current_observe, globals->current_observe, globals->begin_observe_counter, getpid());
-        while (globals->begin_observe_counter != 0) {
-        //while (locals->current_observe != globals->current_observe) {
-            pthread_cond_wait(&globals->begin_observe_cond, &globals->begin_observe_mutex);
+        debug_print(3,"[wait begin_observe %d %d] (pid %d)\n", locals->current_observe, globals->current_observe, getpid());
+        // Use the idle time to pre-fork children we may need after resampling
+        is_standby = zygote_pool_fill(&globals->zygotes, shared_globals_index, locals->log_weight, &globals->begin_observe, sense,
+                                      &locals->live_offspring_count, &standby_seed, &standby_slot);
+        if (!is_standby) {
+            uint64_t wait_start = profile_clock();
+            shared_barrier_wait(&globals->begin_observe, sense);
+            profile_end(PROFILE_BARRIER, wait_start);
         }
     }
-    pthread_mutex_unlock(&(globals->begin_observe_mutex));
-    debug_print(2, "Mutex released, asserting local %d == global %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid());
+    debug_print(2, "Barrier released, asserting local %d == global %d [index %d, %d]\n", locals->current_observe, globals->current_observe, shared_globals_index, getpid());
     assert(locals->current_observe == globals->current_observe);
     locals->log_weight = globals->log_weights[shared_globals_index];
 
 
     // Spawn children
     int n_offspring = globals->n_offspring[shared_globals_index];
-    if (n_offspring == 0) {
+    int first_slot = globals->offspring_slot[shared_globals_index];
+    if (is_standby) {
+        // Activated standby: carry on exactly like a freshly forked child
+        set_rng_seed(standby_seed);
+        locals->live_offspring_count = 0;
+        locals->particle_index = standby_slot;
+    } else if (n_offspring == 0) {
+        zygote_pool_discard(&globals->zygotes, shared_globals_index);
         debug_print(4, "Post resample: terminating process %d (waiting %d children)\n", getpid(), locals->live_offspring_count);
-        pthread_mutex_lock(&globals->end_observe_mutex);
-        globals->end_observe_counter--;
-        if (globals->end_observe_counter == 0) {
-            pthread_cond_broadcast(&globals->end_observe_cond);
-        }
-        debug_print(2, "Killed particle %d, counter down to %d\n", getpid(), globals->end_observe_counter);
-        pthread_mutex_unlock(&globals->end_observe_mutex);
+        shared_latch_count_down(&globals->end_observe);
+        debug_print(2, "Killed particle %d\n", getpid());
 
-        cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+        reaper_release_children(&locals->live_offspring_count);
         destroy_particle();
         assert(false); // Unreachable line of code, hopefully
     } else {
-        while (n_offspring > 1) {
-            unsigned long seed = gen_new_rng_seed();
-            pid_t child_pid = fork();
-            if (child_pid == 0) {
-                set_rng_seed(seed);
-                locals->live_offspring_count = 0;
-                break;
-            } else if (child_pid > 0) {
-                n_offspring--;
-                locals->live_offspring_count++;
-            } else {
-                debug_print(2, "ERROR WHILE FORKING %d\n", locals->current_observe);
-                perror("fork");
-                sleep(1);
-            }
+        // The parent keeps the first slot of its block; each child takes one of the rest
+        locals->particle_index = first_slot;
+        n_offspring -= zygote_pool_activate(&globals->zygotes, shared_globals_index, n_offspring - 1, first_slot + n_offspring - 1);
+        zygote_pool_discard(&globals->zygotes, shared_globals_index);
+        // Activated standbys took the top slots; fork the rest as a tree
+        int child_slot = zygote_pool_fork_tree(&globals->zygotes, first_slot + 1, n_offspring - 1,
+                                               &locals->live_offspring_count);
+        if (child_slot >= 0) {
+            locals->particle_index = child_slot;
         }
     }
 
-    pthread_mutex_lock(&globals->end_observe_mutex);
-    globals->end_observe_counter--;
-    debug_print(2, "%d particles remaining [index %d, %d]\n", globals->end_observe_counter, shared_globals_index, getpid());
-    if (globals->end_observe_counter == 0) {
+    if (shared_latch_count_down(&globals->end_observe)) {
         debug_print(2,"END OF OBSERVE %d\n", globals->current_observe);
-        pthread_cond_broadcast(&globals->end_observe_cond);
+        zygote_pool_reap(&locals->live_offspring_count);
     } else {
-        while (globals->end_observe_counter > 0) {
-            pthread_cond_wait(&globals->end_observe_cond, &globals->end_observe_mutex);
-        }
+        zygote_pool_reap(&locals->live_offspring_count);
+        uint64_t wait_start = profile_clock();
+        shared_latch_wait(&globals->end_observe);
+        profile_end(PROFILE_BARRIER, wait_start);
     }
-    pthread_mutex_unlock(&globals->end_observe_mutex);
     assert(locals->current_observe == globals->current_observe);
-    debug_print(2, "[index %d, %d] I am through with observe %d\n", shared_globals_index, getpid(), locals->current_observe);
+    debug_print(2, "[index %d, %d] I am through with observe %d\n", locals->particle_index, getpid(), locals->current_observe);
+    profile_user_resume();
 }
 
 
@@ -375,19 +532,55 @@ void init_globals() {
     globals = (shared_globals *)shared_memory_alloc(sizeof(shared_globals));
     globals->log_weights = (double *)shared_memory_alloc(NUM_PARTICLES*sizeof(double));
     globals->n_offspring = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
+    globals->offspring_slot = (int *)shared_memory_alloc(NUM_PARTICLES*sizeof(int));
 
-    // Initialize process locks
-    init_shared_mutex(&globals->exec_complete_mutex, &globals->exec_complete_cond);
-    init_shared_mutex(&globals->begin_observe_mutex, &globals->begin_observe_cond);
-    init_shared_mutex(&globals->end_observe_mutex, &globals->end_observe_cond);
+    // Initialize process locks and barriers
+    shared_barrier_init(&globals->begin_observe, NUM_PARTICLES, BARRIER_FANOUT);
+    shared_latch_set(&globals->end_observe, 0);
+    zygote_pool_init(&globals->zygotes, NUM_PARTICLES, ZYGOTES, TAU);
+    shared_latch_set(&globals->exec_complete, NUM_PARTICLES);
     init_shared_mutex(&globals->stdout_mutex, NULL);
     init_shared_mutex(&globals->particle_id_mutex, NULL);
 
     // Initialize globals
-    globals->begin_observe_counter = 0;
-    globals->exec_complete_counter = 0;
     globals->particle_id = 0;
     globals->log_marginal_likelihood = 0.0;
+    globals->num_observes = 0;
+    globals->observes = NULL;
+    globals->frontier.value = 0;
+    globals->observe_count_mismatch = false;
+    globals->num_finished = 0;
+    globals->log_final_weight_sum = 0.0;
+    sync_schedule_init(&globals->schedule, &SYNC_POLICY);
+}
+
+
+/**
+ * Asynchronous mode: count the synchronizing observes in a prerun, and set up
+ * the per-observe statistics
+ *
+ */
+static void init_async(int (*f)(int, char**), int argc, char **argv) {
+    pid_t prerun_pid = fork();
+    if (prerun_pid == 0) {
+        IS_PRERUN = true;
+        f(argc, argv);
+        _exit(0);
+    } else if (prerun_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    waitpid(prerun_pid, NULL, 0);
+    NUM_OBSERVES = globals->num_observes;
+    debug_print(1, "Program has %d observe statements\n", NUM_OBSERVES);
+
+    globals->observes = (async_observe *)shared_memory_alloc((NUM_OBSERVES+1)*sizeof(async_observe));
+    for (int i=0; i<=NUM_OBSERVES; i++) {
+        init_shared_mutex(&globals->observes[i].mutex, NULL);
+        globals->observes[i].arrived = 0;
+        globals->observes[i].offspring = 0;
+    }
+    init_shared_mutex(&globals->frontier_mutex, NULL);
 }
 
 
@@ -398,14 +591,11 @@ void init_globals() {
  */
 int infer(int (*f)(int, char**), int argc, char **argv) {
 
-fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/probc/fork.csv", "w");
-
     pid_t main_pid = getpid();
     debug_print(1, "Main process pid: %d\n", main_pid);
 
     // Initialize random number generators
-    erp_rng_init();
-    if (INITIAL_SEED >= 0) set_rng_seed(INITIAL_SEED);
+    erp_rng_init(INITIAL_SEED);
 
     // Create shared globals
     init_globals();
@@ -416,10 +606,29 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/probc/fork.csv", "w");
     locals->live_offspring_count = 0;
     locals->log_likelihood = 0;
     locals->log_weight = 0;
-	utstring_new(locals->predict);
+    locals->sync_index = 0;
+    locals->force_sync = false;
+	locals->predict = predict_buffer_new();
+
+    // Asynchronous mode has no final resampling step, so its output is weighted
+    if (ASYNC) {
+        init_async(f, argc, argv);
+        WEIGHTED_OUTPUT = true;
+    }
+
+    // Orphaned particles are collected here, so particles need not wait for their children
+    reaper_init();
+
+    // With --output_format=bin, particle output is spooled for the sample file;
+    // with --aggregate, it is summarized in shared memory instead
+    sample_file_open();
+    aggregate_init();
+
+    // Particles hand their output to a collector thread, rather than each writing it out
+    output_ring_init(OUTPUT_RING_BYTES);
 
     // Get memory required for struct
-    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + sizeof(int));
+    int mem_size = sizeof(shared_globals) + NUM_PARTICLES*(sizeof(double) + 2*sizeof(int));
     debug_print(1, "Shared memory size: %d bytes\n", mem_size);
 
     // Start timer
@@ -434,77 +643,80 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/probc/fork.csv", "w");
     locals->current_observe = 0;
     globals->current_observe = 0;
 
-    globals->exec_complete_counter = 0;
-
     for (int i=0; i<NUM_PARTICLES; i++) {
         // We need to set each particle with a distinct random number seed
         unsigned long int seed = gen_new_rng_seed();
 
         // Fork and run
-        start = clock();
+        uint64_t fork_start = profile_clock();
         pid_t child_pid = fork();
-        end = clock();
         if (child_pid == 0) {
 
             // Child process: run program
             locals->live_offspring_count = 0;
+            locals->particle_index = i;
             debug_print(4,"new child rng seed: %ld\n", seed);
             set_rng_seed(seed);
 
             debug_print(4,"[%d -> %d]\n", main_pid, getpid());
 
+            profile_user_resume();
             f(argc, argv);
+            profile_user_pause();
 
-            if (ESTIMATE_MARGINAL_LIKELIHOOD) {
-                globals->log_marginal_likelihood += log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
+            if (ASYNC && locals->current_observe != NUM_OBSERVES) {
+                abort_async();
             }
 
+            // Evidence: the mean final weight, over the N initial particles. Taken
+            // before the final resampling; added in by the root once all are done.
+            pthread_mutex_lock(&globals->particle_id_mutex);
+            if (globals->num_finished++ == 0) {
+                globals->log_final_weight_sum = locals->log_weight;
+                // Every particle saw the same number of synchronizing observes
+                if (!ASYNC) globals->num_observes = locals->sync_index;
+            } else {
+                globals->log_final_weight_sum = log_sum_exp((double[2]){ globals->log_final_weight_sum, locals->log_weight }, 2);
+            }
+            pthread_mutex_unlock(&globals->particle_id_mutex);
+
             if (!WEIGHTED_OUTPUT) {
-                observe(0); // "dummy" observe to mark end of program.
+                // "dummy" observe to mark end of program; always a barrier, as we resample
+                locals->force_sync = true;
+                observe(0);
 
                 double excess_weight = log_sum_exp(globals->log_weights, NUM_PARTICLES) - log(NUM_PARTICLES);
                 if (excess_weight > 0) {
-                    multinomial_resample();
+                    resample();
                 }
-                flush_output(&globals->stdout_mutex, locals->predict);
+                flush_predicts(&globals->stdout_mutex, locals->predict);
             } else {
 
                 UT_string *tmp_output;
                 utstring_new(tmp_output);
-                int ix_left = 0;
-                int ix_right = 0;
 
                 pthread_mutex_lock(&globals->particle_id_mutex);
                 int particle_id = globals->particle_id;
                 globals->particle_id++;
-                while ((ix_right = utstring_find(locals->predict, ix_left, "\n", 1)) >= 0) {
-                    //printf("next newline at %d\n", ix_right);
-                    //printf("len: %d\n", ix_right - ix_left);
-                    utstring_printf(tmp_output, "%.*s,%f,%d\n", ix_right - ix_left, &utstring_body(locals->predict)[ix_left], locals->log_weight, particle_id);
-                    ix_left = ix_right + 1;
-                }
                 pthread_mutex_unlock(&globals->particle_id_mutex);
+                format_weighted_predicts(locals->predict, tmp_output, locals->log_weight, particle_id);
                 flush_output(&globals->stdout_mutex, tmp_output);
                 utstring_free(tmp_output);
             }
 
-            cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+            reaper_release_children(&locals->live_offspring_count);
 
-            pthread_mutex_lock(&globals->exec_complete_mutex);
-            globals->exec_complete_counter++;
-            if (globals->exec_complete_counter == NUM_PARTICLES) {
-                pthread_cond_broadcast(&globals->exec_complete_cond);
-            }
-            pthread_mutex_unlock(&globals->exec_complete_mutex);
+            if (!ASYNC) shared_latch_count_down(&globals->exec_complete);
 
             destroy_particle();
         } else if (child_pid < 0) {
             // Error
             perror("fork");
-            utstring_free(locals->predict);
+            predict_buffer_free(locals->predict);
             exit(1);
         } else {
-         fprintf(fp, "%lu, ", (end - start));
+            profile_end(PROFILE_FORK, fork_start);
+            reaper_track(child_pid);
             locals->live_offspring_count++;
         }
 
@@ -512,16 +724,27 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/probc/fork.csv", "w");
         assert(child_pid > 0);
     }
 
-    pthread_mutex_lock(&globals->exec_complete_mutex);
-    while (globals->exec_complete_counter < NUM_PARTICLES) {
-        debug_print(2, "Blocking on exec complete cond in main process: %d of %d complete\n", globals->exec_complete_counter, NUM_PARTICLES);
-        pthread_cond_wait(&globals->exec_complete_cond, &globals->exec_complete_mutex);
-    }
-    pthread_mutex_unlock(&globals->exec_complete_mutex);
-
-    // Collect terminated child processes
+    // Collect terminated particles as they finish: our own children, and any
+    // orphaned descendants. Once there are none left, every particle is done.
     debug_print(4,"Done launching particles -- waiting for %d of them to finish\n", locals->live_offspring_count);
-    cleanup_children(locals->live_offspring_count, &locals->live_offspring_count);
+    reaper_wait_all(&locals->live_offspring_count);
+
+    debug_print(2, "Blocking on exec complete latch in main process: %d particles\n", NUM_PARTICLES);
+    if (!ASYNC) shared_latch_wait(&globals->exec_complete);
+    output_ring_close();
+    sample_file_close();
+    aggregate_print(stdout, 0);
+
+    if (ASYNC) {
+        if (globals->observe_count_mismatch) {
+            fprintf(stderr, "smc: particles disagree on the number of synchronizing observes\n");
+            exit(1);
+        }
+        debug_print(1, "Asynchronous SMC: %d particles at the end\n", globals->num_finished);
+        globals->log_marginal_likelihood = (globals->num_finished > 0) ? globals->log_final_weight_sum - log(NUM_PARTICLES) : -INFINITY;
+    } else {
+        globals->log_marginal_likelihood += globals->log_final_weight_sum - log(NUM_PARTICLES);
+    }
 
     // Print out timing info
     if (TIME_EXECUTION) print_walltime(&globals->stdout_mutex, 1, &start_time);
@@ -534,7 +757,29 @@ fp = fopen("/Users/kai/Turing/exps/aistats2017/exp1/probc/fork.csv", "w");
         pthread_mutex_unlock(&globals->stdout_mutex);
     }
 
-    utstring_free(locals->predict);
+    // Report how many synchronizing observes were actually barriers. Without a
+    // final barrier, the leaders' count stops at the last one held.
+    if (WEIGHTED_OUTPUT && !ASYNC) globals->schedule.observes = globals->num_observes;
+    if (SYNC_POLICY.type != SYNC_ALWAYS && !ASYNC) sync_schedule_print_stats(&globals->schedule, &SYNC_POLICY, stderr);
+
+    // Report how far the asynchronous population strayed from -p
+    if (ASYNC) {
+        int smallest = NUM_PARTICLES, largest = NUM_PARTICLES;
+        for (int i=0; i<NUM_OBSERVES; i++) {
+            if (globals->observes[i].arrived < smallest) smallest = globals->observes[i].arrived;
+            if (globals->observes[i].arrived > largest) largest = globals->observes[i].arrived;
+        }
+        fprintf(stderr, "async population (max lag %d): min %d, max %d over %d observes, %d at the end\n",
+                MAX_LAG, smallest, largest, NUM_OBSERVES, globals->num_finished);
+    }
+
+    // Report how much fork latency the zygote pool hid
+    if (ZYGOTES > 0) zygote_pool_print_stats(&globals->zygotes, stderr);
+
+    // Report process counts
+    if (DEBUG_LEVEL >= 1) reaper_print_stats(stderr);
+
+    predict_buffer_free(locals->predict);
     return 0;
 }
 
@@ -547,11 +792,21 @@ void parse_args(int argc, char **argv) {
         {"timeit", no_argument, 0, 't'},
         {"weighted", no_argument, 0, 'w'},
         {"evidence", no_argument, 0, 'e'},
-        {"rng_seed", required_argument, 0, 'r'}
+        {"rng_seed", required_argument, 0, 'r'},
+        {"resampler", required_argument, 0, 'R'},
+        {"barrier_fanout", required_argument, 0, 'b'},
+        {"zygotes", required_argument, 0, 'z'},
+        {"async", no_argument, 0, 'a'},
+        {"max_lag", required_argument, 0, 'L'},
+        {"sync_policy", required_argument, 0, 's'},
+        {"output_format", required_argument, 0, 'o'},
+        {"output_file", required_argument, 0, 'O'},
+        {"aggregate", optional_argument, 0, 'A'},
+        {0, 0, 0, 0}
     };
     int c, option_index;
 
-    while((c = getopt_long(argc, argv, "p:twer:", long_options, &option_index)) != -1) {
+    while((c = getopt_long(argc, argv, "p:twer:R:b:z:aL:s:o:O:A::", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 NUM_PARTICLES = atoi(optarg);
@@ -568,8 +823,45 @@ void parse_args(int argc, char **argv) {
             case 'r':
                 INITIAL_SEED = atol(optarg);
                 break;
+            case 'o':
+                if (!sample_file_set_format(optarg)) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                sample_file_set_path(optarg);
+                break;
+            case 'A':
+                aggregate_enable((optarg != NULL) ? atoi(optarg) : 0);
+                break;
+            case 'R':
+                if (!resampler_from_name(optarg, &RESAMPLER)) {
+                    fprintf(stderr, "Unknown resampler: %s (multinomial, stratified or systematic; residual is the same as systematic)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                BARRIER_FANOUT = atoi(optarg);
+                break;
+            case 'z':
+                ZYGOTES = atoi(optarg);
+                break;
+            case 'a':
+                ASYNC = true;
+                break;
+            case 'L':
+                ASYNC = true;
+                MAX_LAG = atoi(optarg);
+                break;
+            case 's':
+                if (!sync_policy_from_name(optarg, &SYNC_POLICY)) {
+                    fprintf(stderr, "Unknown sync policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
         }
     }
 
-    debug_print(1, "Running SMC with %d particles\n", NUM_PARTICLES);
+    debug_print(1, "Running SMC with %d particles (%s resampling)\n", NUM_PARTICLES, resampler_name(RESAMPLER));
 }
@@ -0,0 +1,86 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sync-policy.h"
+
+// Longest run of skipped observes for the ESS-driven policy, unless given
+#define DEFAULT_MAX_GAP 32
+
+
+bool sync_policy_from_name(const char *name, sync_policy *policy) {
+    const char *dash = strchr(name, '-');
+    size_t length = dash ? (size_t)(dash - name) : strlen(name);
+    int k = dash ? atoi(dash + 1) : 0;
+    if (dash && k < 1) return false;
+
+    if (strncmp(name, "always", length) == 0 && length == 6 && !dash) {
+        *policy = (sync_policy) { SYNC_ALWAYS, 1 };
+    } else if (strncmp(name, "every", length) == 0 && length == 5 && dash) {
+        *policy = (sync_policy) { SYNC_EVERY, k };
+    } else if (strncmp(name, "ess", length) == 0 && length == 3) {
+        *policy = (sync_policy) { SYNC_ESS, dash ? k : DEFAULT_MAX_GAP };
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+void sync_schedule_init(sync_schedule *schedule, const sync_policy *policy) {
+    sync_schedule_restart(schedule, policy);
+    schedule->barriers = 0;
+    schedule->observes = 0;
+}
+
+void sync_schedule_restart(sync_schedule *schedule, const sync_policy *policy) {
+    // The ESS policy needs a first measurement, so starts with a barrier
+    schedule->next_barrier = (policy->type == SYNC_EVERY) ? policy->k - 1 : 0;
+    schedule->last_barrier = -1;
+    schedule->last_ess = 1.0;
+}
+
+
+void sync_schedule_update(sync_schedule *schedule, const sync_policy *policy, double tau,
+                          int observe_index, double ess_fraction, bool resampled) {
+    schedule->barriers++;
+    schedule->observes += observe_index - schedule->last_barrier;
+    int gap = 1;
+
+    switch (policy->type) {
+        case SYNC_ALWAYS:
+            break;
+        case SYNC_EVERY:
+            gap = policy->k;
+            break;
+        case SYNC_ESS: {
+            // Geometric decay of the ESS per observe over the last segment,
+            // extrapolated to where it would fall below tau
+            double post_ess = resampled ? 1.0 : ess_fraction;
+            int elapsed = observe_index - schedule->last_barrier;
+            double decay = pow(ess_fraction / schedule->last_ess, 1.0 / elapsed);
+            gap = policy->k;
+            if (decay < 1.0 && post_ess > tau) {
+                double predicted = floor(log(tau / post_ess) / log(decay));
+                if (predicted < gap) gap = (predicted < 1) ? 1 : (int)predicted;
+            } else if (decay < 1.0) {
+                gap = 1;
+            }
+            schedule->last_ess = post_ess;
+            break;
+        }
+    }
+    schedule->last_barrier = observe_index;
+    schedule->next_barrier = observe_index + gap;
+}
+
+
+void sync_schedule_print_stats(const sync_schedule *schedule, const sync_policy *policy, FILE *stream) {
+    const char *names[] = { "always", "every-", "ess-" };
+    char k[16] = "";
+    if (policy->type != SYNC_ALWAYS) snprintf(k, sizeof(k), "%d", policy->k);
+    fprintf(stream, "sync policy %s%s: %d barriers for %d synchronizing observes (%.1f%% skipped)\n",
+            names[policy->type], k, schedule->barriers, schedule->observes,
+            (schedule->observes > 0) ? 100.0*(schedule->observes - schedule->barriers)/schedule->observes : 0.0);
+}
@@ -0,0 +1,87 @@
+#ifndef __SYNC_POLICY__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ *
+ * Runtime schedule of observe barriers.
+ *
+ * A program marks observes which may synchronize (weight_trace(ln_p, true));
+ * the policy decides which of these actually become barriers, where the
+ * population waits and resamples. The others only add to the particle's weight.
+ *
+ *  - always:   every synchronizing observe is a barrier (the default)
+ *  - every-k:  every k-th synchronizing observe is a barrier
+ *  - ess[-k]:  at each barrier, measure how fast the ESS decayed per observe
+ *              since the previous one, and place the next barrier where it is
+ *              predicted to cross the resampling threshold (at most k observes
+ *              later, default 32). Where weights barely change, most observes
+ *              are skipped.
+ *
+ * Every particle must agree on which observes are barriers, so the schedule
+ * lives in shared memory and only changes at a barrier (by its leader).
+ * A final observe, e.g. the "dummy" one before unweighted output, can always
+ * be forced to be a barrier.
+ *
+ */
+
+typedef enum {
+    SYNC_ALWAYS,
+    SYNC_EVERY,
+    SYNC_ESS
+} sync_policy_type;
+
+typedef struct {
+    sync_policy_type type;
+    int k;
+} sync_policy;
+
+typedef struct {
+    int next_barrier;       // index of the next synchronizing observe which is a barrier
+    int last_barrier;       // index of the previous barrier (-1 before the first)
+    double last_ess;        // ESS fraction at the start of the current segment
+    int barriers;           // statistics: barriers held ...
+    int observes;           // ... out of this many synchronizing observes (up to the last barrier)
+} sync_schedule;
+
+
+/**
+ * Parse a policy name ("always", "every-5", "ess", "ess-64");
+ * returns false if unrecognized
+ *
+ */
+bool sync_policy_from_name(const char *name, sync_policy *policy);
+
+/**
+ * Reset the schedule and its statistics; or just the schedule, at the start
+ * of a new SMC sweep
+ *
+ */
+void sync_schedule_init(sync_schedule *schedule, const sync_policy *policy);
+void sync_schedule_restart(sync_schedule *schedule, const sync_policy *policy);
+
+/**
+ * Whether the synchronizing observe with (0-based) index observe_index is a barrier
+ *
+ */
+static inline bool sync_schedule_is_barrier(const sync_schedule *schedule, int observe_index) {
+    return observe_index >= schedule->next_barrier;
+}
+
+/**
+ * Called by the barrier leader, after computing the ESS (as a fraction of the
+ * population) and deciding whether to resample against threshold tau
+ *
+ */
+void sync_schedule_update(sync_schedule *schedule, const sync_policy *policy, double tau,
+                          int observe_index, double ess_fraction, bool resampled);
+
+/**
+ * Print the number of barriers held, out of the number of synchronizing observes
+ *
+ */
+void sync_schedule_print_stats(const sync_schedule *schedule, const sync_policy *policy, FILE *stream);
+
+#define __SYNC_POLICY__
+#endif
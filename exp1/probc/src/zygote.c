@@ -0,0 +1,294 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // clone flags
+#endif
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "erp.h"
+#include "engine-shared.h"
+#include "reaper.h"
+#include "zygote.h"
+#include "profile.h"
+
+
+// Discarded standbys not yet reaped by this process (process-local)
+static pid_t *discarded_pids = NULL;
+static int num_discarded = 0;
+
+
+static long elapsed_ns(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec)*1000000000L + (end.tv_nsec - start->tv_nsec);
+}
+
+static inline void add_stat(long *counter, long value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline int load_state(zygote *z) {
+    return __atomic_load_n(&z->state.value, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_state(zygote *z, int state) {
+    __atomic_store_n(&z->state.value, state, __ATOMIC_RELEASE);
+}
+
+
+void zygote_pool_init(zygote_pool *pool, int max_particles, int size, double resample_threshold) {
+    pool->size = (size > 0) ? size : 0;
+    pool->max_particles = max_particles;
+    pool->resample_threshold = resample_threshold;
+    pool->table = NULL;
+    if (pool->size > 0) {
+        pool->table = (zygote *)shared_memory_alloc(max_particles*pool->size*sizeof(zygote));
+        for (int i=0; i<max_particles*pool->size; i++) {
+            store_state(&pool->table[i], ZYGOTE_EMPTY);
+        }
+    }
+    pool->stats = (zygote_stats *)shared_memory_alloc(sizeof(zygote_stats));
+    *pool->stats = (zygote_stats) { 0 };
+    // A guess, until the first observe which resamples
+    pool->budget = (zygote_budget *)shared_memory_alloc(sizeof(zygote_budget));
+    pool->budget->demand = (max_particles + 1) / 2;
+    pool->budget->remaining = pool->budget->demand;
+    init_shared_mutex(&pool->budget->mutex, NULL);
+    pool->budget->arrived = 0;
+    pool->budget->step = 0;
+    discarded_pids = realloc(discarded_pids, (pool->size + 1)*sizeof(pid_t));
+    num_discarded = 0;
+}
+
+
+/**
+ * Body of a standby: park until the parent decides what to do with us.
+ * Either way, the standby hands its table entry back (EMPTY) once it has
+ * seen the decision, so the parent never has to wait for it.
+ *
+ */
+static void standby(zygote *z, unsigned long *seed, int *new_slot) {
+    int state;
+    while ((state = load_state(z)) == ZYGOTE_STANDBY) {
+        shared_futex_wait(&z->state.value, ZYGOTE_STANDBY);
+    }
+    if (state == ZYGOTE_DISCARD) {
+        store_state(z, ZYGOTE_EMPTY);
+        _exit(0);
+    }
+    assert(state == ZYGOTE_ACTIVE);
+    *seed = z->seed;
+    *new_slot = z->slot;
+    num_discarded = 0;
+    store_state(z, ZYGOTE_EMPTY);
+}
+
+void zygote_pool_plan(zygote_pool *pool, const int *n_offspring, int count) {
+    int demand = 0;
+    for (int i=0; i<count; i++) {
+        if (n_offspring[i] > 1) demand += n_offspring[i] - 1;
+    }
+    // Observes which do not resample request nothing, but say nothing about the next one which does
+    if (demand > 0) pool->budget->demand = demand;
+    pool->budget->step++;
+    __atomic_store_n(&pool->budget->remaining, pool->budget->demand, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&pool->budget->mutex);
+    pool->budget->arrived = 0;
+    pthread_mutex_unlock(&pool->budget->mutex);
+}
+
+bool zygote_pool_fill(zygote_pool *pool, int slot, double log_weight, shared_barrier *barrier, int sense,
+                      int *live_offspring_count, unsigned long *seed, int *new_slot) {
+    if (pool->size == 0) return false;
+
+    // Estimate the ESS and our expected offspring count from the particles which
+    // got here first. (A particle late enough to get here after zygote_pool_plan
+    // counts towards the next observe; this only steers pre-forking.)
+    zygote_budget *budget = pool->budget;
+    pthread_mutex_lock(&budget->mutex);
+    if (budget->arrived == 0) {
+        budget->log_sum_weight = log_weight;
+        budget->log_sum_weight2 = 2*log_weight;
+    } else {
+        budget->log_sum_weight = log_sum_exp((double[2]){ budget->log_sum_weight, log_weight }, 2);
+        budget->log_sum_weight2 = log_sum_exp((double[2]){ budget->log_sum_weight2, 2*log_weight }, 2);
+    }
+    budget->arrived++;
+    const double ess = exp(2*budget->log_sum_weight - budget->log_sum_weight2);
+    const double expected = exp(log_weight - budget->log_sum_weight + log(budget->arrived));
+    const bool resampling = ess < pool->resample_threshold * budget->arrived;
+    pthread_mutex_unlock(&budget->mutex);
+    if (!resampling) return false;
+    const int wanted = (expected < pool->size + 1) ? (int)ceil(expected) - 1 : pool->size;
+
+    for (int j=0; j<wanted; j++) {
+        zygote *z = &pool->table[slot*pool->size + j];
+        if (shared_barrier_released(barrier, sense)) break;
+        if (load_state(z) != ZYGOTE_EMPTY) continue;
+        if (__atomic_sub_fetch(&pool->budget->remaining, 1, __ATOMIC_ACQ_REL) < 0) break;
+
+        store_state(z, ZYGOTE_STANDBY);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t child_pid = fork();
+        if (child_pid == 0) {
+            standby(z, seed, new_slot);
+            return true;
+        } else if (child_pid > 0) {
+            long ns = elapsed_ns(&start);
+            profile_record(PROFILE_FORK, ns);
+            add_stat(&pool->stats->standby_fork_ns, ns);
+            add_stat(&pool->stats->standby_forks, 1);
+            z->pid = child_pid;
+            (*live_offspring_count)++;
+        } else {
+            // Most likely the process table is full; just skip pre-forking
+            store_state(z, ZYGOTE_EMPTY);
+            break;
+        }
+    }
+    return false;
+}
+
+int zygote_pool_activate(zygote_pool *pool, int slot, int count, int last_slot) {
+    int activated = 0;
+    for (int j=0; j<pool->size && activated<count; j++) {
+        zygote *z = &pool->table[slot*pool->size + j];
+        if (load_state(z) != ZYGOTE_STANDBY) continue;
+        z->slot = last_slot - activated;
+        z->seed = gen_offspring_rng_seed(pool->budget->step, z->slot);
+        store_state(z, ZYGOTE_ACTIVE);
+        shared_futex_wake_all(&z->state.value);
+        activated++;
+    }
+    add_stat(&pool->stats->requests, count);
+    add_stat(&pool->stats->hits, activated);
+    return activated;
+}
+
+void zygote_pool_discard(zygote_pool *pool, int slot) {
+    num_discarded = 0;
+    for (int j=0; j<pool->size; j++) {
+        zygote *z = &pool->table[slot*pool->size + j];
+        if (load_state(z) != ZYGOTE_STANDBY) continue;
+        discarded_pids[num_discarded++] = z->pid;
+        store_state(z, ZYGOTE_DISCARD);
+        shared_futex_wake_all(&z->state.value);
+    }
+    add_stat(&pool->stats->discarded, num_discarded);
+}
+
+void zygote_pool_reap(int *live_offspring_count) {
+    uint64_t start = profile_clock();
+    for (int i=0; i<num_discarded; i++) {
+        if (waitpid(discarded_pids[i], NULL, 0) == discarded_pids[i]) {
+            (*live_offspring_count)--;
+            reaper_note_reaped(1);
+        }
+    }
+    num_discarded = 0;
+    profile_end(PROFILE_REAP, start);
+}
+
+
+/**
+ * fork(), or with sibling set, a fork whose child shares our parent
+ *
+ */
+static pid_t timed_fork(zygote_pool *pool, bool sibling) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef __linux__
+    // With no new stack, clone behaves as fork does. This is only safe because
+    // particles are single-threaded: unlike fork(), a raw clone takes none of
+    // libc's locks first, so a lock held by another thread would stay held in
+    // the child; nor does it run the atfork handlers, hence run_fork_hooks.
+    pid_t child_pid = sibling ? syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL) : fork();
+#else
+    assert(!sibling);
+    pid_t child_pid = fork();
+#endif
+    if (child_pid == 0) {
+        num_discarded = 0;
+        // fork() runs the fork hooks itself, through pthread_atfork
+        if (sibling) run_fork_hooks();
+    } else if (child_pid > 0) {
+        long ns = elapsed_ns(&start);
+        profile_record(PROFILE_FORK, ns);
+        add_stat(&pool->stats->sync_fork_ns, ns);
+        add_stat(&pool->stats->sync_forks, 1);
+    }
+    return child_pid;
+}
+
+pid_t zygote_pool_fork(zygote_pool *pool) {
+    return timed_fork(pool, false);
+}
+
+/**
+ * Body of zygote_pool_fork_tree; without seed_by_slot, each process seeds the
+ * children it forks from its own stream instead
+ *
+ */
+static int fork_tree(zygote_pool *pool, int first_slot, int count, int *live_offspring_count, bool seed_by_slot) {
+#ifdef __linux__
+    const bool use_tree = true;
+#else
+    const bool use_tree = false;
+#endif
+    // [lo, hi) are the slots this process has yet to fork; forks from inside
+    // the tree are siblings, so only the caller counts them
+    int lo = first_slot, hi = first_slot + count;
+    bool is_caller = true;
+    int slot = -1;
+    while (lo < hi) {
+        int mid = use_tree ? lo + (hi - lo)/2 : hi - 1;
+        unsigned long seed = seed_by_slot ? gen_offspring_rng_seed(pool->budget->step, mid) : gen_new_rng_seed();
+        pid_t child_pid = timed_fork(pool, !is_caller);
+        if (child_pid == 0) {
+            set_rng_seed(seed);
+            *live_offspring_count = 0;
+            is_caller = false;
+            slot = mid;
+            lo = mid + 1;
+            if (!use_tree) break;
+        } else if (child_pid > 0) {
+            hi = mid;
+        } else {
+            // Most likely the process table is full; wait a second, then retry
+            perror("fork");
+            sleep(1);
+        }
+    }
+    if (is_caller) *live_offspring_count += count;
+    return slot;
+}
+
+int zygote_pool_fork_tree(zygote_pool *pool, int first_slot, int count, int *live_offspring_count) {
+    return fork_tree(pool, first_slot, count, live_offspring_count, true);
+}
+
+bool zygote_pool_fork_offspring(zygote_pool *pool, int count, int *live_offspring_count) {
+    return fork_tree(pool, 0, count, live_offspring_count, false) >= 0;
+}
+
+
+void zygote_pool_print_stats(zygote_pool *pool, FILE *stream) {
+    zygote_stats *s = pool->stats;
+    fprintf(stream, "zygote pool: size %d, %ld children requested, %ld hits (%.1f%%), %ld standbys discarded\n",
+            pool->size, s->requests, s->hits, (s->requests > 0) ? 100.0*s->hits/s->requests : 0.0, s->discarded);
+    fprintf(stream, "zygote pool: %ld forks on critical path (%.3f ms, mean %.1f us), %ld hidden behind barrier (%.3f ms, mean %.1f us)\n",
+            s->sync_forks, s->sync_fork_ns*1e-6, (s->sync_forks > 0) ? s->sync_fork_ns*1e-3/s->sync_forks : 0.0,
+            s->standby_forks, s->standby_fork_ns*1e-6, (s->standby_forks > 0) ? s->standby_fork_ns*1e-3/s->standby_forks : 0.0);
+}
@@ -0,0 +1,178 @@
+#ifndef __ZYGOTE__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "barrier.h"
+
+/**
+ *
+ * Pre-forked particle zygote pool.
+ *
+ * Without it, a particle which draws n offspring at an observe forks them one
+ * after another once resampling is done, while the rest of the population waits
+ * at end_observe. With a pool, particles which are idle at the begin_observe
+ * barrier speculatively fork up to `size` standby children ("zygotes"), which
+ * park on a futex in shared memory. Once the offspring counts are known, the
+ * parent activates standbys (handing each a slot index and a seed for it) before
+ * forking any more, and discards the ones it does not need.
+ *
+ * A standby is an exact copy of its parent at the barrier, so once activated
+ * it simply continues from there, just like a child forked after resampling.
+ *
+ * Only a fraction of the particles branch at any observe, so standbys are only
+ * forked where they are likely to be needed. Running sums of the weights of the
+ * particles which have reached the barrier so far give an estimate of the ESS:
+ * if the engine would not resample at that ESS, no standbys are forked.
+ * Otherwise a particle expects about w / w_avg offspring, and pre-forks one
+ * fewer than that (rounding up). All particles also draw on a shared budget of
+ * standbys per observe, sized by the number of children requested at the last
+ * observe which resampled (and by half the population until one has).
+ *
+ */
+
+typedef enum {
+    ZYGOTE_EMPTY = 0,
+    ZYGOTE_STANDBY,
+    ZYGOTE_ACTIVE,
+    ZYGOTE_DISCARD
+} zygote_state;
+
+typedef struct {
+    padded_counter state;
+    pid_t pid;
+    int slot;
+    unsigned long seed;
+} zygote;
+
+/**
+ * Pool statistics, accumulated across all processes in shared memory
+ *
+ */
+typedef struct {
+    long requests;          // children needed after resampling
+    long hits;              // ... served by an activated standby
+    long discarded;         // standbys forked but not needed
+    long sync_forks;        // forks on the critical path
+    long sync_fork_ns;      // wall time spent in those forks
+    long standby_forks;     // speculative forks while waiting at the barrier
+    long standby_fork_ns;   // wall time spent in those (hidden) forks
+} zygote_stats;
+
+/**
+ * Standby budget, in shared memory
+ *
+ */
+typedef struct {
+    int demand;             // children requested at the last observe which resampled
+    int remaining;          // standbys which may still be forked at this observe
+    pthread_mutex_t mutex;  // guards the running sums below
+    int arrived;            // particles which have called zygote_pool_fill at this observe
+    double log_sum_weight;  // ... the log of the sum of their weights
+    double log_sum_weight2; // ... and of the sum of their squares
+    unsigned long step;     // resampling steps planned so far, to seed offspring by
+} zygote_budget;
+
+typedef struct {
+    int size;
+    int max_particles;
+    double resample_threshold;
+    zygote *table;
+    zygote_stats *stats;
+    zygote_budget *budget;
+} zygote_pool;
+
+
+/**
+ * Allocate a pool in shared memory with `size` standbys per particle slot.
+ * A size of 0 disables pre-forking; zygote_pool_fork still records stats.
+ * The engine resamples when the ESS falls below resample_threshold times the
+ * number of particles (INFINITY if it always resamples).
+ *
+ */
+void zygote_pool_init(zygote_pool *pool, int max_particles, int size, double resample_threshold);
+
+/**
+ * Called by the barrier leader once the offspring counts n_offspring[0..count-1]
+ * are known, before releasing the barrier: sets the standby budget for the next
+ * observe from the number of children they request, and starts a new step for
+ * the seeds of offspring.
+ *
+ */
+void zygote_pool_plan(zygote_pool *pool, const int *n_offspring, int count);
+
+/**
+ * Called by a particle waiting at an observe barrier, from its (pre-resampling)
+ * slot and with its log weight: fork standbys until it has as many as it
+ * expects to need, the budget for this observe is spent, or the barrier is
+ * released. Each fork is added to *live_offspring_count.
+ *
+ * Returns false in the parent. Returns true in a standby which has been
+ * activated, once the barrier has been released; *seed and *new_slot then hold
+ * the values assigned by the parent. Discarded standbys exit.
+ *
+ */
+bool zygote_pool_fill(zygote_pool *pool, int slot, double log_weight, shared_barrier *barrier, int sense,
+                      int *live_offspring_count, unsigned long *seed, int *new_slot);
+
+/**
+ * Activate up to `count` standbys belonging to `slot`, assigning them slots
+ * last_slot, last_slot-1, ... and seeds from gen_offspring_rng_seed(), for the
+ * current step and their new slot.
+ * Returns the number activated; the caller forks the remainder.
+ *
+ */
+int zygote_pool_activate(zygote_pool *pool, int slot, int count, int last_slot);
+
+/**
+ * Tell any standbys of `slot` which were not activated to exit. They stay
+ * counted as live offspring until reaped, either by zygote_pool_reap (off the
+ * critical path, after the end_observe count-down) or by cleanup_children.
+ *
+ */
+void zygote_pool_discard(zygote_pool *pool, int slot);
+void zygote_pool_reap(int *live_offspring_count);
+
+/**
+ * fork(), recording its latency as a critical-path fork.
+ *
+ */
+pid_t zygote_pool_fork(zygote_pool *pool);
+
+/**
+ * Fork `count` new particles, taking slots first_slot, ..., first_slot+count-1,
+ * as a binary tree: the caller forks a child which takes the upper half of the
+ * slots and goes on to fork that half itself, while the caller splits the lower
+ * half, and so on. The last particle exists after O(log count) fork latencies,
+ * rather than after `count` of them.
+ *
+ * On Linux the tree is built with clone(CLONE_PARENT), so every new particle is
+ * still a direct child of the caller, which reaps them as before: the caller's
+ * *live_offspring_count goes up by `count`. Elsewhere the caller forks them all.
+ *
+ * Returns -1 in the caller. In a new particle, returns its slot, after seeding
+ * its RNG from the current step and the slot, and setting *live_offspring_count
+ * to 0. So a particle's stream depends neither on the shape of the tree, nor on
+ * how many standbys were activated instead.
+ *
+ */
+int zygote_pool_fork_tree(zygote_pool *pool, int first_slot, int count, int *live_offspring_count);
+
+/**
+ * zygote_pool_fork_tree, for engines which do not assign slots (asynchronous
+ * smc): each new particle is seeded from the stream of the process which forks
+ * it, so is not reproducible. Returns true in a new particle.
+ *
+ */
+bool zygote_pool_fork_offspring(zygote_pool *pool, int count, int *live_offspring_count);
+
+/**
+ * Print hit rate and fork latency summary
+ *
+ */
+void zygote_pool_print_stats(zygote_pool *pool, FILE *stream);
+
+#define __ZYGOTE__
+#endif
@@ -0,0 +1,255 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "uthash.h"
+#include "sample-reader.h"
+
+/**
+ *
+ * Collate weighted output (e.g. from cascade, or any engine with -w) into
+ * normalized per-identifier distributions: for every `name,value` seen, print
+ *
+ *   name,value,probability
+ *
+ * where probability is the total weight of rows with that name and value,
+ * over the total weight of rows with that name. Rows are `name,value,log_weight[,...]`;
+ * others (e.g. time_elapsed lines with no weight) are skipped.
+ *
+ * Usage: collate-weights [-j THREADS] [FILE ...]
+ *
+ * With no files (or "-") it streams stdin in a single pass. Files are mmap'd
+ * and split between threads, whose tables are merged at the end. Binary
+ * sample files (--output_format=bin) are read through sample-reader.h.
+ *
+ */
+
+typedef struct {
+    char *key;              // "name,value"
+    int name_length;
+    double log_weight;
+    UT_hash_handle hh;
+} entry;
+
+typedef struct {
+    entry *entries;         // in order of first appearance
+    const char *begin;
+    const char *end;
+    pthread_t thread;
+} table;
+
+
+static inline double log_add(double a, double b) {
+    return (a > b) ? a + log1p(exp(b - a)) : b + log1p(exp(a - b));
+}
+
+static void add(table *t, const char *key, size_t key_length, size_t name_length, double log_weight) {
+    entry *e;
+    HASH_FIND(hh, t->entries, key, key_length, e);
+    if (e == NULL) {
+        e = malloc(sizeof(entry));
+        e->key = strndup(key, key_length);
+        e->name_length = name_length;
+        e->log_weight = log_weight;
+        HASH_ADD_KEYPTR(hh, t->entries, e->key, key_length, e);
+    } else {
+        e->log_weight = log_add(e->log_weight, log_weight);
+    }
+}
+
+/**
+ * Add one `name,value,log_weight[,...]` line (without its newline)
+ *
+ */
+static void add_line(table *t, const char *line, size_t length) {
+    const char *end = line + length;
+    const char *first = memchr(line, ',', length);
+    if (first == NULL) return;
+    const char *second = memchr(first + 1, ',', end - first - 1);
+    if (second == NULL) return;
+    const char *third = memchr(second + 1, ',', end - second - 1);
+    size_t weight_length = ((third == NULL) ? end : third) - (second + 1);
+    char weight[64];
+    if (weight_length == 0 || weight_length >= sizeof(weight)) return;
+    memcpy(weight, second + 1, weight_length);
+    weight[weight_length] = '\0';
+    char *parsed;
+    double log_weight = strtod(weight, &parsed);
+    if (parsed == weight) return;
+    add(t, line, second - line, first - line, log_weight);
+}
+
+static void *add_lines(void *argument) {
+    table *t = argument;
+    const char *line = t->begin;
+    while (line < t->end) {
+        const char *newline = memchr(line, '\n', t->end - line);
+        const char *line_end = (newline == NULL) ? t->end : newline;
+        add_line(t, line, line_end - line);
+        line = line_end + 1;
+    }
+    return NULL;
+}
+
+static void merge(table *into, table *from) {
+    entry *e, *tmp;
+    HASH_ITER(hh, from->entries, e, tmp) {
+        add(into, e->key, strlen(e->key), e->name_length, e->log_weight);
+        HASH_DEL(from->entries, e);
+        free(e->key);
+        free(e);
+    }
+}
+
+
+static void read_stream(table *t, FILE *stream) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stream)) > 0) {
+        if (line[length - 1] == '\n') length--;
+        add_line(t, line, length);
+    }
+    free(line);
+}
+
+static int read_binary(table *t, const char *path) {
+    sample_reader reader;
+    if (sample_reader_open(&reader, path) != 0) return -1;
+    char key[256];
+    for (long v=0; v<sample_reader_num_variables(&reader); v++) {
+        sample_column column = sample_reader_column(&reader, v);
+        for (long i=0; i<column.count; i++) {
+            int length = column.is_int
+                ? snprintf(key, sizeof(key), "%.*s,%ld", column.name_length, column.name, (long)column.values[i])
+                : snprintf(key, sizeof(key), "%.*s,%f", column.name_length, column.name, column.values[i]);
+            if (length >= (int)sizeof(key)) continue;
+            add(t, key, length, column.name_length, (column.log_weights != NULL) ? column.log_weights[i] : 0);
+        }
+    }
+    sample_reader_close(&reader);
+    return 0;
+}
+
+/**
+ * Split a text file at line boundaries between `num_threads` tables, parse
+ * them in parallel, and merge them into `t` in file order
+ *
+ */
+static int read_file(table *t, const char *path, int num_threads) {
+    int descriptor = open(path, O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0) {
+        perror(path);
+        return -1;
+    }
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(descriptor);
+        return 0;
+    }
+    if (size >= sizeof(SAMPLE_FILE_MAGIC) - 1) {
+        char magic[sizeof(SAMPLE_FILE_MAGIC) - 1];
+        if (pread(descriptor, magic, sizeof(magic), 0) == sizeof(magic) &&
+            memcmp(magic, SAMPLE_FILE_MAGIC, sizeof(magic)) == 0) {
+            close(descriptor);
+            return read_binary(t, path);
+        }
+    }
+    const char *data = mmap(NULL, size, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    table *parts = calloc(num_threads, sizeof(table));
+    const char *begin = data;
+    for (int i=0; i<num_threads; i++) {
+        const char *end = (i == num_threads - 1) ? data + size : data + size*(i + 1)/num_threads;
+        if (end < begin) end = begin;
+        const char *newline = memchr(end, '\n', data + size - end);
+        end = (newline == NULL) ? data + size : newline + 1;
+        parts[i].begin = begin;
+        parts[i].end = end;
+        begin = end;
+    }
+    for (int i=1; i<num_threads; i++) {
+        pthread_create(&parts[i].thread, NULL, add_lines, &parts[i]);
+    }
+    add_lines(&parts[0]);
+    merge(t, &parts[0]);
+    for (int i=1; i<num_threads; i++) {
+        pthread_join(parts[i].thread, NULL);
+        merge(t, &parts[i]);
+    }
+    free(parts);
+    munmap((void *)data, size);
+    return 0;
+}
+
+
+static void print_distributions(table *t) {
+    // Total weight per name
+    table totals = { 0 };
+    entry *e, *tmp, *total;
+    HASH_ITER(hh, t->entries, e, tmp) {
+        add(&totals, e->key, e->name_length, e->name_length, e->log_weight);
+    }
+    HASH_ITER(hh, t->entries, e, tmp) {
+        HASH_FIND(hh, totals.entries, e->key, e->name_length, total);
+        printf("%s,%f\n", e->key, exp(e->log_weight - total->log_weight));
+    }
+    HASH_ITER(hh, totals.entries, e, tmp) {
+        HASH_DEL(totals.entries, e);
+        free(e->key);
+        free(e);
+    }
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"threads", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int c, option_index;
+    while((c = getopt_long(argc, argv, "j:", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'j':
+                num_threads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j THREADS] [FILE ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (num_threads < 1) num_threads = 1;
+
+    table t = { 0 };
+    int status = 0;
+    if (optind == argc) {
+        read_stream(&t, stdin);
+    }
+    for (int a=optind; a<argc; a++) {
+        if (strcmp(argv[a], "-") == 0) {
+            read_stream(&t, stdin);
+        } else if (read_file(&t, argv[a], num_threads) != 0) {
+            status = 1;
+        }
+    }
+
+    static char output_buffer[1 << 16];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+    print_distributions(&t);
+    fflush(stdout);
+    return status;
+}
@@ -0,0 +1,86 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sample-reader.h"
+
+/**
+ *
+ * Dump a columnar sample file (--output_format=bin) back to the CSV stream
+ * format, `name,value[,log_weight,particle_id]`, grouped by variable.
+ *
+ * Usage: dump-samples [-l] FILE [NAME ...]
+ *   -l, --list   only list the variables: `name,type,count`
+ *   NAME ...     only dump these variables
+ *
+ */
+
+static void dump_column(const sample_column *column) {
+    for (long i=0; i<column->count; i++) {
+        if (column->is_int) {
+            printf("%.*s,%ld", column->name_length, column->name, (long)column->values[i]);
+        } else {
+            printf("%.*s,%f", column->name_length, column->name, column->values[i]);
+        }
+        if (column->log_weights != NULL) {
+            printf(",%f,%ld", column->log_weights[i], (long)column->ids[i]);
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"list", no_argument, 0, 'l'},
+        {0, 0, 0, 0}
+    };
+    bool list = false;
+    int c, option_index;
+    while((c = getopt_long(argc, argv, "l", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'l':
+                list = true;
+                break;
+            default:
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-l] FILE [NAME ...]\n", argv[0]);
+        return 2;
+    }
+
+    sample_reader reader;
+    if (sample_reader_open(&reader, argv[optind]) != 0) return 1;
+    static char output_buffer[1 << 16];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+    int status = 0;
+    if (list) {
+        for (long v=0; v<sample_reader_num_variables(&reader); v++) {
+            sample_column column = sample_reader_column(&reader, v);
+            printf("%.*s,%s,%ld\n", column.name_length, column.name, column.is_int ? "int" : "double", column.count);
+        }
+    } else if (optind + 1 == argc) {
+        for (long v=0; v<sample_reader_num_variables(&reader); v++) {
+            sample_column column = sample_reader_column(&reader, v);
+            dump_column(&column);
+        }
+    } else {
+        for (int a=optind+1; a<argc; a++) {
+            long v = sample_reader_find(&reader, argv[a]);
+            if (v < 0) {
+                fprintf(stderr, "%s: no variable %s\n", argv[optind], argv[a]);
+                status = 1;
+                continue;
+            }
+            sample_column column = sample_reader_column(&reader, v);
+            dump_column(&column);
+        }
+    }
+
+    fflush(stdout);
+    sample_reader_close(&reader);
+    return status;
+}
@@ -19,11 +19,18 @@ end
 
 println("Copy: $(round(mean(copy_mems)/ 1024 / 1024, 3)) MB")
 println("Replay: $(round(mean(replay_mems) / 1024 / 1024, 3)) MB")
-POSIX_mems = [
-  70644, 65256, 58024, 75200, 91472,
-  78816, 75208, 74296, 75200, 84240
-] # manual running result
-println("POSIX: $(round(mean(POSIX_mems) / 1024, 3)) MB")
+
+# POSIX forking: peak heap bytes live over all particle processes at once, from
+# the population memory profile of probc-mem (see exp1/probc-mem/memprofile.h)
+probc_mem = joinpath(dirname(@__FILE__), "..", "exp1", "probc-mem")
+run(pipeline(`make -C $probc_mem ENGINE=smc big-hmm`, stdout=DevNull, stderr=DevNull))
+POSIX_mems = []
+for _ = 1:10
+    run(pipeline(`$probc_mem/bin/big-hmm -p 100 --mem_profile=mem_profile.dat`, stdout=DevNull, stderr=DevNull))
+    profile = readstring("mem_profile.dat")
+    push!(POSIX_mems, parse(Int, match(r"^# peak (\d+)$"m, profile)[1]))
+end
+println("POSIX: $(round(mean(POSIX_mems) / 1024 / 1024, 3)) MB")
 
 # Results obtained on 29 Oct
 # Single core on my local macOS machine
@@ -49,12 +49,10 @@ for num_part = NUMPARTS
   ratios = Vector{Float64}()
 
   for _ = 1:BATCHSIZE
-    run(pipeline(`./bin/big-hmm -p $num_part`, stdout="total.txt", stderr=DevNull))
-    df = readtable("fork.csv", separator = ',', header = false)
-    fork = sum([df[1,i] for i = 1:(length(df[1,:])-1)])
-    df = readtable("total.txt", header = false)
-    total = df[1,1]
-    push!(ratios, fork / total)
+    run(pipeline(`./bin/big-hmm -p $num_part --profile=profile.json`, stdout=DevNull, stderr=DevNull))
+    # Share of fork() in the time particles spent working (not waiting at barriers)
+    profile = readstring("profile.json")
+    push!(ratios, parse(Float64, match(r"\"fork_ratio\":([0-9.]+)", profile)[1]))
   end
   POSIX_ratios[num_part] = ratios
 end